@@ -0,0 +1,136 @@
+/**
+ * Compares how the dictionary backends scale with the number of threads.
+ * The ngrams of a pcap file are made once, and then for each backend and
+ * thread count the time to count them (processTokens), to assign ids
+ * (finalize) and to translate them back (translate) is printed.
+ *
+ * dictionaryScaling --pcap file.pcap --ngram 2 --ngram 3 --threads 1 2 4 8
+ */
+
+#include <ParallelPcap/Pcap.hpp>
+#include <ParallelPcap/CountDictionary.hpp>
+#include <ParallelPcap/FlatCountDictionary.hpp>
+#include <ParallelPcap/Util.hpp>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+using namespace parallel_pcap;
+
+namespace {
+
+double secondsSince(std::chrono::high_resolution_clock::time_point t1)
+{
+  auto t2 = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1)
+    .count() / 1e6;
+}
+
+template <typename Dictionary>
+void timeDictionary(std::string const& name,
+                    std::vector<typename Dictionary::key_type> const& ngrams,
+                    size_t numThreads, size_t vocabSize)
+{
+  setGlobalNumThreads(numThreads);
+  Dictionary d(vocabSize);
+
+  auto t = std::chrono::high_resolution_clock::now();
+  d.processTokens(ngrams);
+  double countTime = secondsSince(t);
+
+  t = std::chrono::high_resolution_clock::now();
+  d.finalize();
+  double finalizeTime = secondsSince(t);
+
+  t = std::chrono::high_resolution_clock::now();
+  std::vector<size_t> ids = d.translate(ngrams);
+  double translateTime = secondsSince(t);
+
+  std::cout << std::setw(8) << name
+            << std::setw(9) << numThreads
+            << std::setw(12) << countTime
+            << std::setw(12) << finalizeTime
+            << std::setw(12) << translateTime
+            << std::setw(12) << d.getNumKeys() << std::endl;
+}
+
+template <typename KeyType>
+void compare(Pcap const& pcap, std::vector<size_t> const& ngramSizes,
+             std::vector<size_t> const& threadCounts, size_t vocabSize)
+{
+  typedef typename NgramTraits<KeyType>::Operator Operator;
+  typedef typename NgramTraits<KeyType>::HashFunction HashFunction;
+
+  std::vector<std::vector<KeyType>> ngramVector;
+  for (size_t n : ngramSizes) {
+    pcap.getPacketTable().applyOperator<Operator, std::vector<KeyType>>(
+      Operator(n), ngramVector);
+  }
+  std::vector<KeyType> ngrams = flatten(ngramVector);
+  ngramVector.clear();
+  std::cout << ngrams.size() << " ngrams" << std::endl;
+
+  std::cout << std::fixed << std::setprecision(3)
+            << std::setw(8) << "backend"
+            << std::setw(9) << "threads"
+            << std::setw(12) << "count (s)"
+            << std::setw(12) << "finalize"
+            << std::setw(12) << "translate"
+            << std::setw(12) << "keys" << std::endl;
+  for (size_t numThreads : threadCounts) {
+    timeDictionary<CountDictionary<KeyType, HashFunction>>(
+      "map", ngrams, numThreads, vocabSize);
+    timeDictionary<FlatCountDictionary<KeyType, HashFunction>>(
+      "flat", ngrams, numThreads, vocabSize);
+  }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  std::string pcapFile;
+  std::vector<size_t> ngramSizes;
+  std::vector<size_t> threadCounts;
+  size_t vocabSize;
+
+  po::options_description desc("Options");
+  desc.add_options()
+    ("help", "Print this message")
+    ("pcap", po::value<std::string>(&pcapFile)->required(), "The pcap file")
+    ("ngram", po::value<std::vector<size_t>>(&ngramSizes)->multitoken()
+      ->default_value(std::vector<size_t>{2}, "2"), "The ngram sizes")
+    ("threads", po::value<std::vector<size_t>>(&threadCounts)->multitoken()
+      ->default_value(std::vector<size_t>{1, 2, 4, 8}, "1 2 4 8"),
+      "The thread counts to time")
+    ("vocab", po::value<size_t>(&vocabSize)->default_value(50000),
+      "The vocabulary size")
+  ;
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+  } catch (po::error& e) {
+    std::cerr << e.what() << std::endl << desc << std::endl;
+    return 1;
+  }
+
+  Pcap pcap(pcapFile);
+  std::cout << pcap.getNumPackets() << " packets" << std::endl;
+
+  if (canPackNgrams(ngramSizes)) {
+    compare<uint64_t>(pcap, ngramSizes, threadCounts, vocabSize);
+  } else {
+    compare<std::string>(pcap, ngramSizes, threadCounts, vocabSize);
+  }
+  return 0;
+}
@@ -3,14 +3,18 @@
 
 #include <stdlib.h>
 #include <set>
+#include <unordered_set>
+#include <algorithm>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <map>
 #include <atomic>
+#include <chrono>
 #include <boost/python.hpp>
 #include <boost/serialization/serialization.hpp>
 #include <ParallelPcap/Util.hpp>
+#include <ParallelPcap/TranslationTable.hpp>
 
 #define DICTIONARY_SIZE_FACTOR 2.0 
 
@@ -45,6 +49,10 @@ private:
   /// An array of mutexes.  The array size is capacity.
   std::mutex* mutexes = 0;  
 
+  /// Time spent waiting for mutexes held by other threads since the last
+  /// count call started.
+  std::atomic<uint64_t> lockWaitNanos { 0 };
+
   /// Mapping from keys to how often the key occurs.  
   /// The array is of size capacity.
   std::vector<std::map<KeyType, size_t>> counts;
@@ -52,6 +60,10 @@ private:
   /// Mapping from keys to the assigned integer key.
   std::vector<std::map<KeyType, size_t>> word2Int;
 
+  /// The keys that getWord2Int() gives ids, made from word2Int when the
+  /// dictionary is finalized or loaded.
+  TranslationTable<KeyType, HF> translationTable;
+
   /// Used to indicate if data structures have been allocated
   bool initialized = false;
 
@@ -59,6 +71,7 @@ private:
   bool finalized = false;
 
 public:
+  typedef KeyType key_type;
 
   static const size_t UNK = 0;
 
@@ -103,11 +116,26 @@ public:
    */
   size_t getWord2Int(KeyType key) const;
 
+  /**
+   * Returns the keys that have ids and their ids, for writing a
+   * MappedDictionary.  Empty until finalized.
+   */
+  std::vector<std::pair<KeyType, size_t>> getVocabulary() const {
+    return translationTable.getEntries();
+  }
+
   /**
    * Returns the total number of keys found in the data.
    */
   size_t getNumKeys() const { return numKeys; }
 
+  /**
+   * Returns how long, summed over the threads, the last processTokens() or
+   * processPackets() call spent waiting for slot mutexes held by other
+   * threads.
+   */
+  double getLockWaitSeconds() const { return lockWaitNanos / 1e9; }
+
   /**
    * Creates the word2int mapping.
    * This should be called after all processTokens() calls have been completed.
@@ -117,12 +145,31 @@ public:
    */
   void finalize();
 
+  /**
+   * Adds the counts of another dictionary, such as the counts of a shard
+   * of the data made by another process and loaded from its archive.  The
+   * result is the same as if this dictionary had counted the keys of both.
+   * Neither dictionary may be finalized.
+   */
+  void merge(CountDictionary const& other);
+
   /**
    * Takes a vector of tokens and keeps track of the total count for each
    * unique token.
    */ 
   void processTokens(std::vector<KeyType> const& v);
 
+  /**
+   * Counts the ngrams of a set of packets like processTokens(), but without
+   * making a vector of all of them first: each thread ngrams its packets one
+   * at a time and adds the ngrams to the counts as it goes.
+   * \param packets The packets (a PacketTable or PacketStore).
+   * \param operators The ngram operators to apply to each packet.
+   */
+  template <typename Packets, typename Operator>
+  void processPackets(Packets const& packets,
+                      std::vector<Operator> const& operators);
+
   /**
    * Takes the vector of tokens and translates it into the integer 
    * representations.  Finalize must be called before this can be called.
@@ -143,6 +190,7 @@ public:
   template<class Archive>
   void serialize(Archive &ar, const unsigned int version) {
     ar &numKeys &vocabSize &capacity &counts &word2Int &initialized &finalized;
+    if (Archive::is_loading::value) buildTranslationTable();
   }
 
 
@@ -159,6 +207,31 @@ private:
    */
   size_t estimateCapacity( std::vector<KeyType> const& v );
 
+  /**
+   * Like estimateCapacity(), but estimates from the ngrams of a sample of
+   * the packets.  At most MAX_SAMPLE_PACKETS packets are ngrammed.
+   */
+  template <typename Packets, typename Operator>
+  size_t estimateCapacity(Packets const& packets,
+                          std::vector<Operator> const& operators);
+
+  static const size_t MAX_SAMPLE_PACKETS = 10000;
+
+  /**
+   * Makes translationTable from word2Int.
+   */
+  void buildTranslationTable();
+
+  /**
+   * Allocates the hash table with the given capacity.
+   */
+  void initialize(size_t capacity);
+
+  /**
+   * Adds count occurrences of the key to the counts.  Thread safe.
+   */
+  void addToken(KeyType const& key, size_t count = 1);
+
 };
 
 template <typename KeyType, typename HF>
@@ -169,9 +242,6 @@ finalize()
   size_t numThreads = globalNumThreads;
  
   DETAIL_TIMING_BEG
-  // Create an array of threads
-  std::thread* threads = new std::thread[numThreads];
-
   // Create a vector that will hold all the key/value pairs to be 
   // sorted.
   std::vector<std::pair<KeyType, size_t>> sortedKeys;
@@ -205,24 +275,21 @@ finalize()
     }
   };
  
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i] = std::thread(fillFunction, i);
-  }
-
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i].join();
-  }
+  parallelFor(numThreads, fillFunction);
   DETAIL_TIMING_END("CountDictionary::fillWord2Int time to fill sortedKeys: ")
 
   DETAIL_TIMING_BEG
-  auto sortbysec = [](std::pair<KeyType, size_t> const& a,
-                      std::pair<KeyType, size_t> const& b)
+  // Only the vocabSize most frequent keys get ids, so only those are
+  // sorted.  Ties go to the smaller key, which keeps the ids the same
+  // whatever the number of threads.
+  auto moreFrequent = [](std::pair<KeyType, size_t> const& a,
+                         std::pair<KeyType, size_t> const& b)
   {
-    return (a.second > b.second);
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
   };
 
-  std::sort(sortedKeys.begin(), sortedKeys.end(), sortbysec);
-  DETAIL_TIMING_END("CountDictionary::fillWord2Int time to sort sortedKeys: ")
+  sortedKeys = parallelTopK(sortedKeys, this->vocabSize, moreFrequent);
+  DETAIL_TIMING_END("CountDictionary::fillWord2Int time to select sortedKeys: ")
 
   DETAIL_TIMING_BEG
   auto assignIdFunction = [this, &sortedKeys, numThreads](size_t threadId)
@@ -239,13 +306,7 @@ finalize()
   };
 
 
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i] = std::thread(assignIdFunction, i);
-  }
-
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i].join();
-  }
+  parallelFor(numThreads, assignIdFunction);
   DETAIL_TIMING_END("CountDictionary::fillWord2Int time to assign ids: ")
 
   DETAIL_TIMING_BEG
@@ -265,18 +326,21 @@ finalize()
     }
   };
 
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i] = std::thread(fillWord2IntFunction, i);
-  }
-
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i].join();
-  }
+  parallelFor(numThreads, fillWord2IntFunction);
 
   DETAIL_TIMING_END("CountDictionary::fillWord2Int time to create word2int: ")
 
+  DETAIL_TIMING_BEG
+  size_t numItems = std::min(sortedKeys.size(), vocabSize);
+  std::vector<std::pair<KeyType, size_t>> entries;
+  for (size_t i = 0; i < numItems; i++) {
+    if (sortedKeys[i].second < vocabSize) entries.push_back(sortedKeys[i]);
+  }
+  translationTable.build(entries);
+  DETAIL_TIMING_END("CountDictionary::fillWord2Int time to build translation"
+    " table: ")
+
   finalized = true;
-  delete[] threads; 
 }
 
 template <typename KeyType, typename HF>
@@ -291,37 +355,34 @@ translate(std::vector<std::vector<KeyType>> const& v)
 
   DETAIL_TIMING_BEG
   size_t numThreads = globalNumThreads;
-  std::thread* threads = new std::thread[numThreads];
   std::vector<std::vector<size_t>> data;
   data.resize(v.size());
   DETAIL_TIMING_END("CountDictionary::translate time to resize data: ")
 
   DETAIL_TIMING_BEG
-  auto translateDataFunction = [this, &v, &data, numThreads](size_t threadId)
+  // The packets' numbers of ngrams vary a lot, so rather than a share of
+  // the packets each, the threads take chunks of about the same number of
+  // ngrams until there are none left.
+  ChunkSchedule schedule(v.size(), numThreads,
+    [&v](size_t i) -> uint64_t { return v[i].size(); });
+  auto translateDataFunction = [this, &v, &data, &schedule](size_t threadId)
   {
-    size_t beg = getBeginIndex(v.size(), threadId, numThreads);
-    size_t end = getEndIndex(v.size(), threadId, numThreads);
-
-    for(size_t i = beg; i < end; i++) {
-      data[i].resize(v[i].size());
-      for(size_t j = 0; j < v[i].size(); j++) {
-        data[i][j] = this->getWord2Int(v[i][j]);
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for(size_t i = beg; i < end; i++) {
+        data[i].resize(v[i].size());
+        for(size_t j = 0; j < v[i].size(); j++) {
+          data[i][j] = this->getWord2Int(v[i][j]);
+        }
       }
     }
   };
 
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i] = std::thread(translateDataFunction, i);
-  }
-
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i].join();
-  }
+  parallelFor(numThreads, translateDataFunction);
 
   DETAIL_TIMING_END("CountDictionary::translate time to translate data: ")
 
   finalized = true;
-  delete[] threads; 
   return data; 
 
 
@@ -340,7 +401,6 @@ translate(std::vector<KeyType> const& v)
  
   DETAIL_TIMING_BEG
   size_t numThreads = globalNumThreads;
-  std::thread* threads = new std::thread[numThreads];
   std::vector<size_t> data;
   data.resize(v.size());
   DETAIL_TIMING_END("CountDictionary::translate time to resize data: ")
@@ -356,18 +416,11 @@ translate(std::vector<KeyType> const& v)
     }
   };
 
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i] = std::thread(translateDataFunction, i);
-  }
-
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i].join();
-  }
+  parallelFor(numThreads, translateDataFunction);
 
   DETAIL_TIMING_END("CountDictionary::translate time to translate data: ")
 
   finalized = true;
-  delete[] threads; 
   return data; 
 }
 
@@ -386,6 +439,7 @@ CountDictionary(
     counts[i] = other.counts[i];
     word2Int[i] = other.word2Int[i];
   }
+  translationTable = other.translationTable;
 }
 
 template <typename KeyType, typename HF>
@@ -402,19 +456,12 @@ processTokens(std::vector<KeyType> const& v)
   if (!initialized) 
   {
     DETAIL_TIMING_BEG
-    this->capacity = estimateCapacity(v);
+    this->initialize(estimateCapacity(v));
     DETAIL_TIMING_END("CountDictionary::CountDictionary time to estimate: ")
-    mutexes = new std::mutex[capacity];
-    counts.resize(capacity);
-    word2Int.resize(capacity);
-
-    initialized = true;
   }
 
   size_t numThreads = globalNumThreads;
-
-  // Create an array of threads
-  std::thread* threads = new std::thread[numThreads];
+  lockWaitNanos = 0;
 
   DETAIL_TIMING_BEG
   // Function passed the threads
@@ -426,38 +473,130 @@ processTokens(std::vector<KeyType> const& v)
     size_t end = getEndIndex(size, threadId, numThreads);
 
     for (size_t i = beg; i < end; i++) {
-      KeyType key = v[i]; 
-
-      // Find the slot by hashing the key
-      size_t index = hash(key) % capacity;
-      
-      // Lock out the slot
-      mutexes[index].lock();
-      
-      if (counts[index].count(key) < 1) {
-        counts[index].insert(std::make_pair(key, 1));
-        numKeys.fetch_add(1);
-      } else {
-        counts[index][key] += 1;
-      }
-
-      // Done with lock
-      mutexes[index].unlock();     
+      this->addToken(v[i]);
     }
   };
   
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i] = std::thread(f, i);
+  parallelFor(numThreads, f);
+  DETAIL_TIMING_END("CountDictionary::CountDictionary Time to fill counts: ");
+}
+
+template <typename KeyType, typename HF>
+template <typename Packets, typename Operator>
+void
+CountDictionary<KeyType, HF>::
+processPackets(Packets const& packets, std::vector<Operator> const& operators)
+{
+  if (!initialized) 
+  {
+    DETAIL_TIMING_BEG
+    this->initialize(estimateCapacity(packets, operators));
+    DETAIL_TIMING_END("CountDictionary::processPackets time to estimate: ")
   }
 
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i].join();
+  size_t numThreads = globalNumThreads;
+  lockWaitNanos = 0;
+
+  DETAIL_TIMING_BEG
+  // The threads take chunks of about the same number of bytes of packets
+  // until there are none left (see PacketTable::applyOperator).
+  ChunkSchedule schedule(packets.size(), numThreads,
+    [&packets](size_t i) -> uint64_t {
+      return packets.getPacket(i).getIncludedLength();
+    });
+  auto f = [this, &packets, &operators, &schedule](size_t threadId)
+  {
+    // Only one packet's ngrams exist at a time.
+    std::vector<KeyType> ngrams;
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for (size_t i = beg; i < end; i++) {
+        ngrams.clear();
+        for (Operator const& op : operators) {
+          op(packets.getPacket(i), ngrams);
+        }
+        for (KeyType const& key : ngrams) {
+          this->addToken(key);
+        }
+      }
+    }
+  };
+
+  parallelFor(numThreads, f);
+  DETAIL_TIMING_END("CountDictionary::processPackets Time to fill counts: ");
+}
+
+template <typename KeyType, typename HF>
+void
+CountDictionary<KeyType, HF>::
+merge(CountDictionary const& other)
+{
+  if (finalized || other.finalized) {
+    throw CountDictionaryException("Tried to merge dictionaries but one of"
+      " them has been finalized.");
   }
-  DETAIL_TIMING_END("CountDictionary::CountDictionary Time to fill counts: ");
+  if (!other.initialized) return;
+  if (!initialized) this->initialize(other.capacity);
 
-  delete[] threads;
+  size_t numThreads = globalNumThreads;
 
+  DETAIL_TIMING_BEG
+  auto f = [this, &other, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(other.capacity, threadId, numThreads);
+    size_t end = getEndIndex(other.capacity, threadId, numThreads);
 
+    for (size_t i = beg; i < end; i++) {
+      for (auto const& count : other.counts[i]) {
+        this->addToken(count.first, count.second);
+      }
+    }
+  };
+
+  parallelFor(numThreads, f);
+  DETAIL_TIMING_END("CountDictionary::merge Time to add counts: ");
+}
+
+template <typename KeyType, typename HF>
+void
+CountDictionary<KeyType, HF>::
+initialize(size_t capacity)
+{
+  this->capacity = std::max<size_t>(1, capacity);
+  mutexes = new std::mutex[this->capacity];
+  counts.resize(this->capacity);
+  word2Int.resize(this->capacity);
+
+  initialized = true;
+}
+
+template <typename KeyType, typename HF>
+void
+CountDictionary<KeyType, HF>::
+addToken(KeyType const& key, size_t count)
+{
+  // Find the slot by hashing the key
+  size_t index = hash(key) % capacity;
+  
+  // Lock out the slot, timing the wait if another thread has it.
+  if (!mutexes[index].try_lock()) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    mutexes[index].lock();
+    auto t2 = std::chrono::high_resolution_clock::now();
+    lockWaitNanos.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count(),
+      std::memory_order_relaxed);
+  }
+  
+  if (counts[index].count(key) < 1) {
+    counts[index].insert(std::make_pair(key, count));
+    numKeys.fetch_add(1);
+  } else {
+    counts[index][key] += count;
+  }
+
+  // Done with lock
+  mutexes[index].unlock();     
 }
 
 template <typename KeyType, typename HF>
@@ -485,9 +624,6 @@ estimateCapacity( std::vector<KeyType> const& v )
   
   int numThreads = globalNumThreads;
 
-  // Create an array of threads
-  std::thread* threads = new std::thread[numThreads];
-  
   // Each array has its own mutex
   std::mutex* mutexes = new std::mutex[sampleSize];
 
@@ -525,15 +661,10 @@ estimateCapacity( std::vector<KeyType> const& v )
     }
   };
   
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i] = std::thread(f, i, std::ref(numUnique));
-  }
-
-  for(size_t i = 0; i < numThreads; i++) {
-    threads[i].join();
-  }
+  parallelFor(numThreads, [&f, &numUnique](size_t threadId) {
+    f(threadId, numUnique);
+  });
   
-  delete[] threads;
   delete[] sampleValues;
   delete[] mutexes;
 
@@ -542,6 +673,43 @@ estimateCapacity( std::vector<KeyType> const& v )
 
 }
 
+template <typename KeyType, typename HF>
+template <typename Packets, typename Operator>
+size_t
+CountDictionary<KeyType, HF>::
+estimateCapacity(Packets const& packets, std::vector<Operator> const& operators)
+{
+  // Like estimateCapacity(v), sample about 5% of the data, but whole packets
+  // at a time, and no more than MAX_SAMPLE_PACKETS of them.
+  size_t numPackets = packets.size();
+  if (numPackets == 0) return 1;
+  size_t stride = std::max<size_t>(20, numPackets / MAX_SAMPLE_PACKETS);
+
+  std::unordered_set<KeyType> sampleValues;
+  std::vector<KeyType> ngrams;
+  size_t numSampled = 0;
+  for (size_t i = 0; i < numPackets; i += stride) {
+    ngrams.clear();
+    for (Operator const& op : operators) {
+      op(packets.getPacket(i), ngrams);
+    }
+    sampleValues.insert(ngrams.begin(), ngrams.end());
+    numSampled++;
+  }
+
+  // There can't be more keys than ngrams, and a packet has fewer ngrams of
+  // each size than bytes.
+  size_t maxKeys = 0;
+  for (size_t i = 0; i < numPackets; i++) {
+    maxKeys += packets.getIncludedLength(i) * operators.size();
+  }
+
+  double samplePercent = static_cast<double>(numSampled) / numPackets;
+  size_t numUnique = std::min<size_t>(maxKeys, 
+    static_cast<size_t>(sampleValues.size() / samplePercent));
+  return DICTIONARY_SIZE_FACTOR * numUnique;
+}
+
 template <typename KeyType, typename HF>
 size_t
 CountDictionary<KeyType, HF>::
@@ -559,14 +727,22 @@ size_t
 CountDictionary<KeyType, HF>::
 getWord2Int(KeyType key) const
 {
-  size_t index = hash(key) % capacity;
-  if (word2Int[index].count(key) > 0) {
-    size_t id = word2Int[index].at(key);
-    if (id < vocabSize) {
-      return word2Int[index].at(key);
+  return translationTable.lookup(key);
+}
+
+template <typename KeyType, typename HF>
+void
+CountDictionary<KeyType, HF>::
+buildTranslationTable()
+{
+  // Like the rest of the dictionary, only ids below vocabSize are used.
+  std::vector<std::pair<KeyType, size_t>> entries;
+  for (auto const& bucket : word2Int) {
+    for (auto const& id : bucket) {
+      if (id.second < vocabSize) entries.push_back(id);
     }
   }
-  return UNK;
+  translationTable.build(entries);
 }
 }
 #endif
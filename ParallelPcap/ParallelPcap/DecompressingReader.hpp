@@ -0,0 +1,495 @@
+#ifndef PARALLELPCAP_DECOMPRESSING_READER_HPP
+#define PARALLELPCAP_DECOMPRESSING_READER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <fstream>
+#include <memory>
+#include <cstring>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+#include <ParallelPcap/MappedFile.hpp>
+#include <ParallelPcap/Util.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The exception type generated by the DecompressingReader class.
+ */
+class DecompressingReaderException : public std::runtime_error {
+public:
+  DecompressingReaderException(char const* message)
+    : std::runtime_error(message) {}
+  DecompressingReaderException(std::string message)
+    : std::runtime_error(message) {}
+};
+
+/**
+ * How a capture file is compressed.
+ */
+enum class Compression { None, Gzip, Zstd };
+
+namespace details {
+
+/// zstd frames start with this (little endian) magic number.
+const uint32_t ZSTD_FRAME_MAGIC = 0xFD2FB528;
+
+/// Skippable frames have a magic number of 0x184D2A5?.
+const uint32_t ZSTD_SKIPPABLE_MAGIC = 0x184D2A50;
+const uint32_t ZSTD_SKIPPABLE_MASK  = 0xFFFFFFF0;
+
+inline uint32_t readLittleEndian32(unsigned char const* data)
+{
+  return static_cast<uint32_t>(data[0]) |
+         static_cast<uint32_t>(data[1]) << 8 |
+         static_cast<uint32_t>(data[2]) << 16 |
+         static_cast<uint32_t>(data[3]) << 24;
+}
+
+/**
+ * Looks at the magic bytes at the start of a file to see how it is
+ * compressed.
+ * \param data The start of the file.
+ * \param numBytes How many bytes of data there are.
+ */
+inline Compression detectCompression(unsigned char const* data,
+                                     uint64_t numBytes)
+{
+  if (numBytes >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+    return Compression::Gzip;
+  }
+  if (numBytes >= 4) {
+    uint32_t magic = readLittleEndian32(data);
+    if (magic == ZSTD_FRAME_MAGIC ||
+        (magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC)
+    {
+      return Compression::Zstd;
+    }
+  }
+  return Compression::None;
+}
+
+/**
+ * Finds the zstd frames in a file by walking the frame and block headers,
+ * without decompressing anything.  Skippable frames are left out.
+ * \param data The zstd file contents.
+ * \param numBytes The size of the file.
+ * \return Returns the (offset, length) of each frame.
+ */
+inline std::vector<std::pair<uint64_t, uint64_t>>
+findZstdFrames(unsigned char const* data, uint64_t numBytes)
+{
+  std::vector<std::pair<uint64_t, uint64_t>> frames;
+  uint64_t index = 0;
+  while (index < numBytes) {
+    if (index + 8 > numBytes) {
+      throw DecompressingReaderException("findZstdFrames: truncated frame");
+    }
+    uint32_t magic = readLittleEndian32(&data[index]);
+
+    if ((magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC) {
+      index += 8 + static_cast<uint64_t>(readLittleEndian32(&data[index + 4]));
+      continue;
+    }
+    if (magic != ZSTD_FRAME_MAGIC) {
+      throw DecompressingReaderException("findZstdFrames: bad frame magic"
+        " number at byte " + std::to_string(index));
+    }
+
+    // Frame header: descriptor, then optional window descriptor,
+    // dictionary id and frame content size fields.
+    unsigned char descriptor = data[index + 4];
+    unsigned contentSizeFlag = descriptor >> 6;
+    bool singleSegment = (descriptor >> 5) & 1;
+    bool checksum = (descriptor >> 2) & 1;
+    unsigned dictionaryIdFlag = descriptor & 3;
+
+    static const unsigned dictionaryIdSizes[] = {0, 1, 2, 4};
+    static const unsigned contentSizeSizes[] = {0, 2, 4, 8};
+    unsigned contentSizeSize = contentSizeSizes[contentSizeFlag];
+    if (contentSizeFlag == 0 && singleSegment) contentSizeSize = 1;
+
+    uint64_t blockIndex = index + 5 + (singleSegment ? 0 : 1) +
+      dictionaryIdSizes[dictionaryIdFlag] + contentSizeSize;
+
+    // Blocks: a 3 byte header with a last block flag, the block type and
+    // the block size.
+    bool last = false;
+    while (!last) {
+      if (blockIndex + 3 > numBytes) {
+        throw DecompressingReaderException("findZstdFrames: truncated"
+          " frame");
+      }
+      uint32_t header = static_cast<uint32_t>(data[blockIndex]) |
+                        static_cast<uint32_t>(data[blockIndex + 1]) << 8 |
+                        static_cast<uint32_t>(data[blockIndex + 2]) << 16;
+      last = header & 1;
+      unsigned type = (header >> 1) & 3;
+      uint32_t size = header >> 3;
+      if (type == 3) {
+        throw DecompressingReaderException("findZstdFrames: reserved block"
+          " type");
+      }
+      // RLE blocks store the byte once.
+      blockIndex += 3 + (type == 1 ? 1 : size);
+    }
+    if (checksum) blockIndex += 4;
+    if (blockIndex > numBytes) {
+      throw DecompressingReaderException("findZstdFrames: truncated frame");
+    }
+
+    frames.push_back(std::make_pair(index, blockIndex - index));
+    index = blockIndex;
+  }
+  return frames;
+}
+
+}
+
+/**
+ * Reads a capture file front to back, decompressing it on the fly if it is
+ * gzip or zstd compressed (detected by the magic bytes, not the file
+ * name).  Nothing is staged on disk.
+ *
+ * Decompression runs in background threads ahead of the reader, into a
+ * bounded number of chunks, so that it overlaps with whatever the reader
+ * does with the data.  Zstd files with several frames are decompressed one
+ * frame per thread; a gzip file or a single zstd frame is decompressed by
+ * one thread.  Either way the output is cut into chunks of at most
+ * CHUNK_SIZE bytes, so a large frame is never held whole.  Uncompressed
+ * files are read directly.
+ */
+class DecompressingReader
+{
+private:
+  Compression compression = Compression::None;
+
+  /// Used for uncompressed files.
+  std::ifstream file;
+
+  /// Size of the file on disk.
+  uint64_t fileBytes = 0;
+
+  /// Total bytes returned by read() so far.
+  uint64_t numBytesRead = 0;
+
+  /**
+   * A piece of the decompressed data.  Chunks are numbered by the frame
+   * they come from (0 for a single stream) and their piece of the frame.
+   */
+  struct Chunk
+  {
+    std::vector<unsigned char> data;
+
+    /// True for the last piece of the frame.
+    bool last = false;
+  };
+  typedef std::pair<size_t, size_t> ChunkId;
+
+  /// The decompressed chunks that are ready, by frame and piece.
+  std::map<ChunkId, Chunk> ready;
+
+  /// The chunk being handed out by read() and how much of it has been.
+  std::vector<unsigned char> current;
+  size_t currentPos = 0;
+
+  /// The next chunk read() needs.
+  ChunkId nextChunk = ChunkId(0, 0);
+
+  /// How many producer threads haven't finished.
+  size_t numProducersRunning = 0;
+
+  /// At most this many chunks wait for the reader, apart from the one it
+  /// needs next.
+  size_t maxChunksAhead = 0;
+
+  /// Set if a producer failed.  Rethrown by read().
+  std::exception_ptr error;
+
+  bool stopping = false;
+
+  std::mutex mutex;
+  std::condition_variable chunkReady;
+  std::condition_variable chunkConsumed;
+
+  std::vector<std::thread> producers;
+
+  /// The compressed file, mapped for the zstd frame threads.
+  std::unique_ptr<MappedFile> mapped;
+  std::vector<std::pair<uint64_t, uint64_t>> frames;
+  size_t nextFrame = 0;
+
+public:
+  /// Size of the chunks a single stream is decompressed into.
+  static const size_t CHUNK_SIZE = 1 << 22;
+
+  /**
+   * Opens the file and starts decompressing it if it is compressed.
+   * \param filename The path to the file.
+   * \param numThreads How many threads may decompress zstd frames at once.
+   */
+  DecompressingReader(std::string const& filename,
+                      size_t numThreads = globalNumThreads);
+  ~DecompressingReader();
+
+  DecompressingReader(DecompressingReader const& other) = delete;
+  DecompressingReader& operator=(DecompressingReader const& other) = delete;
+
+  /**
+   * Reads up to numBytes bytes of (decompressed) data.  Blocks until data
+   * is available.
+   * \return Returns how many bytes were read.  Less than numBytes only at
+   *         the end of the file.
+   */
+  uint64_t read(unsigned char* buffer, uint64_t numBytes);
+
+  Compression getCompression() const { return compression; }
+  bool isCompressed() const { return compression != Compression::None; }
+
+  /// The size of the file on disk.
+  uint64_t getFileBytes() const { return fileBytes; }
+
+  /// How many bytes read() has returned so far.
+  uint64_t getNumBytesRead() const { return numBytesRead; }
+
+  /**
+   * Returns true if the file is a compressed capture.
+   * \param filename The path to the file.
+   */
+  static bool isCompressedFile(std::string const& filename);
+
+private:
+  /// Decompresses a gzip file or single zstd stream in chunks.
+  void produceStream(std::string filename);
+
+  /// Decompresses zstd frames, one at a time, until there are none left.
+  void produceFrames();
+
+  /// Hands a chunk to the reader, waiting if the reader is too far behind.
+  /// Returns false if the reader is going away.
+  bool post(ChunkId id, Chunk&& chunk);
+
+  /// Reads the next piece of a stream into a chunk, marking it last at the
+  /// end of the stream.
+  static Chunk readChunk(std::istream& in);
+
+  /// Called by a producer when it is done or failed.
+  void finishProducing(std::exception_ptr e);
+};
+
+inline bool DecompressingReader::isCompressedFile(std::string const& filename)
+{
+  std::ifstream in(filename, std::ios::binary);
+  unsigned char magic[4];
+  in.read(reinterpret_cast<char*>(magic), 4);
+  return details::detectCompression(magic, in.gcount()) != Compression::None;
+}
+
+inline DecompressingReader::DecompressingReader(std::string const& filename,
+                                                size_t numThreads)
+{
+  file.open(filename, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    throw DecompressingReaderException("Could not open file " + filename);
+  }
+  fileBytes = file.tellg();
+  file.seekg(0, std::ios::beg);
+
+  unsigned char magic[4];
+  file.read(reinterpret_cast<char*>(magic), 4);
+  compression = details::detectCompression(magic, file.gcount());
+  file.clear();
+  file.seekg(0, std::ios::beg);
+
+  if (compression == Compression::None) return;
+  file.close();
+  if (numThreads < 1) numThreads = 1;
+
+  if (compression == Compression::Zstd) {
+    mapped.reset(new MappedFile(filename));
+    mapped->adviseSequential();
+    frames = details::findZstdFrames(mapped->getData(), mapped->getSize());
+  }
+
+  if (compression == Compression::Zstd && frames.size() > 1 &&
+      numThreads > 1)
+  {
+    if (numThreads > frames.size()) numThreads = frames.size();
+    maxChunksAhead = 2 * numThreads;
+    numProducersRunning = numThreads;
+    for (size_t i = 0; i < numThreads; i++) {
+      producers.push_back(std::thread(&DecompressingReader::produceFrames,
+                                      this));
+    }
+  } else {
+    maxChunksAhead = 4;
+    numProducersRunning = 1;
+    producers.push_back(std::thread(&DecompressingReader::produceStream,
+                                    this, filename));
+  }
+}
+
+inline DecompressingReader::~DecompressingReader()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  chunkConsumed.notify_all();
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+}
+
+inline bool DecompressingReader::post(ChunkId id, Chunk&& chunk)
+{
+  // The chunk the reader needs next is always taken, so the producer of
+  // the reader's frame can't be blocked by chunks of later frames.
+  std::unique_lock<std::mutex> lock(mutex);
+  chunkConsumed.wait(lock, [this, id] {
+    return stopping || ready.size() < maxChunksAhead || id == nextChunk;
+  });
+  if (stopping) return false;
+  ready[id] = std::move(chunk);
+  chunkReady.notify_all();
+  return true;
+}
+
+inline DecompressingReader::Chunk 
+DecompressingReader::readChunk(std::istream& in)
+{
+  Chunk chunk;
+  chunk.data.resize(CHUNK_SIZE);
+  in.read(reinterpret_cast<char*>(chunk.data.data()), CHUNK_SIZE);
+  chunk.data.resize(in.gcount());
+  chunk.last = !in;
+  return chunk;
+}
+
+inline void DecompressingReader::finishProducing(std::exception_ptr e)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (e && !error) error = e;
+  numProducersRunning--;
+  chunkReady.notify_all();
+}
+
+inline void DecompressingReader::produceStream(std::string filename)
+{
+  namespace io = boost::iostreams;
+  size_t piece = 0;
+  try {
+    io::filtering_istream in;
+    if (compression == Compression::Gzip) {
+      in.push(io::gzip_decompressor());
+      in.push(io::file_source(filename, std::ios::binary));
+    } else {
+      in.push(io::zstd_decompressor());
+      in.push(io::array_source(
+        reinterpret_cast<char const*>(mapped->getData()), mapped->getSize()));
+    }
+
+    while (true) {
+      Chunk chunk = readChunk(in);
+      bool last = chunk.last;
+      if (!this->post(ChunkId(0, piece++), std::move(chunk))) break;
+      if (last) break;
+    }
+  } catch (...) {
+    this->finishProducing(std::current_exception());
+    return;
+  }
+  this->finishProducing(std::exception_ptr());
+}
+
+inline void DecompressingReader::produceFrames()
+{
+  namespace io = boost::iostreams;
+  try {
+    while (true) {
+      size_t frameId;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || nextFrame >= frames.size()) break;
+        frameId = nextFrame++;
+      }
+
+      io::filtering_istream in;
+      in.push(io::zstd_decompressor());
+      in.push(io::array_source(
+        reinterpret_cast<char const*>(mapped->getData()) +
+          frames[frameId].first, frames[frameId].second));
+
+      bool posted = true;
+      for (size_t piece = 0; posted; piece++) {
+        Chunk chunk = readChunk(in);
+        bool last = chunk.last;
+        posted = this->post(ChunkId(frameId, piece), std::move(chunk));
+        if (last) break;
+      }
+      if (!posted) break;
+    }
+  } catch (...) {
+    this->finishProducing(std::current_exception());
+    return;
+  }
+  this->finishProducing(std::exception_ptr());
+}
+
+inline uint64_t DecompressingReader::read(unsigned char* buffer,
+                                          uint64_t numBytes)
+{
+  if (compression == Compression::None) {
+    file.read(reinterpret_cast<char*>(buffer), numBytes);
+    uint64_t count = file.gcount();
+    numBytesRead += count;
+    return count;
+  }
+
+  uint64_t count = 0;
+  while (count < numBytes) {
+    if (currentPos == current.size()) {
+      // Wait for the next chunk.  Every piece of every frame is posted, so
+      // once every producer is done a missing chunk means the end.
+      std::unique_lock<std::mutex> lock(mutex);
+      chunkReady.wait(lock, [this] {
+        return error || ready.count(nextChunk) > 0 || 
+               numProducersRunning == 0;
+      });
+      if (error) std::rethrow_exception(error);
+      auto it = ready.find(nextChunk);
+      if (it == ready.end()) break;
+      current = std::move(it->second.data);
+      if (it->second.last) {
+        nextChunk = ChunkId(nextChunk.first + 1, 0);
+      } else {
+        nextChunk.second++;
+      }
+      ready.erase(it);
+      currentPos = 0;
+      chunkConsumed.notify_all();
+      continue;
+    }
+
+    uint64_t n = std::min<uint64_t>(numBytes - count,
+                                    current.size() - currentPos);
+    std::memcpy(buffer + count, current.data() + currentPos, n);
+    currentPos += n;
+    count += n;
+  }
+  numBytesRead += count;
+  return count;
+}
+
+}
+
+#endif
@@ -0,0 +1,525 @@
+#ifndef PARALLELPCAP_DENSE_COUNT_DICTIONARY_HPP
+#define PARALLELPCAP_DENSE_COUNT_DICTIONARY_HPP
+
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <boost/serialization/serialization.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/vector.hpp>
+#include <ParallelPcap/Util.hpp>
+#include <ParallelPcap/CountDictionary.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * A CountDictionary for packed ngram keys (see PackedNgramOperator) of at
+ * most MaxNgramSize bytes.  There are only 256^MaxNgramSize such keys, so
+ * instead of hashing, the counts live in a flat array indexed by the key.
+ * Each counting thread has its own array, so counting takes no locks; the
+ * thread arrays are added into the totals before the totals are needed
+ * (or before a thread array could overflow).  Packets can also be counted
+ * without making a vector of all of their ngrams (see processPackets()).
+ *
+ * The interface and semantics match CountDictionary: the vocabSize most
+ * frequent keys get ids 1, 2, ... (ties go to the smaller key), and
+ * everything else is UNK.  The dictionary is saved in the same archive
+ * layout as CountDictionary<uint64_t, PackedNgramHashFunction>, so either
+ * can load what the other saved.
+ */
+template <size_t MaxNgramSize>
+class DenseCountDictionary
+{
+  static_assert(MaxNgramSize >= 1 && MaxNgramSize <= 3,
+                "DenseCountDictionary is only for ngrams of up to 3 bytes");
+
+public:
+  typedef uint64_t key_type;
+
+  static const size_t UNK = 0;
+
+  /// The number of possible keys.
+  static const size_t NUM_KEYS = size_t(1) << (8 * MaxNgramSize);
+
+  /// The thread arrays of all of the counting threads together take at
+  /// most this many bytes.  Fewer threads count when they would take more.
+  static const size_t MAX_THREAD_COUNT_BYTES = size_t(1) << 30;
+
+  /// A thread array is flushed once its thread has counted this many keys,
+  /// so that none of its counts can overflow.
+  static const uint64_t MAX_THREAD_COUNT = 
+    std::numeric_limits<uint32_t>::max();
+
+  /**
+   * \param vocabSize Only the vocabSize most frequent keys get an id.
+   */
+  DenseCountDictionary(size_t vocabSize) : vocabSize(vocabSize) {}
+
+  /**
+   * Returns how often the key occurred.
+   */
+  size_t getCount(uint64_t key) const;
+
+  /**
+   * Returns the id of the key, or UNK if the key doesn't have one.
+   */
+  size_t getWord2Int(uint64_t key) const {
+    return key < ids.size() ? ids[key] : UNK;
+  }
+
+  /**
+   * Returns the keys that have ids and their ids, for writing a
+   * MappedDictionary.  Empty until finalized.
+   */
+  std::vector<std::pair<uint64_t, size_t>> getVocabulary() const {
+    std::vector<std::pair<uint64_t, size_t>> vocabulary;
+    for (uint64_t key = 0; key < ids.size(); key++) {
+      if (ids[key] != UNK) vocabulary.push_back(std::make_pair(key, ids[key]));
+    }
+    return vocabulary;
+  }
+
+  /**
+   * Returns the number of distinct keys found in the data.  Only up to date
+   * after finalize().
+   */
+  size_t getNumKeys() const { return numKeys; }
+
+  /**
+   * Returns how long, summed over the threads, the last processTokens() or
+   * processPackets() call spent waiting for other threads to flush their
+   * arrays into the totals.
+   */
+  double getLockWaitSeconds() const { return lockWaitNanos / 1e9; }
+
+  /**
+   * Adds the keys to the counts.
+   */
+  void processTokens(std::vector<uint64_t> const& v);
+
+  /**
+   * Counts the ngrams of a set of packets without making a vector of all of
+   * them first: each thread ngrams its packets one at a time and adds the
+   * ngrams to its counts as it goes.
+   * \param packets The packets (a PacketTable or PacketStore).
+   * \param operators The ngram operators to apply to each packet.
+   */
+  template <typename Packets, typename Operator>
+  void processPackets(Packets const& packets,
+                      std::vector<Operator> const& operators);
+
+  /**
+   * Assigns the ids.  Call once all of the keys have been processed.
+   */
+  void finalize();
+
+  /**
+   * Adds the counts of another dictionary, such as the counts of a shard
+   * of the data made by another process and loaded from its archive.  The
+   * result is the same as if this dictionary had counted the keys of both.
+   * Neither dictionary may be finalized.
+   */
+  void merge(DenseCountDictionary const& other);
+
+  /**
+   * Translates keys to ids.  finalize() must have been called.
+   */
+  std::vector<size_t> translate(std::vector<uint64_t> const& v);
+
+  std::vector<std::vector<size_t>>
+  translate(std::vector<std::vector<uint64_t>> const& v);
+
+private:
+  size_t vocabSize;
+
+  /// Number of distinct keys.
+  size_t numKeys = 0;
+
+  /// The count of each key.  Doesn't include what is still in the thread
+  /// arrays.
+  std::vector<uint64_t> totals;
+
+  /// The counts of each counting thread since they were last added to the
+  /// totals, and how many keys each thread has counted since then.
+  std::vector<std::vector<uint32_t>> threadCounts;
+  std::vector<uint64_t> threadNumCounted;
+
+  /// Guards the totals while counting threads flush into them.
+  std::mutex totalsMutex;
+
+  /// Time spent waiting for totalsMutex since the last count call started.
+  std::atomic<uint64_t> lockWaitNanos { 0 };
+
+  /// The id of each key (UNK for keys without one).  Empty until finalized.
+  std::vector<uint32_t> ids;
+
+  bool finalized = false;
+
+  /**
+   * Adds the thread arrays into the totals and zeroes them.
+   */
+  void reduce();
+
+  /**
+   * Makes sure there is a thread array for each counting thread.  Returns
+   * the number of counting threads.
+   */
+  size_t prepareThreadCounts();
+
+  /**
+   * Adds one thread's array into the totals and zeroes it.  Called by a
+   * counting thread before its array could overflow.
+   */
+  void flush(size_t threadId);
+
+  /**
+   * The number of threads that count, given the memory their arrays take.
+   */
+  static size_t numCountingThreads() {
+    size_t maxThreads = MAX_THREAD_COUNT_BYTES / (NUM_KEYS * sizeof(uint32_t));
+    return std::max<size_t>(1, std::min(getLoopThreads(), maxThreads));
+  }
+
+  // Serialization, in the layout of CountDictionary.
+  friend class boost::serialization::access;
+
+  template<class Archive>
+  void save(Archive &ar, const unsigned int version) const;
+
+  template<class Archive>
+  void load(Archive &ar, const unsigned int version);
+
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
+template <size_t MaxNgramSize>
+size_t DenseCountDictionary<MaxNgramSize>::getCount(uint64_t key) const
+{
+  if (key >= NUM_KEYS) return 0;
+  uint64_t count = totals.empty() ? 0 : totals[key];
+  for (std::vector<uint32_t> const& counts : threadCounts) {
+    count += counts[key];
+  }
+  return count;
+}
+
+template <size_t MaxNgramSize>
+void DenseCountDictionary<MaxNgramSize>::processTokens(
+  std::vector<uint64_t> const& v)
+{
+  size_t numThreads = prepareThreadCounts();
+
+  std::atomic<bool> outOfRange(false);
+  auto countFunction = [this, &v, &outOfRange, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(v.size(), threadId, numThreads);
+    size_t end = getEndIndex(v.size(), threadId, numThreads);
+
+    uint32_t* counts = this->threadCounts[threadId].data();
+    uint64_t& numCounted = this->threadNumCounted[threadId];
+    for (size_t i = beg; i < end; i++) {
+      if (v[i] >= NUM_KEYS) {
+        outOfRange = true;
+        return;
+      }
+      if (numCounted == MAX_THREAD_COUNT) this->flush(threadId);
+      counts[v[i]]++;
+      numCounted++;
+    }
+  };
+  parallelFor(numThreads, countFunction);
+
+  if (outOfRange) {
+    throw CountDictionaryException("DenseCountDictionary: got a key of more"
+      " than " + std::to_string(MaxNgramSize) + " bytes");
+  }
+}
+
+template <size_t MaxNgramSize>
+template <typename Packets, typename Operator>
+void DenseCountDictionary<MaxNgramSize>::processPackets(
+  Packets const& packets, std::vector<Operator> const& operators)
+{
+  size_t numThreads = prepareThreadCounts();
+
+  // Chunks of about the same number of bytes, taken as the threads go.
+  ChunkSchedule schedule(packets.size(), numThreads,
+    [&packets](size_t i) -> uint64_t {
+      return packets.getPacket(i).getIncludedLength();
+    });
+
+  std::atomic<bool> outOfRange(false);
+  auto countFunction = [this, &packets, &operators, &outOfRange, 
+                        &schedule](size_t threadId)
+  {
+    // Only one packet's ngrams exist at a time.
+    uint32_t* counts = this->threadCounts[threadId].data();
+    uint64_t& numCounted = this->threadNumCounted[threadId];
+    std::vector<uint64_t> ngrams;
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for (size_t i = beg; i < end; i++) {
+        ngrams.clear();
+        for (Operator const& op : operators) {
+          op(packets.getPacket(i), ngrams);
+        }
+        for (uint64_t key : ngrams) {
+          if (key >= NUM_KEYS) {
+            outOfRange = true;
+            return;
+          }
+          if (numCounted == MAX_THREAD_COUNT) this->flush(threadId);
+          counts[key]++;
+          numCounted++;
+        }
+      }
+    }
+  };
+  parallelFor(numThreads, countFunction);
+
+  if (outOfRange) {
+    throw CountDictionaryException("DenseCountDictionary: got a key of more"
+      " than " + std::to_string(MaxNgramSize) + " bytes");
+  }
+}
+
+template <size_t MaxNgramSize>
+size_t DenseCountDictionary<MaxNgramSize>::prepareThreadCounts()
+{
+  size_t numThreads = numCountingThreads();
+  if (threadCounts.size() != numThreads) {
+    reduce();
+    threadCounts.assign(numThreads, std::vector<uint32_t>(NUM_KEYS, 0));
+    threadNumCounted.assign(numThreads, 0);
+  }
+  if (totals.empty()) totals.assign(NUM_KEYS, 0);
+  lockWaitNanos = 0;
+  return numThreads;
+}
+
+template <size_t MaxNgramSize>
+void DenseCountDictionary<MaxNgramSize>::flush(size_t threadId)
+{
+  std::unique_lock<std::mutex> lock(totalsMutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    lock.lock();
+    auto t2 = std::chrono::high_resolution_clock::now();
+    lockWaitNanos.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count(),
+      std::memory_order_relaxed);
+  }
+  std::vector<uint32_t>& counts = threadCounts[threadId];
+  for (size_t key = 0; key < NUM_KEYS; key++) {
+    totals[key] += counts[key];
+    counts[key] = 0;
+  }
+  threadNumCounted[threadId] = 0;
+}
+
+template <size_t MaxNgramSize>
+void DenseCountDictionary<MaxNgramSize>::reduce()
+{
+  if (threadCounts.empty()) return;
+  if (totals.empty()) totals.assign(NUM_KEYS, 0);
+
+  // Each thread adds up a slice of the keys across all the thread arrays.
+  size_t numThreads = globalNumThreads;
+  auto reduceFunction = [this, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(NUM_KEYS, threadId, numThreads);
+    size_t end = getEndIndex(NUM_KEYS, threadId, numThreads);
+
+    for (std::vector<uint32_t>& counts : this->threadCounts) {
+      for (size_t key = beg; key < end; key++) {
+        this->totals[key] += counts[key];
+        counts[key] = 0;
+      }
+    }
+  };
+  parallelFor(numThreads, reduceFunction);
+
+  std::fill(threadNumCounted.begin(), threadNumCounted.end(), 0);
+}
+
+template <size_t MaxNgramSize>
+void DenseCountDictionary<MaxNgramSize>::merge(
+  DenseCountDictionary const& other)
+{
+  if (finalized || other.finalized) {
+    throw CountDictionaryException("Tried to merge dictionaries but one of"
+      " them has been finalized.");
+  }
+  if (totals.empty()) totals.assign(NUM_KEYS, 0);
+
+  size_t numThreads = globalNumThreads;
+  auto mergeFunction = [this, &other, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(NUM_KEYS, threadId, numThreads);
+    size_t end = getEndIndex(NUM_KEYS, threadId, numThreads);
+
+    for (size_t key = beg; key < end; key++) {
+      this->totals[key] += other.getCount(key);
+    }
+  };
+  parallelFor(numThreads, mergeFunction);
+}
+
+template <size_t MaxNgramSize>
+void DenseCountDictionary<MaxNgramSize>::finalize()
+{
+  reduce();
+  threadCounts.clear();
+  threadNumCounted.clear();
+  if (totals.empty()) totals.assign(NUM_KEYS, 0);
+
+  std::vector<uint64_t> keys;
+  for (uint64_t key = 0; key < NUM_KEYS; key++) {
+    if (totals[key] > 0) keys.push_back(key);
+  }
+  numKeys = keys.size();
+
+  // Only the first vocabSize keys get ids, so only those need sorting.
+  auto moreFrequent = [this](uint64_t a, uint64_t b) {
+    return this->totals[a] > this->totals[b] ||
+           (this->totals[a] == this->totals[b] && a < b);
+  };
+  size_t numItems = std::min(keys.size(), vocabSize);
+  std::nth_element(keys.begin(), keys.begin() + numItems, keys.end(),
+                   moreFrequent);
+  std::sort(keys.begin(), keys.begin() + numItems, moreFrequent);
+
+  // Like CountDictionary, an id is only used if it is below vocabSize.
+  ids.assign(NUM_KEYS, UNK);
+  for (size_t i = 0; i < numItems; i++) {
+    size_t id = i + 1;
+    if (id < vocabSize) ids[keys[i]] = id;
+  }
+  finalized = true;
+}
+
+template <size_t MaxNgramSize>
+std::vector<size_t>
+DenseCountDictionary<MaxNgramSize>::translate(std::vector<uint64_t> const& v)
+{
+  if (!finalized) {
+    throw CountDictionaryException("Tried to translate vector but finalized"
+      " has not been called.");
+  }
+
+  std::vector<size_t> data(v.size());
+  size_t numThreads = globalNumThreads;
+  auto translateFunction = [this, &v, &data, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(v.size(), threadId, numThreads);
+    size_t end = getEndIndex(v.size(), threadId, numThreads);
+
+    for (size_t i = beg; i < end; i++) {
+      data[i] = this->getWord2Int(v[i]);
+    }
+  };
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+template <size_t MaxNgramSize>
+std::vector<std::vector<size_t>>
+DenseCountDictionary<MaxNgramSize>::translate(
+  std::vector<std::vector<uint64_t>> const& v)
+{
+  if (!finalized) {
+    throw CountDictionaryException("Tried to translate vector but finalized"
+      " has not been called.");
+  }
+
+  std::vector<std::vector<size_t>> data(v.size());
+  size_t numThreads = globalNumThreads;
+  ChunkSchedule schedule(v.size(), numThreads,
+    [&v](size_t i) -> uint64_t { return v[i].size(); });
+  auto translateFunction = [this, &v, &data, &schedule](size_t threadId)
+  {
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for (size_t i = beg; i < end; i++) {
+        data[i].resize(v[i].size());
+        for (size_t j = 0; j < v[i].size(); j++) {
+          data[i][j] = this->getWord2Int(v[i][j]);
+        }
+      }
+    }
+  };
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+template <size_t MaxNgramSize>
+template <class Archive>
+void DenseCountDictionary<MaxNgramSize>::save(Archive &ar,
+                                              const unsigned int version) const
+{
+  // Bucket the keys the way CountDictionary does, with its load factor.
+  // Before finalize() the counts are still partly in the thread arrays.
+  PackedNgramHashFunction hash;
+  std::vector<uint64_t> keyCounts(totals.empty() ? 0 : NUM_KEYS);
+  size_t numCountedKeys = 0;
+  for (uint64_t key = 0; key < keyCounts.size(); key++) {
+    keyCounts[key] = getCount(key);
+    if (keyCounts[key] > 0) numCountedKeys++;
+  }
+
+  std::atomic<size_t> archiveNumKeys(numCountedKeys);
+  size_t capacity = 
+    std::max<size_t>(1, DICTIONARY_SIZE_FACTOR * numCountedKeys);
+  std::vector<std::map<uint64_t, size_t>> counts(capacity);
+  std::vector<std::map<uint64_t, size_t>> word2Int(capacity);
+  for (uint64_t key = 0; key < keyCounts.size(); key++) {
+    if (keyCounts[key] == 0) continue;
+    size_t index = hash(key) % capacity;
+    counts[index][key] = keyCounts[key];
+    if (finalized && ids[key] != UNK) word2Int[index][key] = ids[key];
+  }
+  bool initialized = !totals.empty();
+
+  ar &archiveNumKeys &vocabSize &capacity &counts &word2Int &initialized
+     &finalized;
+}
+
+template <size_t MaxNgramSize>
+template <class Archive>
+void DenseCountDictionary<MaxNgramSize>::load(Archive &ar,
+                                              const unsigned int version)
+{
+  std::atomic<size_t> archiveNumKeys(0);
+  size_t capacity = 0;
+  std::vector<std::map<uint64_t, size_t>> counts;
+  std::vector<std::map<uint64_t, size_t>> word2Int;
+  bool initialized = false;
+  ar &archiveNumKeys &vocabSize &capacity &counts &word2Int &initialized
+     &finalized;
+
+  numKeys = archiveNumKeys;
+  threadCounts.clear();
+  threadNumCounted.clear();
+  totals.assign(NUM_KEYS, 0);
+  ids.assign(finalized ? NUM_KEYS : 0, UNK);
+  for (size_t i = 0; i < capacity; i++) {
+    for (auto const& count : counts[i]) {
+      if (count.first < NUM_KEYS) totals[count.first] = count.second;
+    }
+    for (auto const& id : word2Int[i]) {
+      if (id.first < NUM_KEYS && id.second < vocabSize) {
+        ids[id.first] = id.second;
+      }
+    }
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,895 @@
+#ifndef PARALLELPCAP_FLAT_COUNT_DICTIONARY_HPP
+#define PARALLELPCAP_FLAT_COUNT_DICTIONARY_HPP
+
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <chrono>
+#include <boost/serialization/serialization.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/vector.hpp>
+#include <ParallelPcap/Util.hpp>
+#include <ParallelPcap/CountDictionary.hpp>
+#include <ParallelPcap/TranslationTable.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * A CountDictionary that keeps its keys in one flat open-addressing table
+ * instead of a vector of mutex-guarded maps.  A key hashes to a cache line
+ * of slots and is looked for by linear probing from there.  Counting takes
+ * no locks: a thread claims an empty slot with a compare-and-swap of the
+ * slot's state and bumps counts with atomic adds.  The table doubles (all
+ * threads stop, the keys are rehashed in parallel, and counting resumes)
+ * when it gets more than MAX_LOAD full.
+ *
+ * With globalShardedCounting, the counting threads don't share the table
+ * at all.  Each thread counts into private tables, one per partition of
+ * the hash range, and then thread k merges partition k of every thread
+ * into the table.  The partitions are contiguous ranges of the table, so
+ * the merging threads mostly write to different cache lines, and each key
+ * is added to the table once per thread instead of once per occurrence.
+ *
+ * Once finalized, getWord2Int() and translate() look the keys up in a
+ * compact read-only TranslationTable of just the keys with ids instead of
+ * the counting table.
+ *
+ * The interface and semantics match CountDictionary, and the dictionary is
+ * saved in the archive layout of CountDictionary<KeyType, HF>, so either
+ * can load what the other saved.
+ */
+template <typename KeyType, typename HF>
+class FlatCountDictionary
+{
+public:
+  typedef KeyType key_type;
+
+  static const size_t UNK = 0;
+
+  /// The table doubles once more than this fraction of the slots is full.
+  static constexpr double MAX_LOAD = 0.7;
+
+  /// The number of slots of a new table.
+  static const size_t INITIAL_CAPACITY = size_t(1) << 16;
+
+  /**
+   * \param vocabSize Only the vocabSize most frequent keys get an id.
+   */
+  FlatCountDictionary(size_t vocabSize) : vocabSize(vocabSize) {}
+
+  FlatCountDictionary(FlatCountDictionary const& other);
+  FlatCountDictionary& operator=(FlatCountDictionary const& other) = delete;
+
+  ~FlatCountDictionary() { freeSlots(slots, capacity); }
+
+  size_t getCapacity() const { return capacity; }
+
+  /**
+   * Returns how often the key occurred.
+   */
+  size_t getCount(KeyType const& key) const;
+
+  /**
+   * Returns the id of the key, or UNK if the key doesn't have one.
+   */
+  size_t getWord2Int(KeyType const& key) const;
+
+  /**
+   * Returns the keys that have ids and their ids, for writing a
+   * MappedDictionary.  Empty until finalized.
+   */
+  std::vector<std::pair<KeyType, size_t>> getVocabulary() const {
+    return translationTable.getEntries();
+  }
+
+  /**
+   * Returns the number of distinct keys found in the data.
+   */
+  size_t getNumKeys() const { return numKeys; }
+
+  /**
+   * Returns how long, summed over the threads, the last processTokens() or
+   * processPackets() call spent waiting for other threads to finish
+   * writing a key to a slot.
+   */
+  double getLockWaitSeconds() const { return lockWaitNanos / 1e9; }
+
+  /**
+   * Adds the tokens to the counts.
+   */
+  void processTokens(std::vector<KeyType> const& v);
+
+  /**
+   * Counts the ngrams of a set of packets without making a vector of all of
+   * them first (see CountDictionary::processPackets).
+   * \param packets The packets (a PacketTable or PacketStore).
+   * \param operators The ngram operators to apply to each packet.
+   */
+  template <typename Packets, typename Operator>
+  void processPackets(Packets const& packets,
+                      std::vector<Operator> const& operators);
+
+  /**
+   * Assigns the ids.  Call once all of the keys have been processed.
+   */
+  void finalize();
+
+  /**
+   * Adds the counts of another dictionary, such as the counts of a shard
+   * of the data made by another process and loaded from its archive.  The
+   * result is the same as if this dictionary had counted the keys of both.
+   * Neither dictionary may be finalized.
+   */
+  void merge(FlatCountDictionary const& other);
+
+  /**
+   * Translates keys to ids.  finalize() must have been called.
+   */
+  std::vector<size_t> translate(std::vector<KeyType> const& v);
+
+  std::vector<std::vector<size_t>>
+  translate(std::vector<std::vector<KeyType>> const& v);
+
+private:
+  enum SlotState : uint8_t { EMPTY = 0, BUSY = 1, FULL = 2 };
+
+  struct Slot
+  {
+    /// EMPTY, then BUSY while the thread that claimed it writes the key,
+    /// then FULL.
+    std::atomic<uint8_t> state;
+    std::atomic<uint64_t> count;
+    size_t id;
+    KeyType key;
+  };
+
+  /// The number of slots that share a cache line.
+  static const size_t SLOTS_PER_LINE =
+    sizeof(Slot) >= 64 ? 1 : 64 / sizeof(Slot);
+
+  size_t vocabSize;
+
+  HF hash;
+
+  /// The slots.  capacity is a power of two, and the slots start on a
+  /// cache line.
+  Slot* slots = 0;
+  size_t capacity = 0;
+
+  /// Number of FULL slots.
+  std::atomic<size_t> numKeys { 0 };
+
+  /// Time spent waiting on BUSY slots since the last count call started.
+  std::atomic<uint64_t> lockWaitNanos { 0 };
+
+  bool finalized = false;
+
+  /// The keys that getWord2Int() gives ids.  Made by finalize() and load().
+  TranslationTable<KeyType, HF> translationTable;
+
+  /**
+   * Fibonacci hashing: the top bits of the product depend on all of the
+   * bits of the hash.  Slots are picked by the top bits.
+   */
+  uint64_t mixedHash(KeyType const& key) const {
+    return hash(key) * 0x9e3779b97f4a7c15ULL;
+  }
+
+  /**
+   * Returns the first slot to look at for a key: the start of the cache
+   * line the key hashes to.
+   */
+  size_t firstSlot(KeyType const& key, size_t capacity) const {
+    uint64_t h = mixedHash(key);
+    int bits = __builtin_ctzll(capacity);
+    size_t index = bits ? static_cast<size_t>(h >> (64 - bits)) : 0;
+    return index - index % SLOTS_PER_LINE;
+  }
+
+  /**
+   * Adds count to the key's slot of a table, claiming an empty slot if the
+   * key isn't there yet.  Thread safe.
+   * \return Returns false, without adding, if the key is new but the table
+   *         already has maxKeys keys.
+   */
+  bool add(Slot* table, size_t tableCapacity, KeyType const& key,
+           uint64_t count, size_t maxKeys);
+
+  /**
+   * Returns the slot with the key, or 0.
+   */
+  Slot* find(KeyType const& key) const;
+
+  /**
+   * The most keys the table takes before it has to grow.
+   */
+  size_t maxKeys() const { return MAX_LOAD * capacity; }
+
+  /**
+   * Makes the table, if there isn't one yet.
+   */
+  void initialize(size_t initialCapacity);
+
+  /**
+   * Doubles the table.
+   */
+  void grow();
+
+  /**
+   * The counts of one thread for one partition of the keys, used by
+   * sharded counting.  A single-threaded open-addressing table over a
+   * vector of the distinct keys and their counts.
+   */
+  class ShardTable
+  {
+  public:
+    /// The distinct keys and their counts, in order of first occurrence.
+    std::vector<std::pair<KeyType, uint64_t>> entries;
+
+    void add(KeyType const& key, uint64_t h);
+
+  private:
+    /// 1 + the entry of each slot, or 0 for an empty slot.
+    std::vector<uint32_t> index;
+
+    /// The hash of each entry, for rehashing.
+    std::vector<uint64_t> hashes;
+
+    void grow();
+  };
+
+  typedef std::vector<ShardTable> Shard;
+
+  /**
+   * Returns the partition of a mixed hash: partition k of n is the kth
+   * nth of the hash range, and so of the table.
+   */
+  static size_t partition(uint64_t h, size_t numPartitions) {
+    return ((h >> 32) * numPartitions) >> 32;
+  }
+
+  /**
+   * Adds one occurrence of the key to a thread's shard.
+   */
+  void addToShard(Shard& shard, KeyType const& key) const {
+    uint64_t h = mixedHash(key);
+    shard[partition(h, shard.size())].add(key, h);
+  }
+
+  /**
+   * Counts with one shard per thread and then merges the shards into the
+   * table.
+   * \param numThreads The number of threads.
+   * \param countFunction Called as countFunction(threadId, shard) by each
+   *                      thread to count its keys into its shard with
+   *                      addToShard().
+   */
+  template <typename CountFunction>
+  void countSharded(size_t numThreads, CountFunction countFunction);
+
+  static Slot* allocateSlots(size_t count);
+  static void freeSlots(Slot* slots, size_t count);
+
+  // Serialization, in the layout of CountDictionary.
+  friend class boost::serialization::access;
+
+  template<class Archive>
+  void save(Archive &ar, const unsigned int version) const;
+
+  template<class Archive>
+  void load(Archive &ar, const unsigned int version);
+
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
+template <typename KeyType, typename HF>
+constexpr double FlatCountDictionary<KeyType, HF>::MAX_LOAD;
+
+template <typename KeyType, typename HF>
+typename FlatCountDictionary<KeyType, HF>::Slot*
+FlatCountDictionary<KeyType, HF>::allocateSlots(size_t count)
+{
+  // Over-allocate so that the slots can start on a cache line, and keep
+  // the original pointer just before them.
+  size_t bytes = count * sizeof(Slot) + 64 + sizeof(void*);
+  char* raw = static_cast<char*>(::operator new(bytes));
+  uintptr_t start = reinterpret_cast<uintptr_t>(raw) + sizeof(void*);
+  start = (start + 63) & ~uintptr_t(63);
+  reinterpret_cast<void**>(start)[-1] = raw;
+
+  Slot* table = reinterpret_cast<Slot*>(start);
+  for (size_t i = 0; i < count; i++) {
+    Slot* slot = new (&table[i]) Slot();
+    slot->state.store(EMPTY, std::memory_order_relaxed);
+    slot->count.store(0, std::memory_order_relaxed);
+    slot->id = UNK;
+  }
+  return table;
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::freeSlots(Slot* table, size_t count)
+{
+  if (!table) return;
+  for (size_t i = 0; i < count; i++) {
+    table[i].~Slot();
+  }
+  ::operator delete(reinterpret_cast<void**>(table)[-1]);
+}
+
+template <typename KeyType, typename HF>
+FlatCountDictionary<KeyType, HF>::FlatCountDictionary(
+  FlatCountDictionary const& other)
+  : vocabSize(other.vocabSize), capacity(other.capacity),
+    numKeys(other.numKeys.load()), finalized(other.finalized),
+    translationTable(other.translationTable)
+{
+  if (!other.slots) return;
+  slots = allocateSlots(capacity);
+  for (size_t i = 0; i < capacity; i++) {
+    slots[i].state.store(other.slots[i].state.load());
+    slots[i].count.store(other.slots[i].count.load());
+    slots[i].id = other.slots[i].id;
+    slots[i].key = other.slots[i].key;
+  }
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::initialize(size_t initialCapacity)
+{
+  if (slots) return;
+  capacity = INITIAL_CAPACITY;
+  while (capacity < initialCapacity) capacity *= 2;
+  slots = allocateSlots(capacity);
+}
+
+template <typename KeyType, typename HF>
+bool FlatCountDictionary<KeyType, HF>::add(Slot* table, size_t tableCapacity,
+                                           KeyType const& key, uint64_t count,
+                                           size_t maxKeys)
+{
+  size_t mask = tableCapacity - 1;
+  for (size_t i = firstSlot(key, tableCapacity); ; i = (i + 1) & mask) {
+    Slot& slot = table[i];
+    uint8_t state = slot.state.load(std::memory_order_acquire);
+
+    if (state == EMPTY) {
+      if (numKeys.load(std::memory_order_relaxed) >= maxKeys) return false;
+
+      uint8_t expected = EMPTY;
+      if (slot.state.compare_exchange_strong(expected, BUSY,
+                                             std::memory_order_acquire)) {
+        slot.key = key;
+        slot.count.store(count, std::memory_order_relaxed);
+        slot.state.store(FULL, std::memory_order_release);
+        numKeys.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      state = expected;
+    }
+
+    // Another thread is writing a key here; wait to see which.
+    if (state == BUSY) {
+      auto t1 = std::chrono::high_resolution_clock::now();
+      while (state == BUSY) {
+        std::this_thread::yield();
+        state = slot.state.load(std::memory_order_acquire);
+      }
+      auto t2 = std::chrono::high_resolution_clock::now();
+      lockWaitNanos.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count(),
+        std::memory_order_relaxed);
+    }
+
+    if (slot.key == key) {
+      slot.count.fetch_add(count, std::memory_order_relaxed);
+      return true;
+    }
+  }
+}
+
+template <typename KeyType, typename HF>
+typename FlatCountDictionary<KeyType, HF>::Slot*
+FlatCountDictionary<KeyType, HF>::find(KeyType const& key) const
+{
+  if (!slots) return 0;
+  size_t mask = capacity - 1;
+  for (size_t i = firstSlot(key, capacity); ; i = (i + 1) & mask) {
+    Slot& slot = slots[i];
+    if (slot.state.load(std::memory_order_acquire) != FULL) return 0;
+    if (slot.key == key) return &slot;
+  }
+}
+
+template <typename KeyType, typename HF>
+size_t FlatCountDictionary<KeyType, HF>::getCount(KeyType const& key) const
+{
+  Slot const* slot = find(key);
+  return slot ? slot->count.load(std::memory_order_relaxed) : 0;
+}
+
+template <typename KeyType, typename HF>
+size_t FlatCountDictionary<KeyType, HF>::getWord2Int(KeyType const& key) const
+{
+  return translationTable.lookup(key);
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::grow()
+{
+  size_t newCapacity = capacity * 2;
+  Slot* newSlots = allocateSlots(newCapacity);
+  size_t oldNumKeys = numKeys;
+  numKeys = 0;
+
+  size_t numThreads = globalNumThreads;
+  auto rehashFunction = [this, newSlots, newCapacity, numThreads]
+    (size_t threadId)
+  {
+    size_t beg = getBeginIndex(this->capacity, threadId, numThreads);
+    size_t end = getEndIndex(this->capacity, threadId, numThreads);
+
+    for (size_t i = beg; i < end; i++) {
+      Slot const& slot = this->slots[i];
+      if (slot.state.load(std::memory_order_relaxed) == FULL) {
+        this->add(newSlots, newCapacity, slot.key, slot.count.load(),
+                  newCapacity);
+      }
+    }
+  };
+  parallelFor(numThreads, rehashFunction);
+
+  if (numKeys != oldNumKeys) {
+    freeSlots(newSlots, newCapacity);
+    throw CountDictionaryException("FlatCountDictionary: lost keys while"
+      " growing the table");
+  }
+
+  freeSlots(slots, capacity);
+  slots = newSlots;
+  capacity = newCapacity;
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::processTokens(
+  std::vector<KeyType> const& v)
+{
+  initialize(INITIAL_CAPACITY);
+  size_t numThreads = getLoopThreads();
+  lockWaitNanos = 0;
+
+  if (globalShardedCounting) {
+    countSharded(numThreads, [this, &v, numThreads](size_t threadId,
+                                                    Shard& shard)
+    {
+      size_t beg = getBeginIndex(v.size(), threadId, numThreads);
+      size_t end = getEndIndex(v.size(), threadId, numThreads);
+
+      for (size_t i = beg; i < end; i++) {
+        this->addToShard(shard, v[i]);
+      }
+    });
+    return;
+  }
+
+  // Where each thread carries on from after the table grows.
+  std::vector<size_t> next(numThreads);
+  for (size_t t = 0; t < numThreads; t++) {
+    next[t] = getBeginIndex(v.size(), t, numThreads);
+  }
+
+  std::atomic<bool> full(false);
+  auto countFunction = [this, &v, &next, &full, numThreads](size_t threadId)
+  {
+    size_t end = getEndIndex(v.size(), threadId, numThreads);
+    size_t maxKeys = this->maxKeys();
+
+    size_t i = next[threadId];
+    for (; i < end && !full.load(std::memory_order_relaxed); i++) {
+      if (!this->add(this->slots, this->capacity, v[i], 1, maxKeys)) {
+        full = true;
+        break;
+      }
+    }
+    next[threadId] = i;
+  };
+
+  do {
+    full = false;
+    parallelFor(numThreads, countFunction);
+    if (full) grow();
+  } while (full);
+}
+
+template <typename KeyType, typename HF>
+template <typename Packets, typename Operator>
+void FlatCountDictionary<KeyType, HF>::processPackets(
+  Packets const& packets, std::vector<Operator> const& operators)
+{
+  initialize(INITIAL_CAPACITY);
+  size_t numThreads = getLoopThreads();
+  lockWaitNanos = 0;
+
+  // The threads take chunks of about the same number of bytes of packets
+  // as they go (see PacketTable::applyOperator).
+  ChunkSchedule schedule(packets.size(), numThreads,
+    [&packets](size_t i) -> uint64_t {
+      return packets.getPacket(i).getIncludedLength();
+    });
+
+  if (globalShardedCounting) {
+    countSharded(numThreads, [this, &packets, &operators, &schedule]
+      (size_t threadId, Shard& shard)
+    {
+      std::vector<KeyType> ngrams;
+      size_t beg, end;
+      while (schedule.next(beg, end)) {
+        for (size_t i = beg; i < end; i++) {
+          ngrams.clear();
+          for (Operator const& op : operators) {
+            op(packets.getPacket(i), ngrams);
+          }
+          for (KeyType const& key : ngrams) {
+            this->addToShard(shard, key);
+          }
+        }
+      }
+    });
+    return;
+  }
+
+  // The rest of the chunk each thread was counting, and the ngram of its
+  // first packet, where the thread carries on from after the table grows.
+  std::vector<size_t> nextPacket(numThreads, 0);
+  std::vector<size_t> chunkEnd(numThreads, 0);
+  std::vector<size_t> nextNgram(numThreads, 0);
+
+  std::atomic<bool> full(false);
+  auto countFunction = [this, &packets, &operators, &schedule, &nextPacket,
+                        &chunkEnd, &nextNgram, &full](size_t threadId)
+  {
+    size_t& i = nextPacket[threadId];
+    size_t& end = chunkEnd[threadId];
+    size_t maxKeys = this->maxKeys();
+
+    // Only one packet's ngrams exist at a time.
+    std::vector<KeyType> ngrams;
+    while (i < end || schedule.next(i, end)) {
+      for (; i < end; i++) {
+        ngrams.clear();
+        for (Operator const& op : operators) {
+          op(packets.getPacket(i), ngrams);
+        }
+        for (size_t& j = nextNgram[threadId]; j < ngrams.size(); j++) {
+          if (full.load(std::memory_order_relaxed) ||
+              !this->add(this->slots, this->capacity, ngrams[j], 1, maxKeys))
+          {
+            full = true;
+            return;
+          }
+        }
+        nextNgram[threadId] = 0;
+      }
+    }
+  };
+
+  do {
+    full = false;
+    parallelFor(numThreads, countFunction);
+    if (full) grow();
+  } while (full);
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::ShardTable::add(KeyType const& key,
+                                                       uint64_t h)
+{
+  if ((entries.size() + 1) * 2 > index.size()) grow();
+
+  size_t mask = index.size() - 1;
+  for (size_t i = h & mask; ; i = (i + 1) & mask) {
+    uint32_t entry = index[i];
+    if (entry == 0) {
+      entries.push_back(std::make_pair(key, 1));
+      hashes.push_back(h);
+      index[i] = entries.size();
+      return;
+    }
+    if (entries[entry - 1].first == key) {
+      entries[entry - 1].second++;
+      return;
+    }
+  }
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::ShardTable::grow()
+{
+  index.assign(std::max<size_t>(1024, index.size() * 2), 0);
+  size_t mask = index.size() - 1;
+  for (size_t e = 0; e < hashes.size(); e++) {
+    size_t i = hashes[e] & mask;
+    while (index[i] != 0) i = (i + 1) & mask;
+    index[i] = e + 1;
+  }
+}
+
+template <typename KeyType, typename HF>
+template <typename CountFunction>
+void FlatCountDictionary<KeyType, HF>::countSharded(
+  size_t numThreads, CountFunction countFunction)
+{
+  // Each thread counts into its own shard, without touching the table.
+  std::vector<Shard> shards(numThreads, Shard(numThreads));
+  parallelFor(numThreads, [&shards, &countFunction](size_t threadId) {
+    countFunction(threadId, shards[threadId]);
+  });
+
+  // Thread k merges partition k of every shard.  Like counting, the
+  // threads stop if the table has to grow, and carry on afterwards.
+  std::vector<size_t> nextShard(numThreads, 0);
+  std::vector<size_t> nextEntry(numThreads, 0);
+  std::atomic<bool> full(false);
+  auto mergeFunction = [this, &shards, &nextShard, &nextEntry, &full,
+                        numThreads](size_t k)
+  {
+    size_t maxKeys = this->maxKeys();
+    for (size_t& t = nextShard[k]; t < numThreads; t++) {
+      std::vector<std::pair<KeyType, uint64_t>> const& entries = 
+        shards[t][k].entries;
+      for (size_t& e = nextEntry[k]; e < entries.size(); e++) {
+        if (full.load(std::memory_order_relaxed) ||
+            !this->add(this->slots, this->capacity, entries[e].first,
+                       entries[e].second, maxKeys))
+        {
+          full = true;
+          return;
+        }
+      }
+      nextEntry[k] = 0;
+    }
+  };
+
+  do {
+    full = false;
+    parallelFor(numThreads, mergeFunction);
+    if (full) grow();
+  } while (full);
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::merge(FlatCountDictionary const& other)
+{
+  if (finalized || other.finalized) {
+    throw CountDictionaryException("Tried to merge dictionaries but one of"
+      " them has been finalized.");
+  }
+  if (!other.slots) return;
+  initialize(other.numKeys / MAX_LOAD + 1);
+  size_t numThreads = globalNumThreads;
+
+  // Each thread adds a range of the other table's slots.  Like counting,
+  // the threads stop if the table has to grow, and carry on afterwards.
+  std::vector<size_t> next(numThreads);
+  for (size_t i = 0; i < numThreads; i++) {
+    next[i] = getBeginIndex(other.capacity, i, numThreads);
+  }
+  std::atomic<bool> full(false);
+  auto mergeFunction = [this, &other, &next, &full, numThreads]
+    (size_t threadId)
+  {
+    size_t end = getEndIndex(other.capacity, threadId, numThreads);
+    size_t maxKeys = this->maxKeys();
+
+    for (size_t& i = next[threadId]; i < end; i++) {
+      Slot const& slot = other.slots[i];
+      if (slot.state.load(std::memory_order_relaxed) != FULL) continue;
+      if (full.load(std::memory_order_relaxed) ||
+          !this->add(this->slots, this->capacity, slot.key,
+                     slot.count.load(std::memory_order_relaxed), maxKeys))
+      {
+        full = true;
+        return;
+      }
+    }
+  };
+
+  do {
+    full = false;
+    parallelFor(numThreads, mergeFunction);
+    if (full) grow();
+  } while (full);
+}
+
+template <typename KeyType, typename HF>
+void FlatCountDictionary<KeyType, HF>::finalize()
+{
+  initialize(INITIAL_CAPACITY);
+  size_t numThreads = globalNumThreads;
+
+  // Gather the full slots, each thread's range of the table into its own
+  // part of the vector, and clear their ids.
+  std::vector<size_t> threadNumKeys(numThreads, 0);
+  auto countFunction = [this, &threadNumKeys, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(this->capacity, threadId, numThreads);
+    size_t end = getEndIndex(this->capacity, threadId, numThreads);
+
+    for (size_t i = beg; i < end; i++) {
+      if (this->slots[i].state.load(std::memory_order_relaxed) == FULL) {
+        threadNumKeys[threadId]++;
+      }
+    }
+  };
+  parallelFor(numThreads, countFunction);
+
+  std::vector<size_t> threadStarts(numThreads, 0);
+  for (size_t i = 1; i < numThreads; i++) {
+    threadStarts[i] = threadStarts[i - 1] + threadNumKeys[i - 1];
+  }
+
+  std::vector<Slot*> sortedSlots(numKeys);
+  auto fillFunction = [this, &sortedSlots, &threadStarts, numThreads]
+    (size_t threadId)
+  {
+    size_t beg = getBeginIndex(this->capacity, threadId, numThreads);
+    size_t end = getEndIndex(this->capacity, threadId, numThreads);
+
+    size_t next = threadStarts[threadId];
+    for (size_t i = beg; i < end; i++) {
+      if (this->slots[i].state.load(std::memory_order_relaxed) == FULL) {
+        this->slots[i].id = UNK;
+        sortedSlots[next++] = &this->slots[i];
+      }
+    }
+  };
+  parallelFor(numThreads, fillFunction);
+
+  // Only the vocabSize most frequent keys get ids, so only those are
+  // sorted.  Ties go to the smaller key, which keeps the ids the same
+  // whatever the number of threads.
+  auto moreFrequent = [](Slot const* a, Slot const* b) {
+    uint64_t countA = a->count.load(std::memory_order_relaxed);
+    uint64_t countB = b->count.load(std::memory_order_relaxed);
+    return countA > countB || (countA == countB && a->key < b->key);
+  };
+  std::vector<Slot*> topSlots =
+    parallelTopK(sortedSlots, vocabSize, moreFrequent);
+
+  // Like CountDictionary, only ids below vocabSize are used.
+  std::vector<std::pair<KeyType, size_t>> entries;
+  for (size_t i = 0; i < topSlots.size(); i++) {
+    topSlots[i]->id = i + 1;
+    if (i + 1 < vocabSize) entries.push_back(std::make_pair(topSlots[i]->key,
+                                                            i + 1));
+  }
+  translationTable.build(entries);
+  finalized = true;
+}
+
+template <typename KeyType, typename HF>
+std::vector<size_t>
+FlatCountDictionary<KeyType, HF>::translate(std::vector<KeyType> const& v)
+{
+  if (!finalized) {
+    throw CountDictionaryException("Tried to translate vector but finalized"
+      " has not been called.");
+  }
+
+  std::vector<size_t> data(v.size());
+  size_t numThreads = globalNumThreads;
+  auto translateFunction = [this, &v, &data, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(v.size(), threadId, numThreads);
+    size_t end = getEndIndex(v.size(), threadId, numThreads);
+
+    for (size_t i = beg; i < end; i++) {
+      data[i] = this->getWord2Int(v[i]);
+    }
+  };
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+template <typename KeyType, typename HF>
+std::vector<std::vector<size_t>>
+FlatCountDictionary<KeyType, HF>::translate(
+  std::vector<std::vector<KeyType>> const& v)
+{
+  if (!finalized) {
+    throw CountDictionaryException("Tried to translate vector but finalized"
+      " has not been called.");
+  }
+
+  std::vector<std::vector<size_t>> data(v.size());
+  size_t numThreads = globalNumThreads;
+  ChunkSchedule schedule(v.size(), numThreads,
+    [&v](size_t i) -> uint64_t { return v[i].size(); });
+  auto translateFunction = [this, &v, &data, &schedule](size_t threadId)
+  {
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for (size_t i = beg; i < end; i++) {
+        data[i].resize(v[i].size());
+        for (size_t j = 0; j < v[i].size(); j++) {
+          data[i][j] = this->getWord2Int(v[i][j]);
+        }
+      }
+    }
+  };
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+template <typename KeyType, typename HF>
+template <class Archive>
+void FlatCountDictionary<KeyType, HF>::save(Archive &ar,
+                                            const unsigned int version) const
+{
+  // Bucket the keys the way CountDictionary does, with its load factor.
+  std::atomic<size_t> archiveNumKeys(numKeys.load());
+  size_t archiveCapacity =
+    std::max<size_t>(1, DICTIONARY_SIZE_FACTOR * numKeys);
+  std::vector<std::map<KeyType, size_t>> counts(archiveCapacity);
+  std::vector<std::map<KeyType, size_t>> word2Int(archiveCapacity);
+  for (size_t i = 0; i < capacity; i++) {
+    Slot const& slot = slots[i];
+    if (slot.state.load(std::memory_order_relaxed) != FULL) continue;
+    size_t index = hash(slot.key) % archiveCapacity;
+    counts[index][slot.key] = slot.count.load(std::memory_order_relaxed);
+    if (finalized && slot.id != UNK) word2Int[index][slot.key] = slot.id;
+  }
+  bool initialized = slots != 0;
+
+  ar &archiveNumKeys &vocabSize &archiveCapacity &counts &word2Int
+     &initialized &finalized;
+}
+
+template <typename KeyType, typename HF>
+template <class Archive>
+void FlatCountDictionary<KeyType, HF>::load(Archive &ar,
+                                            const unsigned int version)
+{
+  std::atomic<size_t> archiveNumKeys(0);
+  size_t archiveCapacity = 0;
+  std::vector<std::map<KeyType, size_t>> counts;
+  std::vector<std::map<KeyType, size_t>> word2Int;
+  bool initialized = false;
+  ar &archiveNumKeys &vocabSize &archiveCapacity &counts &word2Int
+     &initialized &finalized;
+
+  freeSlots(slots, capacity);
+  slots = 0;
+  capacity = 0;
+  numKeys = 0;
+  initialize(archiveNumKeys / MAX_LOAD + 1);
+
+  size_t noLimit = capacity;
+  for (size_t i = 0; i < archiveCapacity; i++) {
+    for (auto const& count : counts[i]) {
+      add(slots, capacity, count.first, count.second, noLimit);
+    }
+  }
+  for (size_t i = 0; i < archiveCapacity; i++) {
+    for (auto const& id : word2Int[i]) {
+      Slot* slot = find(id.first);
+      if (slot) slot->id = id.second;
+    }
+  }
+
+  std::vector<std::pair<KeyType, size_t>> entries;
+  for (size_t i = 0; i < archiveCapacity; i++) {
+    for (auto const& id : word2Int[i]) {
+      if (id.second < vocabSize) entries.push_back(id);
+    }
+  }
+  translationTable.build(entries);
+}
+
+}
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef PARALLELPCAP_MAPPED_DICTIONARY_HPP
+#define PARALLELPCAP_MAPPED_DICTIONARY_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <ParallelPcap/MappedFile.hpp>
+#include <ParallelPcap/Util.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The exception type generated by the MappedDictionary class.
+ */
+class MappedDictionaryException : public std::runtime_error {
+public:
+  MappedDictionaryException(char const* message)
+    : std::runtime_error(message) {}
+  MappedDictionaryException(std::string message)
+    : std::runtime_error(message) {}
+};
+
+/**
+ * A finalized dictionary's key to id table, in a binary file that is used
+ * in place through a read-only memory mapping.  Opening one reads and
+ * checks the header and nothing else, and processes that open the same
+ * file share its pages.  Only the keys with ids are stored; the counts
+ * stay in the boost archive of the dictionary.
+ *
+ * The file, in the byte order of the machine that wrote it, is a Header,
+ * then numSlots Slots (an open-addressing table at most half full, laid
+ * out like TranslationTable's), then for string keys the bytes of the
+ * keys.  A packed key is stored in its slot; a string key as the offset
+ * and length of its bytes.
+ */
+template <typename KeyType, typename HF>
+class MappedDictionary
+{
+public:
+  typedef KeyType key_type;
+
+  static const size_t UNK = 0;
+
+  /**
+   * Maps a dictionary file.
+   * \param filename The path to a file made by write().
+   */
+  MappedDictionary(std::string const& filename);
+
+  /**
+   * Returns true if the file starts like a dictionary file, of any key
+   * type.
+   */
+  static bool isMappedDictionary(std::string const& filename);
+
+  /**
+   * Writes a dictionary file.
+   * \param filename The path to write to.
+   * \param vocabulary The keys with ids and their ids (see the
+   *                   dictionaries' getVocabulary()).
+   * \param vocabSize The vocabulary size of the dictionary.
+   */
+  static void write(std::string const& filename,
+                    std::vector<std::pair<KeyType, size_t>> const& vocabulary,
+                    size_t vocabSize);
+
+  /**
+   * Returns the id of the key, or UNK if the key doesn't have one.
+   */
+  size_t getWord2Int(KeyType const& key) const {
+    size_t mask = header->numSlots - 1;
+    for (size_t i = firstSlot(key); ; i = (i + 1) & mask) {
+      Slot const& slot = slots[i];
+      if (slot.id == UNK) return UNK;
+      if (matches(slot, key)) return slot.id;
+    }
+  }
+
+  /**
+   * Translates keys to ids.
+   */
+  std::vector<size_t> translate(std::vector<KeyType> const& v) const;
+
+  std::vector<std::vector<size_t>>
+  translate(std::vector<std::vector<KeyType>> const& v) const;
+
+  /**
+   * Returns the number of keys with ids.
+   */
+  size_t size() const { return header->numEntries; }
+
+  size_t getVocabSize() const { return header->vocabSize; }
+
+private:
+  enum KeyKind : uint32_t { PACKED_KEYS = 0, STRING_KEYS = 1 };
+
+  static constexpr char MAGIC[8] = { 'P', 'P', 'D', 'I', 'C', 'T', '0', '1' };
+
+  struct Header
+  {
+    char magic[8];
+    uint32_t keyKind;
+    uint32_t reserved;
+    uint64_t vocabSize;
+    uint64_t numEntries;
+
+    /// A power of two.
+    uint64_t numSlots;
+    uint64_t numKeyBytes;
+  };
+
+  struct Slot
+  {
+    /// The packed key, or the offset of the string key's bytes.
+    uint64_t key;
+    uint32_t length;
+
+    /// UNK for an empty slot.
+    uint32_t id;
+  };
+
+  HF hash;
+  MappedFile file;
+  Header const* header = 0;
+  Slot const* slots = 0;
+  char const* keyBytes = 0;
+  int shift = 64;
+
+  static KeyKind keyKind(uint64_t const*) { return PACKED_KEYS; }
+  static KeyKind keyKind(std::string const*) { return STRING_KEYS; }
+
+  static size_t firstSlot(HF const& hash, KeyType const& key, int shift) {
+    return (hash(key) * 0x9e3779b97f4a7c15ULL) >> shift;
+  }
+
+  size_t firstSlot(KeyType const& key) const {
+    return firstSlot(hash, key, shift) & (header->numSlots - 1);
+  }
+
+  bool matches(Slot const& slot, uint64_t key) const {
+    return slot.key == key;
+  }
+
+  bool matches(Slot const& slot, std::string const& key) const {
+    return slot.length == key.size() &&
+           std::memcmp(keyBytes + slot.key, key.data(), key.size()) == 0;
+  }
+
+  static void encode(Slot& slot, uint64_t key, std::string& bytes) {
+    slot.key = key;
+    slot.length = 0;
+  }
+
+  static void encode(Slot& slot, std::string const& key, std::string& bytes) {
+    slot.key = bytes.size();
+    slot.length = key.size();
+    bytes += key;
+  }
+};
+
+template <typename KeyType, typename HF>
+constexpr char MappedDictionary<KeyType, HF>::MAGIC[8];
+
+template <typename KeyType, typename HF>
+MappedDictionary<KeyType, HF>::MappedDictionary(std::string const& filename)
+  : file(filename)
+{
+  if (file.getSize() < sizeof(Header)) {
+    throw MappedDictionaryException(filename + " is too small to be a"
+      " dictionary file");
+  }
+  header = reinterpret_cast<Header const*>(file.getData());
+  if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+    throw MappedDictionaryException(filename + " is not a dictionary file");
+  }
+  if (header->keyKind != keyKind(static_cast<KeyType const*>(0))) {
+    throw MappedDictionaryException(filename + " has the wrong kind of keys"
+      " (packed ngrams vs strings) for these ngram sizes");
+  }
+
+  uint64_t numSlots = header->numSlots;
+  if (numSlots == 0 || (numSlots & (numSlots - 1)) != 0 ||
+      numSlots > (file.getSize() - sizeof(Header)) / sizeof(Slot) ||
+      file.getSize() != sizeof(Header) + numSlots * sizeof(Slot) +
+                        header->numKeyBytes)
+  {
+    throw MappedDictionaryException(filename + " is truncated or corrupt");
+  }
+
+  slots = reinterpret_cast<Slot const*>(file.getData() + sizeof(Header));
+  keyBytes = reinterpret_cast<char const*>(slots + numSlots);
+  shift = 64 - __builtin_ctzll(numSlots);
+}
+
+template <typename KeyType, typename HF>
+bool MappedDictionary<KeyType, HF>::isMappedDictionary(
+  std::string const& filename)
+{
+  std::ifstream stream(filename, std::ios::binary);
+  char magic[sizeof(MAGIC)];
+  return stream.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+template <typename KeyType, typename HF>
+void MappedDictionary<KeyType, HF>::write(
+  std::string const& filename,
+  std::vector<std::pair<KeyType, size_t>> const& vocabulary,
+  size_t vocabSize)
+{
+  int bits = 1;
+  while ((uint64_t(1) << bits) < 2 * vocabulary.size()) bits++;
+
+  Header header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.keyKind = keyKind(static_cast<KeyType const*>(0));
+  header.reserved = 0;
+  header.vocabSize = vocabSize;
+  header.numEntries = vocabulary.size();
+  header.numSlots = uint64_t(1) << bits;
+
+  // Placed in id order, so the file only depends on the vocabulary.
+  std::vector<std::pair<KeyType, size_t>> sorted(vocabulary);
+  std::sort(sorted.begin(), sorted.end(),
+    [](std::pair<KeyType, size_t> const& a,
+       std::pair<KeyType, size_t> const& b) { return a.second < b.second; });
+
+  HF hash;
+  std::vector<Slot> slots(header.numSlots, Slot { 0, 0, UNK });
+  std::string bytes;
+  size_t mask = header.numSlots - 1;
+  for (auto const& entry : sorted) {
+    if (entry.second == UNK ||
+        entry.second > std::numeric_limits<uint32_t>::max())
+    {
+      throw MappedDictionaryException("MappedDictionary::write: id " +
+        std::to_string(entry.second) + " can't be stored");
+    }
+    size_t i = firstSlot(hash, entry.first, 64 - bits) & mask;
+    while (slots[i].id != UNK) i = (i + 1) & mask;
+    encode(slots[i], entry.first, bytes);
+    slots[i].id = entry.second;
+  }
+  header.numKeyBytes = bytes.size();
+
+  std::ofstream stream(filename, std::ios::binary);
+  stream.write(reinterpret_cast<char const*>(&header), sizeof(header));
+  stream.write(reinterpret_cast<char const*>(slots.data()),
+               slots.size() * sizeof(Slot));
+  stream.write(bytes.data(), bytes.size());
+  if (!stream) {
+    throw MappedDictionaryException("Could not write " + filename);
+  }
+}
+
+template <typename KeyType, typename HF>
+std::vector<size_t>
+MappedDictionary<KeyType, HF>::translate(std::vector<KeyType> const& v) const
+{
+  std::vector<size_t> data(v.size());
+  size_t numThreads = globalNumThreads;
+  auto translateFunction = [this, &v, &data, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(v.size(), threadId, numThreads);
+    size_t end = getEndIndex(v.size(), threadId, numThreads);
+
+    for (size_t i = beg; i < end; i++) {
+      data[i] = this->getWord2Int(v[i]);
+    }
+  };
+
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+template <typename KeyType, typename HF>
+std::vector<std::vector<size_t>>
+MappedDictionary<KeyType, HF>::translate(
+  std::vector<std::vector<KeyType>> const& v) const
+{
+  std::vector<std::vector<size_t>> data(v.size());
+  size_t numThreads = globalNumThreads;
+  ChunkSchedule schedule(v.size(), numThreads,
+    [&v](size_t i) -> uint64_t { return v[i].size(); });
+  auto translateFunction = [this, &v, &data, &schedule](size_t threadId)
+  {
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for (size_t i = beg; i < end; i++) {
+        data[i].resize(v[i].size());
+        for (size_t j = 0; j < v[i].size(); j++) {
+          data[i][j] = this->getWord2Int(v[i][j]);
+        }
+      }
+    }
+  };
+
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+}
+
+#endif
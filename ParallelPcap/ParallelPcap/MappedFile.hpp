@@ -0,0 +1,135 @@
+#ifndef PARALLELPCAP_MAPPED_FILE_HPP
+#define PARALLELPCAP_MAPPED_FILE_HPP
+
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace parallel_pcap {
+
+/**
+ * The exception type generated by the MappedFile class.
+ */
+class MappedFileException : public std::runtime_error {
+public:
+  MappedFileException(char const* message) : std::runtime_error(message) {}
+  MappedFileException(std::string message) : std::runtime_error(message) {}
+};
+
+/**
+ * Read-only memory mapping of an entire file.  The mapping lives as long as
+ * the object, so anything that points into getData() must not outlive it.
+ * Only regular files can be mapped; opening a pipe or a device throws a
+ * MappedFileException so that callers can fall back to reading the file.
+ */
+class MappedFile
+{
+private:
+  /// The file descriptor of the mapped file.
+  int fd = -1;
+
+  /// Start of the mapping.  Null if the file is empty.
+  unsigned char* data = 0;
+
+  /// Number of bytes in the file (and in the mapping).
+  uint64_t numBytes = 0;
+
+public:
+  /**
+   * Maps the whole file read-only.
+   * \param filename The path to the file.
+   */
+  MappedFile(std::string const& filename);
+
+  ~MappedFile();
+
+  MappedFile(MappedFile const& other) = delete;
+  MappedFile& operator=(MappedFile const& other) = delete;
+
+  unsigned char const* getData() const { return data; }
+  uint64_t getSize() const { return numBytes; }
+
+  /**
+   * Tells the kernel the mapping will be read front to back, so it can
+   * read ahead aggressively and drop pages behind us.
+   */
+  void adviseSequential() const;
+
+  /**
+   * Tells the kernel we will need the given byte range soon, which starts
+   * the reads before we fault on the pages.
+   * \param offset Byte offset into the file.
+   * \param length Number of bytes starting at offset.
+   */
+  void adviseWillNeed(uint64_t offset, uint64_t length) const;
+
+private:
+  void advise(uint64_t offset, uint64_t length, int advice) const;
+};
+
+inline MappedFile::MappedFile(std::string const& filename)
+{
+  fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw MappedFileException("Could not open file " + filename + ": " +
+      std::strerror(errno));
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    throw MappedFileException("Could not map " + filename +
+      ": not a regular file");
+  }
+
+  numBytes = st.st_size;
+  if (numBytes > 0) {
+    void* ptr = ::mmap(0, numBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      ::close(fd);
+      throw MappedFileException("Could not map " + filename + ": " +
+        std::strerror(errno));
+    }
+    data = static_cast<unsigned char*>(ptr);
+  }
+}
+
+inline MappedFile::~MappedFile()
+{
+  if (data) ::munmap(data, numBytes);
+  if (fd >= 0) ::close(fd);
+}
+
+inline void MappedFile::adviseSequential() const
+{
+  advise(0, numBytes, POSIX_MADV_SEQUENTIAL);
+}
+
+inline void MappedFile::adviseWillNeed(uint64_t offset, uint64_t length) const
+{
+  advise(offset, length, POSIX_MADV_WILLNEED);
+}
+
+inline void MappedFile::advise(uint64_t offset, uint64_t length,
+                               int advice) const
+{
+  if (!data || offset >= numBytes) return;
+  if (length > numBytes - offset) length = numBytes - offset;
+
+  // posix_madvise wants a page aligned address.
+  uint64_t pageSize = ::sysconf(_SC_PAGESIZE);
+  uint64_t alignedOffset = offset - offset % pageSize;
+
+  // The advice is only a hint, so failures are ignored.
+  ::posix_madvise(data + alignedOffset, length + (offset - alignedOffset),
+                  advice);
+}
+
+}
+
+#endif
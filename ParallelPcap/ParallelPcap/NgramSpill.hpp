@@ -0,0 +1,424 @@
+#ifndef PARALLELPCAP_NGRAM_SPILL_HPP
+#define PARALLELPCAP_NGRAM_SPILL_HPP
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <fstream>
+#include <thread>
+#include <unordered_map>
+#include <stdexcept>
+#include <ParallelPcap/Util.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The exception type generated by the ngram spill classes.
+ */
+class NgramSpillException : public std::runtime_error {
+public:
+  NgramSpillException(char const* message) : std::runtime_error(message) {}
+  NgramSpillException(std::string message) : std::runtime_error(message) {}
+};
+
+namespace details {
+
+inline void writeSpillKey(std::ostream& stream, std::string const& key)
+{
+  uint32_t length = key.size();
+  stream.write(reinterpret_cast<char const*>(&length), sizeof(length));
+  stream.write(key.data(), length);
+}
+
+inline void writeSpillKey(std::ostream& stream, uint64_t key)
+{
+  stream.write(reinterpret_cast<char const*>(&key), sizeof(key));
+}
+
+inline void readSpillKey(std::istream& stream, std::string& key)
+{
+  uint32_t length = 0;
+  stream.read(reinterpret_cast<char*>(&length), sizeof(length));
+  if (!stream) return;
+  key.resize(length);
+  stream.read(&key[0], length);
+}
+
+inline void readSpillKey(std::istream& stream, uint64_t& key)
+{
+  stream.read(reinterpret_cast<char*>(&key), sizeof(key));
+}
+
+}
+
+/**
+ * The ngrams of a run of packets in the compact form NgramSpillWriter
+ * writes: each distinct ngram is given a key index, and only the key
+ * indices are kept for each packet.  Built up a batch of packets at a
+ * time, so that only the ngram vectors of the current batch have to exist.
+ */
+template <typename KeyType>
+class NgramSpillBatch
+{
+public:
+  /**
+   * Adds the ngrams of the next packets.
+   * \param ngrams The ngrams of each packet, as computed by the operator of
+   *               NgramTraits<KeyType>.
+   */
+  void add(std::vector<std::vector<KeyType>> const& ngrams);
+
+  /**
+   * Returns the distinct keys.  Key index i refers to getKeys()[i].
+   */
+  std::vector<KeyType> const& getKeys() const { return keys; }
+
+  /// The key index of every ngram of every packet, in order.
+  std::vector<uint32_t> const& getKeyIndices() const { return indices; }
+
+  /// The number of ngrams of each packet.
+  std::vector<uint32_t> const& getPacketCounts() const {
+    return packetCounts;
+  }
+
+private:
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> packetCounts;
+
+  /// The distinct keys in order of their index, and the index of each.
+  std::vector<KeyType> keys;
+  std::unordered_map<KeyType, uint32_t> keyIndices;
+};
+
+/**
+ * Writes the ngrams of a capture in a compact form so that they can be
+ * translated to dictionary ids later without ngramming the packets again.
+ * Each distinct ngram of the file is given a local key index, and only the
+ * key indices are written for each packet.
+ *
+ * The file is
+ *   - the key index (uint32) of every ngram of every packet, in order,
+ *   - the number of ngrams of each packet (uint32),
+ *   - the distinct keys: packed keys as uint64s, and string keys as a
+ *     uint32 length followed by the string,
+ *   - the number of ngrams, packets and keys (uint64 each).
+ * All in the byte order of the machine.  Spill files only live for the
+ * duration of a ReadPcap run, so they aren't versioned.
+ */
+template <typename KeyType>
+class NgramSpillWriter
+{
+public:
+  /// Key indices are renumbered and written this many at a time.
+  static const size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+  /**
+   * \param filename The path of the spill.  An existing file is replaced.
+   */
+  NgramSpillWriter(std::string const& filename);
+
+  NgramSpillWriter(NgramSpillWriter const& other) = delete;
+  NgramSpillWriter& operator=(NgramSpillWriter const& other) = delete;
+
+  /**
+   * Adds the ngrams of the next packets.  The batch's key indices are
+   * renumbered to the file's as they are written.
+   */
+  void write(NgramSpillBatch<KeyType> const& batch);
+
+  /**
+   * Writes the packet counts and keys and closes the file.
+   */
+  void finish();
+
+private:
+  std::string filename;
+  std::ofstream stream;
+
+  uint64_t numNgrams = 0;
+
+  /// The number of ngrams of each packet written so far.
+  std::vector<uint32_t> packetCounts;
+
+  /// The distinct keys in order of their index, and the index of each.
+  std::vector<KeyType> keys;
+  std::unordered_map<KeyType, uint32_t> keyIndices;
+
+  /// A piece of a batch's key indices, renumbered for writing.
+  std::vector<uint32_t> buffer;
+
+  void check() const;
+};
+
+/**
+ * Reads a spill written by NgramSpillWriter.  The keys and packet counts
+ * are read up front; the key indices are read a batch at a time.
+ */
+template <typename KeyType>
+class NgramSpillReader
+{
+public:
+  /**
+   * \param filename The path of the spill.
+   */
+  NgramSpillReader(std::string const& filename);
+
+  /**
+   * Returns the distinct keys.  Key index i refers to getKeys()[i].
+   */
+  std::vector<KeyType> const& getKeys() const { return keys; }
+
+  uint64_t getNumPackets() const { return packetCounts.size(); }
+  uint64_t getNumNgrams() const { return numNgrams; }
+
+  /**
+   * Reads the key indices of the next packets.  Whole packets are read
+   * until at least maxNgrams ngrams have been read or the spill ends.
+   * \param maxNgrams Roughly how many ngrams to read.
+   * \param keyIndices Set to the key index of every ngram read.
+   * \param packetOffsets Set so that the ngrams of packet i of the batch
+   *                      are [packetOffsets[i], packetOffsets[i + 1]) of
+   *                      keyIndices.
+   * \return Returns false once every packet has been read.
+   */
+  bool nextBatch(uint64_t maxNgrams, std::vector<uint32_t>& keyIndices,
+                 std::vector<uint64_t>& packetOffsets);
+
+private:
+  std::string filename;
+  std::ifstream stream;
+
+  uint64_t numNgrams = 0;
+  std::vector<uint32_t> packetCounts;
+  std::vector<KeyType> keys;
+
+  /// The first packet the next batch starts with.
+  uint64_t nextPacket = 0;
+
+  template <typename T>
+  void read(T* values, size_t count);
+};
+
+template <typename KeyType>
+void NgramSpillBatch<KeyType>::add(
+  std::vector<std::vector<KeyType>> const& ngrams)
+{
+  size_t numThreads = globalNumThreads;
+
+  // Where each packet's ngrams start in indices.
+  uint64_t first = indices.size();
+  std::vector<uint64_t> packetOffsets(ngrams.size() + 1, first);
+  for (size_t i = 0; i < ngrams.size(); i++) {
+    packetOffsets[i + 1] = packetOffsets[i] + ngrams[i].size();
+    packetCounts.push_back(ngrams[i].size());
+  }
+  indices.resize(packetOffsets.back());
+
+  // Packets have from none to thousands of ngrams, so the threads take
+  // chunks of about the same number of ngrams as they go.  Each thread
+  // numbers the distinct keys of its chunks, so that only those have to be
+  // looked up in the batch's keys, and remembers which chunks it took.
+  ChunkSchedule schedule(ngrams.size(), numThreads,
+    [&ngrams](size_t i) -> uint64_t { return ngrams[i].size(); });
+  std::vector<std::vector<KeyType const*>> threadKeys(numThreads);
+  std::vector<std::vector<std::pair<size_t, size_t>>> threadChunks(numThreads);
+
+  auto numberFunction = [this, &ngrams, &packetOffsets, &schedule,
+                         &threadKeys, &threadChunks](size_t threadId)
+  {
+    std::unordered_map<KeyType, uint32_t> localIndices;
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      threadChunks[threadId].push_back(std::make_pair(beg, end));
+      for (size_t i = beg; i < end; i++) {
+        for (size_t j = 0; j < ngrams[i].size(); j++) {
+          KeyType const& key = ngrams[i][j];
+          auto it = localIndices.find(key);
+          if (it == localIndices.end()) {
+            it = localIndices.insert(
+              std::make_pair(key, threadKeys[threadId].size())).first;
+            threadKeys[threadId].push_back(&key);
+          }
+          this->indices[packetOffsets[i] + j] = it->second;
+        }
+      }
+    }
+  };
+
+  parallelFor(numThreads, numberFunction);
+
+  // Map each thread's numbering to the batch's.
+  std::vector<std::vector<uint32_t>> toBatchIndex(numThreads);
+  for (size_t t = 0; t < numThreads; t++) {
+    toBatchIndex[t].resize(threadKeys[t].size());
+    for (size_t k = 0; k < threadKeys[t].size(); k++) {
+      KeyType const& key = *threadKeys[t][k];
+      auto it = keyIndices.find(key);
+      if (it == keyIndices.end()) {
+        it = keyIndices.insert(std::make_pair(key, keys.size())).first;
+        keys.push_back(key);
+      }
+      toBatchIndex[t][k] = it->second;
+    }
+  }
+
+  auto remapFunction = [this, &packetOffsets, &threadChunks,
+                        &toBatchIndex](size_t threadId)
+  {
+    std::vector<uint32_t> const& remap = toBatchIndex[threadId];
+    for (std::pair<size_t, size_t> const& chunk : threadChunks[threadId]) {
+      for (uint64_t i = packetOffsets[chunk.first]; 
+           i < packetOffsets[chunk.second]; i++)
+      {
+        this->indices[i] = remap[this->indices[i]];
+      }
+    }
+  };
+
+  parallelFor(numThreads, remapFunction);
+}
+
+template <typename KeyType>
+NgramSpillWriter<KeyType>::NgramSpillWriter(std::string const& filename)
+  : filename(filename), stream(filename, std::ios::binary | std::ios::trunc)
+{
+  if (!stream.is_open()) {
+    throw NgramSpillException("Could not open " + filename +
+                              " for writing");
+  }
+}
+
+template <typename KeyType>
+void NgramSpillWriter<KeyType>::write(NgramSpillBatch<KeyType> const& batch)
+{
+  // Number the batch's keys that are new to the file.
+  std::vector<KeyType> const& batchKeys = batch.getKeys();
+  std::vector<uint32_t> toFileIndex(batchKeys.size());
+  for (size_t k = 0; k < batchKeys.size(); k++) {
+    auto it = keyIndices.find(batchKeys[k]);
+    if (it == keyIndices.end()) {
+      it = keyIndices.insert(std::make_pair(batchKeys[k], keys.size())).first;
+      keys.push_back(batchKeys[k]);
+    }
+    toFileIndex[k] = it->second;
+  }
+
+  // Renumber and write the key indices a piece at a time.
+  size_t numThreads = globalNumThreads;
+  std::vector<uint32_t> const& indices = batch.getKeyIndices();
+  for (size_t piece = 0; piece < indices.size(); piece += WRITE_BUFFER_SIZE) {
+    size_t pieceSize = indices.size() - piece;
+    if (pieceSize > WRITE_BUFFER_SIZE) pieceSize = WRITE_BUFFER_SIZE;
+    buffer.resize(pieceSize);
+
+    auto remapFunction = [this, &indices, &toFileIndex, piece, pieceSize,
+                          numThreads](size_t threadId)
+    {
+      size_t beg = getBeginIndex(pieceSize, threadId, numThreads);
+      size_t end = getEndIndex(pieceSize, threadId, numThreads);
+      for (size_t i = beg; i < end; i++) {
+        this->buffer[i] = toFileIndex[indices[piece + i]];
+      }
+    };
+
+    parallelFor(numThreads, remapFunction);
+    writeBinary(buffer, stream);
+  }
+
+  std::vector<uint32_t> const& counts = batch.getPacketCounts();
+  packetCounts.insert(packetCounts.end(), counts.begin(), counts.end());
+  numNgrams += indices.size();
+  check();
+}
+
+template <typename KeyType>
+void NgramSpillWriter<KeyType>::finish()
+{
+  writeBinary(packetCounts, stream);
+  for (KeyType const& key : keys) {
+    details::writeSpillKey(stream, key);
+  }
+
+  uint64_t trailer[3] = { numNgrams, packetCounts.size(), keys.size() };
+  stream.write(reinterpret_cast<char const*>(trailer), sizeof(trailer));
+  stream.close();
+  check();
+}
+
+template <typename KeyType>
+void NgramSpillWriter<KeyType>::check() const
+{
+  if (!stream) {
+    throw NgramSpillException("Error writing ngram spill " + filename);
+  }
+}
+
+template <typename KeyType>
+NgramSpillReader<KeyType>::NgramSpillReader(std::string const& filename)
+  : filename(filename), stream(filename, std::ios::binary | std::ios::ate)
+{
+  if (!stream.is_open()) {
+    throw NgramSpillException("Could not open ngram spill " + filename);
+  }
+
+  uint64_t fileBytes = stream.tellg();
+  uint64_t trailer[3];
+  if (fileBytes < sizeof(trailer)) {
+    throw NgramSpillException(filename + " is too small to be an ngram"
+                              " spill");
+  }
+  stream.seekg(fileBytes - sizeof(trailer));
+  read(trailer, 3);
+  numNgrams = trailer[0];
+
+  // The packet counts and keys follow the key indices.
+  stream.seekg(numNgrams * sizeof(uint32_t));
+  packetCounts.resize(trailer[1]);
+  read(packetCounts.data(), packetCounts.size());
+  keys.resize(trailer[2]);
+  for (KeyType& key : keys) {
+    details::readSpillKey(stream, key);
+  }
+  if (!stream) {
+    throw NgramSpillException("Ngram spill " + filename + " ended early");
+  }
+
+  stream.seekg(0);
+}
+
+template <typename KeyType>
+bool NgramSpillReader<KeyType>::nextBatch(uint64_t maxNgrams,
+                                          std::vector<uint32_t>& keyIndices,
+                                          std::vector<uint64_t>& packetOffsets)
+{
+  keyIndices.clear();
+  packetOffsets.assign(1, 0);
+  if (nextPacket >= packetCounts.size()) return false;
+
+  uint64_t batchNgrams = 0;
+  while (nextPacket < packetCounts.size() &&
+         (batchNgrams < maxNgrams || packetOffsets.size() == 1))
+  {
+    batchNgrams += packetCounts[nextPacket++];
+    packetOffsets.push_back(batchNgrams);
+  }
+
+  keyIndices.resize(batchNgrams);
+  read(keyIndices.data(), batchNgrams);
+  return true;
+}
+
+template <typename KeyType>
+template <typename T>
+void NgramSpillReader<KeyType>::read(T* values, size_t count)
+{
+  stream.read(reinterpret_cast<char*>(values), count * sizeof(T));
+  if (static_cast<size_t>(stream.gcount()) != count * sizeof(T)) {
+    throw NgramSpillException("Ngram spill " + filename + " ended early");
+  }
+}
+
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/split_member.hpp>
 #include <ParallelPcap/ByteManipulations.hpp>
 
 namespace parallel_pcap {
@@ -35,6 +36,20 @@ public:
     this->includedLength = includedLength;
     this->originalLength = originalLength;
   }
+
+  /**
+   * Parses a 16 byte packet record header.
+   * \param array Points to the start of the record header.
+   * \param transform Converts the header fields to uint32.
+   */
+  PacketHeader(unsigned char const* array,
+               AbstractUint32Transformer* transform)
+  {
+    this->timestampSeconds = (*transform)(array);
+    this->timestampUseconds = (*transform)(array + 4);
+    this->includedLength = (*transform)(array + 8);
+    this->originalLength = (*transform)(array + 12);
+  }
       
   inline uint32_t getTimestampSeconds() const { return timestampSeconds; }
   inline uint32_t getTimestampUseconds() const { return timestampUseconds; }
@@ -46,12 +61,14 @@ class Packet
 {
 private:
 
-  /// The packet data (non-header).  This data is owned by the Pcap class.
-  /// we don't copy the data over or delete it in this class.
-  std::vector<unsigned char> data;
+  /// The packet data (non-header).  This data is owned by the Pcap class
+  /// (either its read buffer or its memory mapping), so we don't copy the
+  /// data over or delete it in this class.
+  unsigned char const* payload = 0;
 
-  /// Converts unsigned char array to uint32
-  AbstractUint32Transformer* transform; 
+  /// Only used when the packet is restored from an archive, in which case
+  /// there is no Pcap buffer to point into and payload points here.
+  std::vector<unsigned char> restoredData;
 
   /// The packet header info.
   PacketHeader header;
@@ -59,14 +76,27 @@ private:
   friend class boost::serialization::access;
 
   template<class Archive>
-  void serialize(Archive &ar, const unsigned int version) {
+  void save(Archive &ar, const unsigned int version) const {
+    std::vector<unsigned char> data = getData();
     ar &header &data;
   }
 
+  template<class Archive>
+  void load(Archive &ar, const unsigned int version) {
+    ar &header &restoredData;
+    payload = restoredData.data();
+  }
+
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+
 public:
   
   Packet() {} 
   Packet(unsigned char const* array, AbstractUint32Transformer* transform);
+  Packet(unsigned char const* payload, PacketHeader const& header)
+    : payload(payload), header(header) {}
+  Packet(Packet const& other);
+  Packet& operator=(Packet const& other);
   ~Packet();
 
   /**
@@ -78,12 +108,20 @@ public:
    */
   unsigned char getElement(size_t i) const {
     if (i < header.getIncludedLength()) {
-      return data[i];
+      return payload[i];
     }
     throw std::out_of_range("Tried to get data element in packet that is out"
       "of range");
   }
 
+  /**
+   * Returns a pointer to the first byte of packet data.  There are 
+   * getIncludedLength() bytes available.
+   */
+  unsigned char const* getPayload() const {
+    return payload;
+  }
+
   /**
    * Returns the header associated with this packet.
    */
@@ -91,8 +129,12 @@ public:
     return header;
   }
 
+  /**
+   * Returns a copy of the packet data.
+   */
   std::vector<unsigned char> getData() const {
-    return data;
+    return std::vector<unsigned char>(payload, 
+                                      payload + header.getIncludedLength());
   }
 
   uint32_t getTimestampSeconds() const { 
@@ -113,27 +155,31 @@ public:
 
 };
 
+/**
+ * Parses the 16 byte packet record header at array.  The packet data that
+ * follows the header is referenced, not copied, so array must stay valid
+ * for the lifetime of the packet.
+ */
 Packet::Packet(unsigned char const* array, AbstractUint32Transformer* transform)
+  : payload(array + 16), header(array, transform)
 {
-  this->transform = transform;
-  uint32_t timestampSeconds = (*transform)(array);
-  array = array + 4;
-  uint32_t timestampUseconds = (*transform)(array);
-  array = array + 4;
-  uint32_t includedLength = (*transform)(array);
-  array = array + 4;
-  uint32_t originalLength = (*transform)(array);
-  array = array + 4;
-
-  header = PacketHeader(timestampSeconds,
-                        timestampUseconds,
-                        includedLength,
-                        originalLength);
-
-  // Store in vector as opposed to char array for seralization
-  for (int i = 0; i < includedLength; i++) 
-    this->data.push_back(array[i]);
+}
 
+Packet::Packet(Packet const& other)
+  : restoredData(other.restoredData), header(other.header)
+{
+  // Restored packets own their bytes, so point at our copy of them.
+  payload = other.restoredData.empty() ? other.payload : restoredData.data();
+}
+
+Packet& Packet::operator=(Packet const& other)
+{
+  if (this != &other) {
+    restoredData = other.restoredData;
+    header = other.header;
+    payload = other.restoredData.empty() ? other.payload : restoredData.data();
+  }
+  return *this;
 }
 
 Packet::~Packet() { }
@@ -4,6 +4,9 @@
 #include <ParallelPcap/PacketInfo.hpp>
 #include <ParallelPcap/DARPA2009.hpp>
 #include <ParallelPcap/Pcap.hpp>
+#include <ParallelPcap/PacketStore.hpp>
+#include <ParallelPcap/TokenTable.hpp>
+#include <ParallelPcap/TokenStore.hpp>
 #include <ParallelPcap/Util.hpp>
 #include <stdexcept>
 #include <iostream>
@@ -35,7 +38,31 @@ private:
   np::ndarray embeddings;
   Messenger msg;
 
-  void assignLabel(Pcap const &pcap, p::ssize_t i);
+  /**
+   * Returns the labels of packets, which is a PacketTable or a PacketStore.
+   */
+  template <typename Packets>
+  np::ndarray labelPackets(Packets const &packets);
+
+  template <typename Packets>
+  p::list packetEventTypes(Packets const &packets);
+
+  /**
+   * Restores a pcap object file written by ReadPcap before it wrote packet
+   * stores (a Boost text archive of a Pcap).
+   * \param pcapFile The pcap object file.
+   * \param restoredPcap The Pcap to restore into.  Pcaps can't be copied,
+   *                     so it isn't returned.
+   */
+  static void restorePcap(std::string const &pcapFile, Pcap &restoredPcap);
+
+  /**
+   * Copies the ids of each packet into a row of X, for generateXTokens().
+   * \param X The rows, numColumns ints each, all zero.
+   * \param rows The packets of a TokenStore.
+   */
+  template <typename Rows>
+  static void copyTokens(int *X, size_t numColumns, Rows const &rows);
   
   // Figure these out
   static np::ndarray convertToVector(np::ndarray &embeddings, std::vector<size_t>& ngrammedPacket);
@@ -64,7 +91,8 @@ public:
    * Returns the constructed X ndarray.  Each row has the features for an
    * individual packet.
    * \param token_path This is the path to the file with the vector of vector 
-   *                   of ints.
+   *                   of ints: a token store (see TokenStore.hpp) written by
+   *                   ReadPcap, or an older Boost archive.
    * \param Returns an numpy ndarray with the X matrix.
    */
   np::ndarray generateX(std::string token_path);
@@ -73,7 +101,7 @@ public:
    * Returns the constructed X ndarray containing integer tokens.
    * Each row has the tokens for an individual packet.
    * \param token_path This is the path to the file with the vector of vector 
-   *                   of ints.
+   *                   of ints, as for generateX().
    * \param Returns an numpy ndarray with the feature vector.
    */
 
@@ -89,6 +117,28 @@ public:
    */
   static np::ndarray translateX(np::ndarray &embeddings, std::vector<std::vector<size_t>> &tokens, bool debug);
 
+  /**
+   * Returns the constructed X ndarray for the token ids of a TokenTable,
+   * like translateX() above.  The rows are filled in place.
+   * \param embeddings A numpy array that has the embeddings.
+   * \param tokens The ids of the ngrams of each packet.
+   */
+  static np::ndarray translateX(np::ndarray &embeddings, 
+                                TokenTable const &tokens, bool debug);
+
+  /**
+   * Sets each row of X to the average of the embeddings of a packet's ids,
+   * as translateX() does.  Takes no Python objects, so it can run on any
+   * thread.
+   * \param X tokens.size() rows of numColumns floats, all zero.
+   * \param embeddings The embeddings, numColumns floats per id.
+   * \param tokens The ids of the ngrams of each packet, a TokenTable or the
+   *               rows of a TokenStore.
+   */
+  template <typename Tokens>
+  static void averageEmbeddings(float *X, float const *embeddings,
+                                int numColumns, Tokens const &tokens);
+
   /**
    * Returns the constructed y ndarray.  It reads the pcap object file.  The 
    * object is found in Pcap.hpp. Static method used to construct labels during
@@ -98,8 +148,27 @@ public:
   static np::ndarray translateY(Pcap const &pcap, DARPA2009 &darpa, bool debug); 
 
   /**
-   * Returns the constructed y ndarray.  It reads the pcap object file.  The 
-   * object is found in Pcap.hpp.
+   * Returns the constructed y ndarray for the packets of a packet table,
+   * e.g. one batch of a PcapStream.
+   * \param packets The packets to label.
+   */
+  static np::ndarray translateY(PacketTable const &packets, DARPA2009 &darpa,
+                                bool debug); 
+
+  /**
+   * Sets y[i] to 1 if packet i is malicious and to 0 if not, as
+   * translateY() does.  Takes no Python objects, so it can run on any
+   * thread.
+   * \param packets The packets to label.
+   * \param y packets.size() labels.
+   */
+  static void labelPackets(PacketTable const &packets, DARPA2009 &darpa,
+                           float *y);
+
+  /**
+   * Returns the constructed y ndarray.  It reads the pcap object file, which
+   * is a packet store (see PacketStore.hpp) written by ReadPcap.  Older
+   * Boost archives of a Pcap are read too.
    * \param pcapFile The path location of the pcap object file.
    */
   np::ndarray generateY(std::string pcapFile);
@@ -150,24 +219,34 @@ np::ndarray Packet2Vec::convertToVector(
   return allwordvec;
 }
 
-void Packet2Vec::assignLabel(Pcap const &pcap, p::ssize_t i)
+np::ndarray Packet2Vec::generateX(std::string token_path)
 {
-  PacketHeader pkthdr = pcap.getPacketHeader(i);
-  std::vector<unsigned char> pkt = pcap.getPacket(i);
-
-  // Refactor packet info to accomodate char vector instead
-  PacketInfo packetInfo = PacketInfo::parse_packet(pkthdr.getTimestampSeconds(),
-                                                   pkt);
-
-  if (this->darpa.is_danger(packetInfo)) {
-    this->y[i] = 1;
-  } else {
-    this->y[i] = 0;
+  if (TokenStore::isTokenStore(token_path)) {
+    TokenStore tokens(token_path);
+    int shape = this->embeddings.shape(1);
+
+    this->X = np::zeros(p::make_tuple(tokens.size(), shape),
+                        np::dtype::get_builtin<float>());
+    std::string message = "Initialized X - Shape: (" + 
+                          std::to_string(this->X.shape(0)) + ", " + 
+                          std::to_string(this->X.shape(1)) + ")"; 
+    this->msg.printMessage(message);
+
+    this->msg.printMessage("Converting Packets to Vectors");
+    float *X_ptr = reinterpret_cast<float *>(this->X.get_data());
+    float const *embeddings_ptr = 
+      reinterpret_cast<float const *>(this->embeddings.get_data());
+    if (tokens.getIdBytes() == sizeof(uint16_t)) {
+      averageEmbeddings(X_ptr, embeddings_ptr, shape,
+                        tokens.getRows<uint16_t>());
+    } else {
+      averageEmbeddings(X_ptr, embeddings_ptr, shape,
+                        tokens.getRows<uint32_t>());
+    }
+    this->msg.printMessage("Finished Loop");
+    return this->X;
   }
-}
 
-np::ndarray Packet2Vec::generateX(std::string token_path)
-{
   std::vector<std::vector<size_t>> packets;
   {
     std::ifstream ifs(token_path);
@@ -255,8 +334,88 @@ np::ndarray Packet2Vec::translateX(
   return X;
 }
 
+np::ndarray Packet2Vec::translateX(
+  np::ndarray &embeddings, 
+  TokenTable const &tokens,
+  bool debug
+) {
+  Messenger msg(debug);
+  size_t numPackets = tokens.size();
+  int shape = embeddings.shape(1);
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  np::ndarray X = np::zeros(p::make_tuple(numPackets, shape), 
+                      np::dtype::get_builtin<float>());
+  std::string message = "Initialized X - Shape: (" + std::to_string(X.shape(0))
+                  + ", " + std::to_string(X.shape(1)) + ")"; 
+  msg.printMessage(message);
+  auto t2 = std::chrono::high_resolution_clock::now();
+  msg.printDuration("Packet2Vec::translateX: Time to create X with zeros: ", 
+                t1, t2);
+
+  t1 = std::chrono::high_resolution_clock::now();
+  averageEmbeddings(reinterpret_cast<float *>(X.get_data()),
+                    reinterpret_cast<float const *>(embeddings.get_data()),
+                    shape, tokens);
+  t2 = std::chrono::high_resolution_clock::now();
+  msg.printDuration("Packet2Vec::translateX: Time for for loop: ", t1, t2);
+
+  return X;
+}
+
+template <typename Tokens>
+void Packet2Vec::averageEmbeddings(float *X_ptr, float const *embeddings_ptr,
+                                   int shape, Tokens const &tokens)
+{
+  // Each row is the average of the embeddings of the packet's ids, as in
+  // convertToVector().
+  size_t numPackets = tokens.size();
+  for (size_t i = 0; i < numPackets; i++)
+  {
+    float *row = X_ptr + i * shape;
+    auto const *ids = tokens.getPacketIds(i);
+    size_t numwords = tokens.getPacketSize(i);
+    for (size_t k = 0; k < numwords; k++)
+    {
+      float const *embedding = embeddings_ptr + shape * ids[k];
+      for (int j = 0; j < shape; j++)
+      {
+        row[j] = row[j] + embedding[j];
+      }
+    }
+    for (int j = 0; j < shape; j++)
+    {
+      row[j] = row[j] / static_cast<int>(numwords);
+    }
+  }
+}
+
 np::ndarray Packet2Vec::generateXTokens(std::string token_path) 
 {
+  if (TokenStore::isTokenStore(token_path)) {
+    TokenStore tokens(token_path);
+    size_t numPackets = tokens.size();
+    size_t largest_size = tokens.getMaxPacketSize();
+
+    // Rows are zero-padded to the largest packet, as below.
+    this->X = np::zeros(p::make_tuple(numPackets, largest_size), 
+                        np::dtype::get_builtin<int>());
+    std::string message = "Initialized X - Shape: (" + 
+                          std::to_string(this->X.shape(0)) + ", " + 
+                          std::to_string(this->X.shape(1)) + ")"; 
+    this->msg.printMessage(message);
+
+    this->msg.printMessage("Converting Packets to Vectors");
+    int *X_ptr = reinterpret_cast<int *>(this->X.get_data());
+    if (tokens.getIdBytes() == sizeof(uint16_t)) {
+      copyTokens(X_ptr, largest_size, tokens.getRows<uint16_t>());
+    } else {
+      copyTokens(X_ptr, largest_size, tokens.getRows<uint32_t>());
+    }
+    this->msg.printMessage("Finished Loop");
+    return this->X;
+  }
+
   std::vector<std::vector<size_t>> packets;
   {
     std::ifstream ifs(token_path);
@@ -310,19 +469,44 @@ np::ndarray Packet2Vec::generateXTokens(std::string token_path)
   return this->X;
 }
 
-np::ndarray Packet2Vec::generateY(std::string pcapFile)
+template <typename Rows>
+void Packet2Vec::copyTokens(int *X_ptr, size_t numColumns, Rows const &rows)
 {
-  // Restore pcap from file
-  Pcap restoredPcap;
+  for (size_t i = 0; i < rows.size(); i++)
   {
-    std::ifstream ifs(pcapFile);
-    ba::text_iarchive ar(ifs);
+    auto const *ids = rows.getPacketIds(i);
+    int *row = X_ptr + i * numColumns;
+    for (size_t j = 0; j < rows.getPacketSize(i); j++)
+    {
+      row[j] = ids[j];
+    }
+  }
+}
+
+void Packet2Vec::restorePcap(std::string const &pcapFile, Pcap &restoredPcap)
+{
+  std::ifstream ifs(pcapFile);
+  ba::text_iarchive ar(ifs);
 
-    ar >> restoredPcap;
-    restoredPcap.setRestored(true);
+  ar >> restoredPcap;
+  restoredPcap.setRestored(true);
+}
+
+np::ndarray Packet2Vec::generateY(std::string pcapFile)
+{
+  if (PacketStore::isPacketStore(pcapFile)) {
+    PacketStore store(pcapFile);
+    return this->labelPackets(store);
   }
+  Pcap restoredPcap;
+  restorePcap(pcapFile, restoredPcap);
+  return this->labelPackets(restoredPcap.getPacketTable());
+}
 
-  int numPackets = restoredPcap.getNumPackets();
+template <typename Packets>
+np::ndarray Packet2Vec::labelPackets(Packets const &packets)
+{
+  p::ssize_t numPackets = packets.size();
 
   this->y = np::zeros(p::make_tuple(numPackets), 
                       np::dtype::get_builtin<int>());
@@ -330,18 +514,29 @@ np::ndarray Packet2Vec::generateY(std::string pcapFile)
                         + ")";
   this->msg.printMessage(message);
 
-  // some loop to assign the labels
-  for (p::ssize_t i = 0; i < numPackets; i++)
-    this->assignLabel(restoredPcap, i);
-  
+  // Assign the labels
+  int *y_ptr = reinterpret_cast<int *>(this->y.get_data());
+  for (p::ssize_t i = 0; i < numPackets; i++) {
+    PacketInfo packetInfo = PacketInfo::parse_packet(
+      packets.getTimestampSeconds(i), packets.getPayload(i), 
+      packets.getIncludedLength(i));
+
+    y_ptr[i] = this->darpa.is_danger(packetInfo) ? 1 : 0;
+  }
 
   return this->y;
 }
 
 np::ndarray Packet2Vec::translateY(Pcap const &pcap, DARPA2009 &darpa, bool debug) 
+{
+  return translateY(pcap.getPacketTable(), darpa, debug);
+}
+
+np::ndarray Packet2Vec::translateY(PacketTable const &packets, 
+                                   DARPA2009 &darpa, bool debug) 
 {
   Messenger msg(debug);
-  int numPackets = pcap.getNumPackets();
+  int numPackets = packets.size();
 
   np::ndarray y = np::zeros(p::make_tuple(numPackets),
                             np::dtype::get_builtin<float>());
@@ -349,47 +544,44 @@ np::ndarray Packet2Vec::translateY(Pcap const &pcap, DARPA2009 &darpa, bool debu
                         + ")";
   msg.printMessage(message);
   
-  for (p::ssize_t i = 0; i < numPackets; i++) {
-    PacketHeader pkthdr = pcap.getPacketHeader(i);
-    std::vector<unsigned char> pkt = pcap.getPacket(i);
+  labelPackets(packets, darpa, reinterpret_cast<float *>(y.get_data()));
 
-    // Refactor packet info to accomodate char vector instead
-    PacketInfo packetInfo = PacketInfo::parse_packet(pkthdr.getTimestampSeconds(),
-                                                    pkt);
+  return y;
+}
 
-    if (darpa.is_danger(packetInfo)) {
-      y[i] = 1;
-    } else {
-      y[i] = 0;
-    }
-  }
+void Packet2Vec::labelPackets(PacketTable const &packets, DARPA2009 &darpa,
+                              float *y)
+{
+  for (size_t i = 0; i < packets.size(); i++) {
+    PacketInfo packetInfo = PacketInfo::parse_packet(
+      packets.getTimestampSeconds(i), packets.getPayload(i), 
+      packets.getIncludedLength(i));
 
-  return y;
+    y[i] = darpa.is_danger(packetInfo) ? 1 : 0;
+  }
 }
 
 p::list Packet2Vec::attacks(std::string pcapFile) 
 {
-  // Restore pcap from file
-  Pcap restoredPcap;
-  {
-    std::ifstream ifs(pcapFile);
-    ba::text_iarchive ar(ifs);
-
-    ar >> restoredPcap;
-    restoredPcap.setRestored(true);
+  if (PacketStore::isPacketStore(pcapFile)) {
+    PacketStore store(pcapFile);
+    return this->packetEventTypes(store);
   }
+  Pcap restoredPcap;
+  restorePcap(pcapFile, restoredPcap);
+  return this->packetEventTypes(restoredPcap.getPacketTable());
+}
 
-  int numPackets = restoredPcap.getNumPackets();
+template <typename Packets>
+p::list Packet2Vec::packetEventTypes(Packets const &packets)
+{
   p::list l;
 
   // Generate the packet event types
-  for (p::ssize_t i = 0; i < numPackets; i++) {
-    PacketHeader pkthdr = restoredPcap.getPacketHeader(i);
-    std::vector<unsigned char> pkt = restoredPcap.getPacket(i);
-
-    // Refactor packet info to accomodate char vector instead
-    PacketInfo packetInfo = PacketInfo::parse_packet(pkthdr.getTimestampSeconds(),
-                                                    pkt);
+  for (size_t i = 0; i < packets.size(); i++) {
+    PacketInfo packetInfo = PacketInfo::parse_packet(
+      packets.getTimestampSeconds(i), packets.getPayload(i), 
+      packets.getIncludedLength(i));
 
     l.append(this->darpa.packet_event_type(packetInfo));
   }
@@ -0,0 +1,315 @@
+#ifndef PARALLELPCAP_PACKET_INDEX_HPP
+#define PARALLELPCAP_PACKET_INDEX_HPP
+
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <thread>
+#include <functional>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ParallelPcap/PacketTable.hpp>
+#include <ParallelPcap/Util.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The header of a packet index file.  Holds what is needed to check that
+ * the index still matches its capture file, and the capture's header
+ * fields, so that opening the capture with the index doesn't need to look
+ * at anything but the first bytes of the capture.
+ */
+class PacketIndexHeader
+{
+public:
+  /// The canonical path of the capture (see PacketIndex::canonicalPath()).
+  /// Indexes of different captures with the same name can share a
+  /// directory, so this is checked before the index is used.
+  std::string capturePath;
+
+  /// Size and modification time of the capture when it was indexed.
+  uint64_t fileSize = 0;
+  int64_t mtimeSeconds = 0;
+  int64_t mtimeNanoseconds = 0;
+
+  uint64_t numPackets = 0;
+
+  // Capture header fields, as Pcap has them.
+  uint32_t magicNumber = 0;
+  uint16_t majorVersion = 0;
+  uint16_t minorVersion = 0;
+  int32_t  timeZoneCorrection = 0;
+  uint32_t sigfigs = 0;
+  uint32_t snaplen = 0;
+  uint32_t network = 0;
+
+  /**
+   * Sets fileSize and the modification time from the file.
+   * \return Returns false if the file couldn't be stat'ed.
+   */
+  bool stamp(std::string const& filename);
+
+  /**
+   * Returns true if the file still has the size and modification time
+   * this header was stamped with.
+   */
+  bool matches(std::string const& filename) const;
+
+  void write(std::ostream& stream) const;
+
+  /**
+   * \return Returns false if the stream doesn't start with a header of this
+   *         version written on a machine with the same byte order.
+   */
+  bool read(std::istream& stream);
+
+private:
+  /// The first 8 bytes of an index file.
+  static char const* magic() { return "PPCAPIDX"; }
+  static const size_t MAGIC_SIZE = 8;
+
+  static const uint32_t VERSION = 2;
+
+  /// Longest capturePath read() accepts.  Longer ones mean the index is
+  /// corrupt.
+  static const uint64_t MAX_PATH_BYTES = 1 << 16;
+
+  /// Written as a uint32 to detect an index from a machine with the other
+  /// byte order.
+  static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+  template <typename T>
+  static void writeField(std::ostream& stream, T const& value) {
+    stream.write(reinterpret_cast<char const*>(&value), sizeof(T));
+  }
+
+  template <typename T>
+  static void readField(std::istream& stream, T& value) {
+    stream.read(reinterpret_cast<char*>(&value), sizeof(T));
+  }
+};
+
+/**
+ * Reads and writes packet index files.  An index records the offset,
+ * lengths and timestamps of every packet of a capture, so that later opens
+ * of the capture can skip finding the packet boundaries.  It lives in
+ * globalPacketIndexDir, or next to the capture if that isn't set (see
+ * getIndexPath()), and is ignored once the capture's size or modification
+ * time changes, or if it was written for a different capture.
+ *
+ * The file is the PacketIndexHeader followed by the PacketTable arrays,
+ * all in the byte order of the machine that wrote it.
+ */
+class PacketIndex
+{
+public:
+  /**
+   * Returns the path of the index of a capture file.  In
+   * globalPacketIndexDir it is <file>.<hash>.ppidx, where <hash> is a hash
+   * of the capture's canonical path, so captures with the same name in
+   * different directories get different indexes.  Next to the capture it
+   * is <file>.ppidx.
+   */
+  static std::string getIndexPath(std::string const& captureFile);
+
+  /**
+   * Returns the absolute path of a file with symbolic links and . and ..
+   * resolved, or the path as given if it can't be resolved.
+   */
+  static std::string canonicalPath(std::string const& filename);
+
+  /**
+   * Reads the index of a capture file.
+   * \param captureFile The path to the capture.
+   * \param header Set to the index header.
+   * \param table Gets the packet arrays.  Its byte buffer is left as is.
+   * \return Returns false if there is no index, or it is stale or corrupt.
+   */
+  static bool read(std::string const& captureFile, PacketIndexHeader& header,
+                   PacketTable& table);
+
+  /**
+   * Writes the index of a capture file.  The index is written to a
+   * temporary file named for the process and thread and renamed into
+   * place, so a reader never sees a partial index and concurrent writers
+   * of the same index don't write into each other's file.
+   * \param captureFile The path to the capture.
+   * \param header The capture's header fields.  The path, size,
+   *               modification time and number of packets are filled in.
+   * \param table The packets of the whole capture.
+   * \return Returns false if the index couldn't be written (e.g. the
+   *         directory is read only).  globalPacketIndexDir is created if
+   *         it doesn't exist; its parent has to.
+   */
+  static bool write(std::string const& captureFile, PacketIndexHeader header,
+                    PacketTable const& table);
+};
+
+inline bool PacketIndexHeader::stamp(std::string const& filename)
+{
+  struct stat st;
+  if (::stat(filename.c_str(), &st) != 0) return false;
+  fileSize = st.st_size;
+  mtimeSeconds = st.st_mtim.tv_sec;
+  mtimeNanoseconds = st.st_mtim.tv_nsec;
+  return true;
+}
+
+inline bool PacketIndexHeader::matches(std::string const& filename) const
+{
+  PacketIndexHeader current;
+  return current.stamp(filename) && current.fileSize == fileSize &&
+         current.mtimeSeconds == mtimeSeconds &&
+         current.mtimeNanoseconds == mtimeNanoseconds;
+}
+
+inline void PacketIndexHeader::write(std::ostream& stream) const
+{
+  uint32_t version = VERSION;
+  uint32_t byteOrder = BYTE_ORDER_MARK;
+  stream.write(magic(), MAGIC_SIZE);
+  writeField(stream, version);
+  writeField(stream, byteOrder);
+  uint64_t pathBytes = capturePath.size();
+  writeField(stream, pathBytes);
+  stream.write(capturePath.data(), pathBytes);
+  writeField(stream, fileSize);
+  writeField(stream, mtimeSeconds);
+  writeField(stream, mtimeNanoseconds);
+  writeField(stream, numPackets);
+  writeField(stream, magicNumber);
+  writeField(stream, majorVersion);
+  writeField(stream, minorVersion);
+  writeField(stream, timeZoneCorrection);
+  writeField(stream, sigfigs);
+  writeField(stream, snaplen);
+  writeField(stream, network);
+}
+
+inline bool PacketIndexHeader::read(std::istream& stream)
+{
+  char fileMagic[MAGIC_SIZE];
+  uint32_t version = 0;
+  uint32_t byteOrder = 0;
+  stream.read(fileMagic, MAGIC_SIZE);
+  readField(stream, version);
+  readField(stream, byteOrder);
+  if (!stream || std::memcmp(fileMagic, magic(), MAGIC_SIZE) != 0 ||
+      version != VERSION || byteOrder != BYTE_ORDER_MARK)
+  {
+    return false;
+  }
+
+  uint64_t pathBytes = 0;
+  readField(stream, pathBytes);
+  if (!stream || pathBytes > MAX_PATH_BYTES) return false;
+  capturePath.resize(pathBytes);
+  stream.read(&capturePath[0], pathBytes);
+
+  readField(stream, fileSize);
+  readField(stream, mtimeSeconds);
+  readField(stream, mtimeNanoseconds);
+  readField(stream, numPackets);
+  readField(stream, magicNumber);
+  readField(stream, majorVersion);
+  readField(stream, minorVersion);
+  readField(stream, timeZoneCorrection);
+  readField(stream, sigfigs);
+  readField(stream, snaplen);
+  readField(stream, network);
+  return static_cast<bool>(stream);
+}
+
+inline std::string PacketIndex::canonicalPath(std::string const& filename)
+{
+  char resolved[PATH_MAX];
+  if (::realpath(filename.c_str(), resolved) == 0) return filename;
+  return resolved;
+}
+
+inline std::string PacketIndex::getIndexPath(std::string const& captureFile)
+{
+  if (globalPacketIndexDir.empty()) return captureFile + ".ppidx";
+
+  size_t slash = captureFile.find_last_of('/');
+  std::string name = slash == std::string::npos ? captureFile : 
+                                                  captureFile.substr(slash + 1);
+
+  // 64 bit FNV-1a, which unlike std::hash is the same in every build.
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : canonicalPath(captureFile)) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  }
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx", 
+                static_cast<unsigned long long>(hash));
+
+  return globalPacketIndexDir + "/" + name + "." + hex + ".ppidx";
+}
+
+inline bool PacketIndex::read(std::string const& captureFile,
+                              PacketIndexHeader& header, PacketTable& table)
+{
+  std::ifstream stream(getIndexPath(captureFile), 
+                       std::ios::binary | std::ios::ate);
+  if (!stream.is_open()) return false;
+  uint64_t indexBytes = stream.tellg();
+  stream.seekg(0, std::ios::beg);
+
+  if (!header.read(stream) || 
+      header.capturePath != canonicalPath(captureFile) ||
+      !header.matches(captureFile))
+  {
+    return false;
+  }
+
+  // Every packet takes 24 bytes of index, so a packet count that doesn't
+  // fit in the file means the index is corrupt.
+  if (header.numPackets > indexBytes / 24) return false;
+
+  if (!table.loadColumns(stream, header.numPackets)) {
+    table.clear();
+    return false;
+  }
+  return true;
+}
+
+inline bool PacketIndex::write(std::string const& captureFile,
+                               PacketIndexHeader header,
+                               PacketTable const& table)
+{
+  if (!header.stamp(captureFile)) return false;
+  header.capturePath = canonicalPath(captureFile);
+  header.numPackets = table.size();
+
+  if (!globalPacketIndexDir.empty()) {
+    ::mkdir(globalPacketIndexDir.c_str(), 0777);
+  }
+
+  std::string path = getIndexPath(captureFile);
+  std::string tmpPath = path + ".tmp." + std::to_string(::getpid()) + "." +
+    std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream stream(tmpPath, std::ios::binary);
+    if (!stream.is_open()) return false;
+    header.write(stream);
+    table.saveColumns(stream);
+    if (!stream) {
+      stream.close();
+      std::remove(tmpPath.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+}
+
+#endif
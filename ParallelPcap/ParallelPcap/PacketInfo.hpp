@@ -29,6 +29,16 @@ public:
    */
   static PacketInfo parse_packet(unsigned int pkthdr, std::vector<unsigned char> const &packetVector);
 
+  /**
+   * Returns a PacketInfo object.  Parses the supplied packet data in place.
+   * \param timestamp The packet timestamp in seconds.
+   * \param packet Points to the packet data.
+   * \param length The number of bytes of packet data.
+   * \param Returns a PacketInfo object.
+   */
+  static PacketInfo parse_packet(unsigned int timestamp, 
+                                 unsigned char const* packet, size_t length);
+
   unsigned int getProtocol() { return this->protocol; }
   std::string getSourceIp() { return this->sourceIp; }
   unsigned int getSourcePort() { return this->sourcePort; }
@@ -56,15 +66,18 @@ PacketInfo::~PacketInfo() { }
 
 PacketInfo PacketInfo::parse_packet(unsigned int timestamp, std::vector<unsigned char> const &packetVector)
 {
-  // Convert vector to char array
-  unsigned const char* packet = &packetVector[0];
+  return parse_packet(timestamp, packetVector.data(), packetVector.size());
+}
 
+PacketInfo PacketInfo::parse_packet(unsigned int timestamp, 
+                                    unsigned char const* packet, size_t length)
+{
   const struct ether_header* ethernetHeader;
   const struct ip* ipHeader;
   const struct tcphdr* tcpHeader;
   const struct udphdr* udpHeader;
 
-  unsigned int protocol;
+  unsigned int protocol = 0;
   unsigned int sourcePort = 0;
   unsigned int destPort = 0;
   std::string sourceIp;
@@ -73,7 +86,8 @@ PacketInfo PacketInfo::parse_packet(unsigned int timestamp, std::vector<unsigned
   ethernetHeader = (struct ether_header*)packet;
 
   // Only want to parse IP packets
-  if (ntohs(ethernetHeader->ether_type) == ETHERTYPE_IP)
+  if (length >= sizeof(struct ether_header) + sizeof(struct ip) &&
+      ntohs(ethernetHeader->ether_type) == ETHERTYPE_IP)
   {
     // Parse IP header
     ipHeader = (struct ip*)(packet + sizeof(struct ether_header));
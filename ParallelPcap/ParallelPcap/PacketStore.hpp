@@ -0,0 +1,460 @@
+#ifndef PARALLELPCAP_PACKET_STORE_HPP
+#define PARALLELPCAP_PACKET_STORE_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <ParallelPcap/PacketTable.hpp>
+#include <ParallelPcap/MappedFile.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The exception type generated by the packet store classes.
+ */
+class PacketStoreException : public std::runtime_error {
+public:
+  PacketStoreException(char const* message) : std::runtime_error(message) {}
+  PacketStoreException(std::string message) : std::runtime_error(message) {}
+};
+
+/**
+ * The fixed size header at the start of a packet store file.  It is
+ * written and read as is, in the byte order of the machine.
+ */
+struct PacketStoreHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrderMark;
+
+  uint64_t numPackets;
+  uint64_t payloadBytes; ///< Bytes of packet data
+
+  // Fields of the capture the packets came from.
+  uint64_t numBytes; ///< Size of the (decompressed) capture
+  uint32_t magicNumber;
+  uint16_t majorVersion;
+  uint16_t minorVersion;
+  int32_t  timeZoneCorrection;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t network;
+};
+
+static_assert(sizeof(PacketStoreHeader) == 64,
+              "PacketStoreHeader must not have padding");
+
+namespace details {
+
+inline char const* packetStoreMagic() { return "PPCAPPKT"; }
+
+const uint32_t PACKET_STORE_VERSION = 2;
+const uint32_t PACKET_STORE_BYTE_ORDER_MARK = 0x01020304;
+
+/// Bytes of packet arrays per packet: the offset and four 32 bit fields.
+const uint64_t PACKET_STORE_BYTES_PER_PACKET = 24;
+
+/// Bytes of packet data plus the padding that 8 byte aligns the arrays
+/// that follow it.
+inline uint64_t packetStorePaddedBytes(uint64_t payloadBytes) {
+  return (payloadBytes + 7) & ~uint64_t(7);
+}
+
+}
+
+/**
+ * Writes a packet store: the packets of a capture in a binary layout that
+ * PacketStore can memory map and use without deserializing anything.
+ *
+ * The file is
+ *   - a PacketStoreHeader,
+ *   - the data of every packet, back to back, padded to a multiple of 8
+ *     bytes,
+ *   - the packet arrays, one after another: offsets (uint64), included
+ *     lengths, original lengths, timestamp seconds and timestamp
+ *     microseconds (uint32).  Offsets are relative to the packet data.
+ *
+ * Packet data is gathered into large buffers and appended as packets are
+ * added.  The arrays of each batch go to a temporary file next to the
+ * store and are copied into place by finish(), so the number of packets
+ * doesn't have to be known up front and only a batch of packets is in
+ * memory at a time.  The header is written last; a store that was never
+ * finished has a zeroed header and won't open.
+ */
+class PacketStoreWriter
+{
+public:
+  /// Packet data is written once this many bytes are buffered.
+  static const size_t WRITE_BUFFER_SIZE = 1 << 22;
+
+  /**
+   * \param filename The path of the store.  An existing file is replaced.
+   */
+  PacketStoreWriter(std::string const& filename);
+
+  ~PacketStoreWriter();
+
+  PacketStoreWriter(PacketStoreWriter const& other) = delete;
+  PacketStoreWriter& operator=(PacketStoreWriter const& other) = delete;
+
+  /**
+   * Adds packets to the end of the store.  Can be called once with all of
+   * a capture's packets or once per batch of a PcapStream.
+   */
+  void write(PacketTable const& packets);
+
+  /**
+   * Writes the packet arrays and the header, and closes the file.
+   * \param capture The Pcap or PcapStream the packets came from, for its
+   *                header fields.
+   */
+  template <typename Capture>
+  void finish(Capture const& capture);
+
+private:
+  std::string filename;
+  std::ofstream stream;
+
+  /// The arrays of each batch, one batch after another.
+  std::string arraysFilename;
+  std::fstream arraysStream;
+  std::vector<size_t> batchSizes;
+
+  uint64_t numPackets = 0;
+
+  /// Packet data not yet written.
+  std::vector<char> buffer;
+
+  /// Bytes of packet data added so far, written or buffered.
+  uint64_t payloadBytes = 0;
+
+  /**
+   * Copies the batches' arrays from the temporary file to the store.
+   * \param arraysPos Where the arrays start in the store.
+   */
+  void copyArrays(uint64_t arraysPos);
+
+  void flush();
+  void check() const;
+};
+
+/**
+ * A read-only view of a packet store written by PacketStoreWriter.  The
+ * file is memory mapped and the packets are read straight from the
+ * mapping, so opening a store costs the same no matter how many packets it
+ * has.  The accessors match those of PacketTable.
+ */
+class PacketStore
+{
+public:
+  /**
+   * Maps the store and checks its header.  Throws a PacketStoreException
+   * if the file isn't a packet store of this version and byte order, its
+   * size doesn't match the header, or the first and last packets don't
+   * bound the packet data.  The other packets aren't looked at; see
+   * validate().
+   * \param filename The path of the store.
+   */
+  PacketStore(std::string const& filename);
+
+  /**
+   * Checks that every packet lies within the packet data, which takes a
+   * pass over the offsets and lengths.  Throws a PacketStoreException if
+   * one doesn't.
+   */
+  void validate() const;
+
+  /**
+   * Returns true if the file starts with the packet store magic.  Files
+   * written by older versions of ReadPcap (Boost text archives) don't.
+   */
+  static bool isPacketStore(std::string const& filename);
+
+  size_t size() const { return header.numPackets; }
+  size_t getNumPackets() const { return header.numPackets; }
+
+  uint64_t getNumBytes() const { return header.numBytes; }
+  uint32_t getMagicNumber() const { return header.magicNumber; }
+  uint16_t getMajorVersion() const { return header.majorVersion; }
+  uint16_t getMinorVersion() const { return header.minorVersion; }
+  int32_t getTimeZoneCorrection() const { return header.timeZoneCorrection; }
+  uint32_t getSigfigs() const { return header.sigfigs; }
+  uint32_t getSnaplen() const { return header.snaplen; }
+  uint32_t getNetwork() const { return header.network; }
+
+  uint64_t getOffset(size_t i) const { return offsets[i]; }
+  uint32_t getIncludedLength(size_t i) const { return includedLengths[i]; }
+  uint32_t getOriginalLength(size_t i) const { return originalLengths[i]; }
+  uint32_t getTimestampSeconds(size_t i) const { return timestampSeconds[i]; }
+  uint32_t getTimestampUseconds(size_t i) const {
+    return timestampUseconds[i];
+  }
+
+  unsigned char const* getPayload(size_t i) const {
+    return payload + offsets[i];
+  }
+
+  PacketHeader getHeader(size_t i) const {
+    return PacketHeader(timestampSeconds[i], timestampUseconds[i],
+                        includedLengths[i], originalLengths[i]);
+  }
+
+  Packet getPacket(size_t i) const {
+    return Packet(getPayload(i), getHeader(i));
+  }
+
+  /**
+   * Returns a PacketTable of the packets.  The arrays are copied but the
+   * packet data isn't; the table points into the mapping, so it must not
+   * outlive the store.
+   */
+  PacketTable getPacketTable() const;
+
+private:
+  std::shared_ptr<MappedFile> mapped;
+  PacketStoreHeader header;
+
+  // Point into the mapping.
+  unsigned char const* payload = 0;
+  uint64_t const* offsets = 0;
+  uint32_t const* includedLengths = 0;
+  uint32_t const* originalLengths = 0;
+  uint32_t const* timestampSeconds = 0;
+  uint32_t const* timestampUseconds = 0;
+};
+
+inline PacketStoreWriter::PacketStoreWriter(std::string const& filename)
+  : filename(filename), stream(filename, std::ios::binary | std::ios::trunc),
+    arraysFilename(filename + ".arrays"),
+    arraysStream(arraysFilename, std::ios::binary | std::ios::in | 
+                                 std::ios::out | std::ios::trunc)
+{
+  if (!stream.is_open() || !arraysStream.is_open()) {
+    throw PacketStoreException("Could not open " + filename +
+                               " for writing");
+  }
+  buffer.reserve(WRITE_BUFFER_SIZE);
+
+  // Zeros until finish() writes the real header.
+  PacketStoreHeader empty;
+  std::memset(&empty, 0, sizeof(empty));
+  stream.write(reinterpret_cast<char const*>(&empty), sizeof(empty));
+  check();
+}
+
+inline PacketStoreWriter::~PacketStoreWriter()
+{
+  if (arraysStream.is_open()) arraysStream.close();
+  std::remove(arraysFilename.c_str());
+}
+
+inline void PacketStoreWriter::write(PacketTable const& packets)
+{
+  size_t n = packets.size();
+
+  // The batch's arrays, with offsets into the store's packet data.
+  std::vector<uint64_t> offsets(n);
+  std::vector<uint32_t> includedLengths(n), originalLengths(n);
+  std::vector<uint32_t> timestampSeconds(n), timestampUseconds(n);
+  for (size_t i = 0; i < n; i++) {
+    offsets[i] = payloadBytes;
+    includedLengths[i] = packets.getIncludedLength(i);
+    originalLengths[i] = packets.getOriginalLength(i);
+    timestampSeconds[i] = packets.getTimestampSeconds(i);
+    timestampUseconds[i] = packets.getTimestampUseconds(i);
+
+    uint32_t length = includedLengths[i];
+    char const* data = reinterpret_cast<char const*>(packets.getPayload(i));
+    if (buffer.size() + length > WRITE_BUFFER_SIZE) flush();
+    if (length > WRITE_BUFFER_SIZE) {
+      stream.write(data, length);
+    } else {
+      buffer.insert(buffer.end(), data, data + length);
+    }
+    payloadBytes += length;
+  }
+
+  writeBinary(offsets, arraysStream);
+  writeBinary(includedLengths, arraysStream);
+  writeBinary(originalLengths, arraysStream);
+  writeBinary(timestampSeconds, arraysStream);
+  writeBinary(timestampUseconds, arraysStream);
+  batchSizes.push_back(n);
+  numPackets += n;
+  check();
+}
+
+template <typename Capture>
+void PacketStoreWriter::finish(Capture const& capture)
+{
+  uint64_t padding =
+    details::packetStorePaddedBytes(payloadBytes) - payloadBytes;
+  buffer.insert(buffer.end(), padding, 0);
+  flush();
+  copyArrays(sizeof(PacketStoreHeader) + payloadBytes + padding);
+
+  PacketStoreHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, details::packetStoreMagic(), sizeof(header.magic));
+  header.version = details::PACKET_STORE_VERSION;
+  header.byteOrderMark = details::PACKET_STORE_BYTE_ORDER_MARK;
+  header.numPackets = numPackets;
+  header.payloadBytes = payloadBytes;
+  header.numBytes = capture.getNumBytes();
+  header.magicNumber = capture.getMagicNumber();
+  header.majorVersion = capture.getMajorVersion();
+  header.minorVersion = capture.getMinorVersion();
+  header.timeZoneCorrection = capture.getTimeZoneCorrection();
+  header.sigfigs = capture.getSigfigs();
+  header.snaplen = capture.getSnaplen();
+  header.network = capture.getNetwork();
+
+  stream.seekp(0);
+  stream.write(reinterpret_cast<char const*>(&header), sizeof(header));
+  stream.close();
+  check();
+}
+
+inline void PacketStoreWriter::copyArrays(uint64_t arraysPos)
+{
+  arraysStream.seekg(0);
+
+  // Where each array starts in the store.
+  uint64_t offsetsPos = arraysPos;
+  uint64_t includedPos = offsetsPos + numPackets * sizeof(uint64_t);
+  uint64_t originalPos = includedPos + numPackets * sizeof(uint32_t);
+  uint64_t secondsPos = originalPos + numPackets * sizeof(uint32_t);
+  uint64_t usecondsPos = secondsPos + numPackets * sizeof(uint32_t);
+
+  std::vector<char> bytes;
+  auto copyArray = [this, &bytes](uint64_t arrayPos, size_t elementSize,
+                                  uint64_t first, size_t count)
+  {
+    bytes.resize(count * elementSize);
+    this->arraysStream.read(bytes.data(), bytes.size());
+    this->stream.seekp(arrayPos + first * elementSize);
+    this->stream.write(bytes.data(), bytes.size());
+  };
+
+  uint64_t first = 0;
+  for (size_t n : batchSizes) {
+    copyArray(offsetsPos, sizeof(uint64_t), first, n);
+    copyArray(includedPos, sizeof(uint32_t), first, n);
+    copyArray(originalPos, sizeof(uint32_t), first, n);
+    copyArray(secondsPos, sizeof(uint32_t), first, n);
+    copyArray(usecondsPos, sizeof(uint32_t), first, n);
+    first += n;
+  }
+  if (!arraysStream) {
+    throw PacketStoreException("Error reading back the packet arrays of " +
+                               filename);
+  }
+}
+
+inline void PacketStoreWriter::flush()
+{
+  stream.write(buffer.data(), buffer.size());
+  buffer.clear();
+}
+
+inline void PacketStoreWriter::check() const
+{
+  if (!stream || !arraysStream) {
+    throw PacketStoreException("Error writing packet store " + filename);
+  }
+}
+
+inline PacketStore::PacketStore(std::string const& filename)
+  : mapped(std::make_shared<MappedFile>(filename))
+{
+  uint64_t fileBytes = mapped->getSize();
+  if (fileBytes < sizeof(header)) {
+    throw PacketStoreException(filename + " is too small to be a packet"
+                               " store");
+  }
+  unsigned char const* data = mapped->getData();
+  std::memcpy(&header, data, sizeof(header));
+
+  if (std::memcmp(header.magic, details::packetStoreMagic(),
+                  sizeof(header.magic)) != 0)
+  {
+    throw PacketStoreException(filename + " is not a packet store");
+  }
+  if (header.version != details::PACKET_STORE_VERSION) {
+    throw PacketStoreException(filename + " is packet store version " +
+      std::to_string(header.version) + "; expected version " +
+      std::to_string(details::PACKET_STORE_VERSION));
+  }
+  if (header.byteOrderMark != details::PACKET_STORE_BYTE_ORDER_MARK) {
+    throw PacketStoreException(filename + " was written on a machine with"
+                               " a different byte order");
+  }
+
+  uint64_t n = header.numPackets;
+  uint64_t arraysPos = 
+    sizeof(header) + details::packetStorePaddedBytes(header.payloadBytes);
+  if (header.payloadBytes > fileBytes || arraysPos > fileBytes ||
+      n > (fileBytes - arraysPos) / details::PACKET_STORE_BYTES_PER_PACKET ||
+      arraysPos + n * details::PACKET_STORE_BYTES_PER_PACKET != fileBytes)
+  {
+    throw PacketStoreException("The size of " + filename + " doesn't match"
+                               " its header");
+  }
+
+  payload = data + sizeof(header);
+  offsets = reinterpret_cast<uint64_t const*>(data + arraysPos);
+  includedLengths = reinterpret_cast<uint32_t const*>(offsets + n);
+  originalLengths = includedLengths + n;
+  timestampSeconds = originalLengths + n;
+  timestampUseconds = timestampSeconds + n;
+
+  // The packet data is written back to back, so it starts with the first
+  // packet and ends with the last.
+  bool bounded = n == 0 ? header.payloadBytes == 0 :
+    offsets[0] == 0 && offsets[n - 1] <= header.payloadBytes &&
+    includedLengths[n - 1] == header.payloadBytes - offsets[n - 1];
+  if (!bounded) {
+    throw PacketStoreException("The packets of " + filename + " don't match"
+                               " its packet data");
+  }
+}
+
+inline void PacketStore::validate() const
+{
+  for (size_t i = 0; i < size(); i++) {
+    if (offsets[i] > header.payloadBytes ||
+        includedLengths[i] > header.payloadBytes - offsets[i])
+    {
+      throw PacketStoreException("Packet " + std::to_string(i) +
+                                 " is outside of the packet data");
+    }
+  }
+}
+
+inline bool PacketStore::isPacketStore(std::string const& filename)
+{
+  std::ifstream stream(filename, std::ios::binary);
+  char magic[8];
+  stream.read(magic, sizeof(magic));
+  return stream &&
+         std::memcmp(magic, details::packetStoreMagic(), sizeof(magic)) == 0;
+}
+
+inline PacketTable PacketStore::getPacketTable() const
+{
+  PacketTable table(payload);
+  table.reserve(size());
+  for (size_t i = 0; i < size(); i++) {
+    table.append(offsets[i], getHeader(i));
+  }
+  return table;
+}
+
+}
+
+#endif
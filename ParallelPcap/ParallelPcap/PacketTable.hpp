@@ -0,0 +1,337 @@
+#ifndef PARALLELPCAP_PACKET_TABLE_HPP
+#define PARALLELPCAP_PACKET_TABLE_HPP
+
+#include <vector>
+#include <thread>
+#include <istream>
+#include <ostream>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/level.hpp>
+#include <ParallelPcap/Packet.hpp>
+#include <ParallelPcap/Util.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * Structure-of-arrays index over the packets of a capture.  Packet i is
+ * described by entry i of each of the arrays, and its data starts at
+ * getBytes() + getOffset(i).  The byte buffer is shared by all of the
+ * packets and is owned elsewhere (the Pcap's read buffer or mapping), so
+ * building the table costs a handful of amortized array appends rather
+ * than one allocation per packet.
+ */
+class PacketTable
+{
+private:
+  /// The buffer that the offsets index into.  Not owned by the table
+  /// unless the table was restored from an archive.
+  unsigned char const* bytes = 0;
+
+  /// Holds the packet data of a restored table.  bytes points here.
+  std::vector<unsigned char> restoredBytes;
+
+  std::vector<uint64_t> offsets; ///< Offset of each packet's data in bytes
+  std::vector<uint32_t> includedLengths; ///< Bytes of the packet captured
+  std::vector<uint32_t> originalLengths; ///< Bytes of the packet on the wire
+  std::vector<uint32_t> timestampSeconds; ///< Seconds since epoch
+  std::vector<uint32_t> timestampUseconds; ///< Microseconds (or nanoseconds)
+
+  friend class boost::serialization::access;
+
+  /**
+   * The archive holds a vector of Packets, which is the layout Pcap
+   * archives had before the packet table existed.  The table itself writes
+   * no class info (see BOOST_CLASS_IMPLEMENTATION below), so old archives
+   * still load.
+   */
+  template<class Archive>
+  void save(Archive &ar, const unsigned int version) const {
+    std::vector<Packet> packets;
+    packets.reserve(size());
+    for (size_t i = 0; i < size(); i++) {
+      packets.push_back(getPacket(i));
+    }
+    ar &packets;
+  }
+
+  template<class Archive>
+  void load(Archive &ar, const unsigned int version) {
+    std::vector<Packet> packets;
+    ar &packets;
+
+    clear();
+    reserve(packets.size());
+
+    uint64_t numBytes = 0;
+    for (Packet const& packet : packets) {
+      numBytes += packet.getIncludedLength();
+    }
+    restoredBytes.resize(numBytes);
+
+    uint64_t offset = 0;
+    for (Packet const& packet : packets) {
+      std::copy(packet.getPayload(),
+                packet.getPayload() + packet.getIncludedLength(),
+                restoredBytes.begin() + offset);
+      append(offset, packet.getHeader());
+      offset += packet.getIncludedLength();
+    }
+    bytes = restoredBytes.data();
+  }
+
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+public:
+  PacketTable() {}
+
+  /**
+   * \param bytes The buffer that packet offsets are relative to.
+   */
+  PacketTable(unsigned char const* bytes) : bytes(bytes) {}
+
+  PacketTable(PacketTable const& other);
+  PacketTable& operator=(PacketTable const& other);
+
+  /// Moving a vector keeps its buffer, so bytes stays valid for a restored
+  /// table.
+  PacketTable(PacketTable&& other) = default;
+  PacketTable& operator=(PacketTable&& other) = default;
+
+  size_t size() const { return offsets.size(); }
+
+  /**
+   * Reserves room for numPackets packets in each of the arrays.
+   */
+  void reserve(size_t numPackets);
+
+  /**
+   * Removes all of the packets.  The byte buffer is left as is.
+   */
+  void clear();
+
+  /**
+   * Adds a packet to the end of the table.
+   * \param offset Offset of the packet data relative to getBytes().
+   * \param header The packet's record header.
+   */
+  void append(uint64_t offset, PacketHeader const& header) {
+    offsets.push_back(offset);
+    includedLengths.push_back(header.getIncludedLength());
+    originalLengths.push_back(header.getOriginalLength());
+    timestampSeconds.push_back(header.getTimestampSeconds());
+    timestampUseconds.push_back(header.getTimestampUseconds());
+  }
+
+  /**
+   * Adds all of the packets of other to the end of this table.  Both tables
+   * must index into the same byte buffer.
+   */
+  void append(PacketTable const& other);
+
+  unsigned char const* getBytes() const { return bytes; }
+
+  /**
+   * Changes the buffer that the offsets are relative to.
+   */
+  void setBytes(unsigned char const* bytes) { this->bytes = bytes; }
+
+  uint64_t getOffset(size_t i) const { return offsets[i]; }
+  uint32_t getIncludedLength(size_t i) const { return includedLengths[i]; }
+  uint32_t getOriginalLength(size_t i) const { return originalLengths[i]; }
+  uint32_t getTimestampSeconds(size_t i) const { return timestampSeconds[i]; }
+  uint32_t getTimestampUseconds(size_t i) const {
+    return timestampUseconds[i];
+  }
+
+  /**
+   * Returns a pointer to the first byte of packet i's data.
+   */
+  unsigned char const* getPayload(size_t i) const {
+    return bytes + offsets[i];
+  }
+
+  PacketHeader getHeader(size_t i) const {
+    return PacketHeader(timestampSeconds[i], timestampUseconds[i],
+                        includedLengths[i], originalLengths[i]);
+  }
+
+  /**
+   * Returns a view of packet i.  The packet data is not copied.
+   */
+  Packet getPacket(size_t i) const {
+    return Packet(getPayload(i), getHeader(i));
+  }
+
+  /**
+   * Writes the arrays (not the packet data) to a stream in binary, one 
+   * array after another, in the byte order of the machine.
+   */
+  void saveColumns(std::ostream& stream) const;
+
+  /**
+   * Replaces the arrays with ones written by saveColumns().  The byte 
+   * buffer is left as is.
+   * \param stream The stream to read from.
+   * \param numPackets The number of packets saveColumns() wrote.
+   * \return Returns false if the stream ended early.
+   */
+  bool loadColumns(std::istream& stream, size_t numPackets);
+
+  /**
+   * Keeps only the packets [beg, end).
+   */
+  void slice(size_t beg, size_t end);
+
+  /**
+   * Applies op to every packet in parallel.  The result for packet i is
+   * written to vec[i]; vec is grown if it is smaller than the table.
+   */
+  template<typename Operator, typename OutputType>
+  void applyOperator(Operator op, std::vector<OutputType>& vec) const;
+};
+
+inline PacketTable::PacketTable(PacketTable const& other)
+  : bytes(other.bytes), restoredBytes(other.restoredBytes),
+    offsets(other.offsets), includedLengths(other.includedLengths),
+    originalLengths(other.originalLengths),
+    timestampSeconds(other.timestampSeconds),
+    timestampUseconds(other.timestampUseconds)
+{
+  if (!restoredBytes.empty()) bytes = restoredBytes.data();
+}
+
+inline PacketTable& PacketTable::operator=(PacketTable const& other)
+{
+  if (this != &other) {
+    bytes = other.bytes;
+    restoredBytes = other.restoredBytes;
+    offsets = other.offsets;
+    includedLengths = other.includedLengths;
+    originalLengths = other.originalLengths;
+    timestampSeconds = other.timestampSeconds;
+    timestampUseconds = other.timestampUseconds;
+    if (!restoredBytes.empty()) bytes = restoredBytes.data();
+  }
+  return *this;
+}
+
+inline void PacketTable::reserve(size_t numPackets)
+{
+  offsets.reserve(numPackets);
+  includedLengths.reserve(numPackets);
+  originalLengths.reserve(numPackets);
+  timestampSeconds.reserve(numPackets);
+  timestampUseconds.reserve(numPackets);
+}
+
+inline void PacketTable::clear()
+{
+  offsets.clear();
+  includedLengths.clear();
+  originalLengths.clear();
+  timestampSeconds.clear();
+  timestampUseconds.clear();
+}
+
+inline void PacketTable::append(PacketTable const& other)
+{
+  offsets.insert(offsets.end(), other.offsets.begin(), other.offsets.end());
+  includedLengths.insert(includedLengths.end(),
+    other.includedLengths.begin(), other.includedLengths.end());
+  originalLengths.insert(originalLengths.end(),
+    other.originalLengths.begin(), other.originalLengths.end());
+  timestampSeconds.insert(timestampSeconds.end(),
+    other.timestampSeconds.begin(), other.timestampSeconds.end());
+  timestampUseconds.insert(timestampUseconds.end(),
+    other.timestampUseconds.begin(), other.timestampUseconds.end());
+}
+
+namespace details {
+
+template <typename T>
+void writeColumn(std::vector<T> const& column, std::ostream& stream)
+{
+  stream.write(reinterpret_cast<char const*>(column.data()),
+               column.size() * sizeof(T));
+}
+
+template <typename T>
+bool readColumn(std::vector<T>& column, std::istream& stream, size_t size)
+{
+  column.resize(size);
+  stream.read(reinterpret_cast<char*>(column.data()), size * sizeof(T));
+  return static_cast<size_t>(stream.gcount()) == size * sizeof(T);
+}
+
+template <typename T>
+void sliceColumn(std::vector<T>& column, size_t beg, size_t end)
+{
+  column.erase(column.begin() + end, column.end());
+  column.erase(column.begin(), column.begin() + beg);
+}
+
+}
+
+inline void PacketTable::saveColumns(std::ostream& stream) const
+{
+  details::writeColumn(offsets, stream);
+  details::writeColumn(includedLengths, stream);
+  details::writeColumn(originalLengths, stream);
+  details::writeColumn(timestampSeconds, stream);
+  details::writeColumn(timestampUseconds, stream);
+}
+
+inline bool PacketTable::loadColumns(std::istream& stream, size_t numPackets)
+{
+  return details::readColumn(offsets, stream, numPackets) &&
+         details::readColumn(includedLengths, stream, numPackets) &&
+         details::readColumn(originalLengths, stream, numPackets) &&
+         details::readColumn(timestampSeconds, stream, numPackets) &&
+         details::readColumn(timestampUseconds, stream, numPackets);
+}
+
+inline void PacketTable::slice(size_t beg, size_t end)
+{
+  details::sliceColumn(offsets, beg, end);
+  details::sliceColumn(includedLengths, beg, end);
+  details::sliceColumn(originalLengths, beg, end);
+  details::sliceColumn(timestampSeconds, beg, end);
+  details::sliceColumn(timestampUseconds, beg, end);
+}
+
+template<typename Operator, typename OutputType>
+void
+PacketTable::applyOperator(Operator op, std::vector<OutputType>& vec) const
+{
+  size_t mythreadCount = globalNumThreads;
+
+  if (vec.size() < this->size()) {
+    vec.resize(this->size());
+  }
+
+  // Packets run from tens of bytes to thousands and come in bursts, so
+  // the threads take chunks of about the same number of bytes as they go.
+  ChunkSchedule schedule(this->size(), mythreadCount,
+    [this](size_t i) -> uint64_t { return this->getIncludedLength(i); });
+
+  auto applyFunction = [this, &vec, &schedule, op](size_t threadId)
+  {
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for(size_t i = beg; i < end; i++)
+      {
+        op( this->getPacket(i), vec[i] );
+      }
+    }
+  };
+
+  parallelFor(mythreadCount, applyFunction);
+}
+
+}
+
+BOOST_CLASS_IMPLEMENTATION(parallel_pcap::PacketTable,
+                           boost::serialization::object_serializable)
+
+#endif
@@ -9,10 +9,18 @@
 #include <ParallelPcap/ByteManipulations.hpp>
 #include <ParallelPcap/Util.hpp>
 #include <ParallelPcap/Packet.hpp>
+#include <ParallelPcap/PacketTable.hpp>
+#include <ParallelPcap/Pcapng.hpp>
+#include <ParallelPcap/PacketIndex.hpp>
+#include <ParallelPcap/MappedFile.hpp>
+#include <ParallelPcap/DecompressingReader.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/python.hpp>
 #include <boost/serialization/vector.hpp>
-#include <mutex>
+#include <memory>
+#include <exception>
+#include <limits>
+#include <algorithm>
 #include <vector>
 
 namespace parallel_pcap {
@@ -46,8 +54,126 @@ public:
       vec.push_back(s);
     }
   }
+
+  /**
+   * Returns how many ngrams operator() appends for the packet.
+   */
+  size_t numNgrams(Packet const& packet) const
+  {
+    size_t length = packet.getIncludedLength();
+    return length >= 38 + n ? length - 38 - n + 1 : 0;
+  }
+};
+
+/**
+ * Callable object that ngrams a packet like NgramOperator, but packs each
+ * ngram into a uint64_t instead of building a string.  Byte j of the ngram
+ * goes to bits [8j, 8j + 8).  Like the strings of NgramOperator, an ngram
+ * ends at its first zero byte, so the bytes after it are zeroed; two
+ * ngrams get the same key exactly when NgramOperator gives them the same
+ * string.  Only ngrams of up to MAX_NGRAM_SIZE bytes fit.
+ */
+class PackedNgramOperator
+{
+private:
+  size_t n;
+public:
+  static const size_t MAX_NGRAM_SIZE = 8;
+
+  PackedNgramOperator(size_t n) {
+    if (n == 0 || n > MAX_NGRAM_SIZE) {
+      throw std::invalid_argument("PackedNgramOperator: ngram size " + 
+        std::to_string(n) + " doesn't fit in a uint64_t");
+    }
+    this->n = n;
+  }
+
+  void operator()(Packet const& packet, std::vector<uint64_t> & vec) const
+  {
+    // Start at 38 to remove ip addresses and ports, as NgramOperator does.
+    const size_t start = 38;
+    size_t length = packet.getIncludedLength();
+    if (length < start + n) return;
+
+    unsigned char const* payload = packet.getPayload();
+    const uint64_t ones = 0x0101010101010101ULL & lowBytes(n);
+    const uint64_t highs = 0x8080808080808080ULL & lowBytes(n);
+
+    // Slide the window a byte at a time: drop the low byte and add the
+    // next byte at the top.
+    uint64_t window = 0;
+    for (size_t j = 0; j < n - 1; j++) {
+      window |= uint64_t(payload[start + j]) << (8 * j);
+    }
+
+    vec.reserve(vec.size() + length - start - n + 1);
+    for (size_t i = start; i + n <= length; i++) {
+      window |= uint64_t(payload[i + n - 1]) << (8 * (n - 1));
+
+      // Flags the zero bytes of the window.  Only the lowest flag is exact,
+      // which is the one that matters.
+      uint64_t zeros = (window - ones) & ~window & highs;
+      uint64_t key = window;
+      if (zeros) {
+        key &= lowBytes(__builtin_ctzll(zeros) / 8);
+      }
+      vec.push_back(key);
+
+      window >>= 8;
+    }
+  }
+
+  /**
+   * Returns how many ngrams operator() appends for the packet.
+   */
+  size_t numNgrams(Packet const& packet) const
+  {
+    size_t length = packet.getIncludedLength();
+    return length >= 38 + n ? length - 38 - n + 1 : 0;
+  }
+
+private:
+  /// Mask of the low k bytes.
+  static uint64_t lowBytes(size_t k) {
+    return k >= 8 ? ~uint64_t(0) : (uint64_t(1) << (8 * k)) - 1;
+  }
+};
+
+/**
+ * How ngrams are computed and hashed for each type of dictionary key:
+ * std::string keys come from NgramOperator and uint64_t keys from
+ * PackedNgramOperator.
+ */
+template <typename KeyType>
+struct NgramTraits;
+
+template <>
+struct NgramTraits<std::string>
+{
+  typedef NgramOperator Operator;
+  typedef StringHashFunction HashFunction;
 };
 
+template <>
+struct NgramTraits<uint64_t>
+{
+  typedef PackedNgramOperator Operator;
+  typedef PackedNgramHashFunction HashFunction;
+};
+
+/**
+ * Returns true if ngrams of all the sizes fit in packed keys.  ReadPcap
+ * and TestPcap use packed keys (and a dictionary keyed on them) when they
+ * do.
+ */
+inline bool canPackNgrams(std::vector<size_t> const& ngramSizes)
+{
+  for (size_t n : ngramSizes) {
+    if (n == 0 || n > PackedNgramOperator::MAX_NGRAM_SIZE) return false;
+  }
+  return true;
+}
+
 /**
  * The exception type generate by the Pcap class.
  */
@@ -69,7 +195,7 @@ namespace details {
  */
 void checkSequence(std::vector<uint64_t> const& candidates,
                    AbstractUint32Transformer* transformUnsigned32,
-                   unsigned char* packetData)
+                   unsigned char const* packetData)
 {
   auto it = candidates.begin();
   uint64_t index = *it;
@@ -91,19 +217,34 @@ void checkSequence(std::vector<uint64_t> const& candidates,
 
 /**
  * Go through the first snaplen part of packetData, and see which of the 
- * the bytes could possibly be the start of a packet.  
+ * the bytes could possibly be the start of a packet.  A candidate has to
+ * be followed by numDesired plausible packet records (or by plausible 
+ * records up to the end of the data).
+ * \param candidates Filled with the indices that pass.
+ * \param numDesired How many records in a row have to look like packets.
+ * \param beg Where to start looking.
+ * \param end The end of packetData.  Records can't go past it.
+ * \param snaplen The largest a packet can be.
+ * \param transformUnsigned32 Transforms the bytes into an unsigned 32-bit
+ *         integer.
+ * \param packetData An unsigned char array that has the packet data.
+ * \param firstTimestamp The timestamp of the first packet in the file.
+ * \param threadId Used in the error message.
  */
 void createCandidates(std::vector<uint64_t>& candidates, 
                       size_t numDesired,
-                      uint32_t beg,
-                      uint32_t end,
+                      uint64_t beg,
+                      uint64_t end,
                       uint32_t snaplen,
                       AbstractUint32Transformer* transformUnsigned32,
-                      unsigned char* packetData,
+                      unsigned char const* packetData,
                       uint32_t firstTimestamp,
                       size_t threadId)
 {
-  for (uint64_t i = beg; i < beg + snaplen; i++)
+  // A record is at most 16 + snaplen bytes long, so the first packet that
+  // starts at or after beg starts within that many bytes of beg.
+  uint64_t searchEnd = beg + 16 + static_cast<uint64_t>(snaplen);
+  for (uint64_t i = beg; i < searchEnd && i + 16 <= end; i++)
   {
     uint32_t timestamp = (*transformUnsigned32)(&packetData[i]);
     if (timestamp >= firstTimestamp) {
@@ -111,42 +252,34 @@ void createCandidates(std::vector<uint64_t>& candidates,
     }
   }
 
-  for(auto it = candidates.begin(); it != candidates.end(); )
+  auto isSequence = [numDesired, end, snaplen, transformUnsigned32,
+                     packetData, firstTimestamp](uint64_t index)
   {
     uint32_t previousTime = firstTimestamp; 
-    uint64_t index = *it;
-    int j = 0;
-    bool success = true;
-    while (j < numDesired && success) {
+    size_t j = 0;
+    while (j < numDesired && index < end) {
+      if (index + 16 > end) return false;
+
       uint32_t currentTime = (*transformUnsigned32)(&packetData[index]);
+      if (currentTime < previousTime) return false;
 
-      if (currentTime >= previousTime) {
-        // Get the candidate packetLen
-        uint32_t packetLen = (*transformUnsigned32)
-                              (&packetData[index+8]);
-                                
-
-        if (packetLen <= snaplen) {
-          index = index + 4*sizeof(uint32_t) + packetLen; 
-          if (index >= end) {
-            success = false;
-          }
-        } else {
-          success = false;
-        }
-
-        j++;
-        previousTime = currentTime;
-      } else {
-        success = false;
-      } 
-    }
-    if (success) {
-      ++it;
-    } else {
-      it = candidates.erase(it);
+      // Get the candidate packetLen
+      uint32_t packetLen = (*transformUnsigned32)(&packetData[index+8]);
+      if (packetLen > snaplen) return false;
+
+      index = index + 4*sizeof(uint32_t) + packetLen; 
+      if (index > end) return false;
+
+      j++;
+      previousTime = currentTime;
     }
-  }
+    return true;
+  };
+
+  // Filter in place rather than erasing from the middle of the vector.
+  candidates.erase(std::remove_if(candidates.begin(), candidates.end(),
+    [&isSequence](uint64_t index) { return !isSequence(index); }),
+    candidates.end());
 
   if (candidates.size() < 1) {
     std::string message = "Trying to find the start of a packet in thread " +
@@ -156,6 +289,41 @@ void createCandidates(std::vector<uint64_t>& candidates,
   }
 }
 
+/**
+ * Looks at the magic number at the start of a pcap file and creates the
+ * byte converters that match the file's byte order.  Both the microsecond
+ * (0xa1b2c3d4) and nanosecond (0xa1b23c4d) magic numbers are accepted.  
+ * The caller owns the converters.
+ * \param data The start of the pcap file.
+ * \return Returns true if the file's byte order is swapped.
+ */
+inline bool createTransformers(unsigned char const* data,
+                               AbstractInt32Transformer*& transformSigned32,
+                               AbstractUint32Transformer*& transformUnsigned32,
+                               AbstractUint16Transformer*& transformUnsigned16)
+{
+  if (data[0] == 0xa1 && data[1] == 0xb2 && 
+      ((data[2] == 0xc3 && data[3] == 0xd4) || 
+       (data[2] == 0x3c && data[3] == 0x4d)))
+  {
+    transformSigned32 = new Int32Transformer();
+    transformUnsigned32 = new Uint32Transformer();
+    transformUnsigned16 = new Uint16Transformer(); 
+    return false;
+  } else
+  if (data[2] == 0xb2 && data[3] == 0xa1 &&
+      ((data[0] == 0xd4 && data[1] == 0xc3) ||
+       (data[0] == 0x4d && data[1] == 0x3c)))
+  {
+    transformSigned32 = new Int32TransformerSwapped();
+    transformUnsigned32 = new Uint32TransformerSwapped();
+    transformUnsigned16 = new Uint16TransformerSwapped(); 
+    return true;
+  }
+  throw PcapException("Tried to get the magic number but it wasn't"
+    " 0xa1b2c3d4, 0xa1b23c4d, or their byte swapped versions");
+}
+
 } //end namespace details
 
 class Pcap
@@ -173,12 +341,21 @@ private:
   uint32_t snaplen;
   uint32_t network; 
 
-  AbstractInt32Transformer* transformSigned32;
-  AbstractUint32Transformer* transformUnsigned32;
-  AbstractUint16Transformer* transformUnsigned16;
+  AbstractInt32Transformer* transformSigned32 = 0;
+  AbstractUint32Transformer* transformUnsigned32 = 0;
+  AbstractUint16Transformer* transformUnsigned16 = 0;
 
+  /// The file contents when read into memory.  Null when mapped.
   unsigned char* data = 0;
-  std::vector<Packet> packets;
+
+  /// The file contents when memory mapped.
+  std::shared_ptr<MappedFile> mapped;
+
+  /// The decompressed file contents when the file is compressed.
+  std::shared_ptr<std::vector<unsigned char>> decompressed;
+
+  /// Where each packet is in the file contents.
+  PacketTable packets;
 
   bool swapped;
 
@@ -198,15 +375,86 @@ public:
   static const uint64_t SNAPLEN_POS       = 16; 
   static const uint64_t NETWORK_POS       = 20;
   static const uint64_t PACKET_DATA_POS   = 24; ///> Offset to packet data
+
+  // Magic numbers (as read in the file's byte order)
+  static const uint32_t MAGIC_MICROSECONDS = 0xa1b2c3d4;
+  static const uint32_t MAGIC_NANOSECONDS  = 0xa1b23c4d;
+
+  /// Files with fewer bytes than this per thread are parsed by fewer 
+  /// threads.  Only used for pcapng; pcap files use the snaplen.
+  static const uint64_t PCAPNG_MIN_BYTES_PER_THREAD = 1 << 16;
   //static const uint64_t PACKET_DATA_POS   = 38; // Exclude ip addresses from data
 
-  Pcap(std::string const& filename);
-  //Pcap(std::string const& filename, size_t numThreads);
+  /**
+   * Reads the pcap file and finds all of the packets.  The packets point
+   * into the file contents rather than copying them.  Gzip and zstd 
+   * compressed files are decompressed into memory, with the packets found
+   * as the data is decompressed.  If globalPacketIndex is set, the packets
+   * of an uncompressed file are read from its packet index when the index
+   * is up to date, and the index is written otherwise.
+   * \param filename The path to the pcap file.
+   * \param useMmap If true, the file is memory mapped instead of read into
+   *                a buffer.  Falls back to reading the file if it can't be
+   *                mapped (e.g. it is a pipe).
+   */
+  Pcap(std::string const& filename, bool useMmap = true);
+
+  /**
+   * Reads only the packets whose records start within [begByte, endByte)
+   * of the file.  Splitting a file into consecutive byte ranges and 
+   * reading each with its own Pcap (e.g. in separate processes) yields
+   * every packet exactly once.  For compressed files the range is of the
+   * decompressed data.
+   * \param filename The path to the pcap file.
+   * \param begByte File offset where the range begins.
+   * \param endByte File offset where the range ends (exclusive).  Clamped
+   *                to the size of the file.
+   * \param useMmap If true, the file is memory mapped.
+   */
+  Pcap(std::string const& filename, uint64_t begByte, uint64_t endByte,
+       bool useMmap = true);
   Pcap() { }
   ~Pcap();
 
+  // The destructor deletes the transformers and data, so a copy would
+  // delete them twice.
+  Pcap(Pcap const& other) = delete;
+  Pcap& operator=(Pcap const& other) = delete;
+
   size_t getNumPackets() const { return packets.size(); }
 
+  uint64_t getNumBytes() const { return numBytes; }
+  uint32_t getMagicNumber() const { return magicNumber; }
+  uint16_t getMajorVersion() const { return majorVersion; }
+  uint16_t getMinorVersion() const { return minorVersion; }
+  int32_t getTimeZoneCorrection() const { return timeZoneCorrection; }
+  uint32_t getSigfigs() const { return sigfigs; }
+  uint32_t getSnaplen() const { return snaplen; }
+  uint32_t getNetwork() const { return network; }
+
+  /**
+   * Returns true if the file was pcapng.  Pcapng timestamps are converted
+   * to seconds and microseconds, and the header fields come from the first
+   * section header and interface description blocks.
+   */
+  bool isPcapng() const {
+    return magicNumber == PcapngParser::SECTION_HEADER_BLOCK;
+  }
+
+  /**
+   * Returns true if the packet timestamps are in seconds and nanoseconds
+   * (the 0xa1b23c4d magic number) rather than seconds and microseconds.
+   */
+  bool hasNanosecondTimestamps() const {
+    return magicNumber == MAGIC_NANOSECONDS;
+  }
+
+  /**
+   * Returns the packet table, which can be iterated over without copying
+   * any packet data.
+   */
+  PacketTable const& getPacketTable() const { return packets; }
+
   template<typename Operator, typename OutputType>
   void applyOperator(Operator op, 
                      std::vector<OutputType>& vec) const;
@@ -219,19 +467,49 @@ public:
    * \param i The index of the packet.
    */
   PacketHeader getPacketHeader(size_t i) const {
-    return packets[i].getHeader();
+    return packets.getHeader(i);
   }
   
+  /**
+   * Returns a copy of the data of the ith packet.
+   * \param i The index of the packet.
+   */
   std::vector<unsigned char> getPacket(size_t i) const {
-    return packets[i].getData();
+    return packets.getPacket(i).getData();
   }
 
   void setRestored(bool restored);
 private:
-  bool restored;
-  void readFile(std::string const& filename);
-  void readHeader(unsigned char* data);
-  void readPackets(unsigned char* data);
+  bool restored = false;
+  void readFile(std::string const& filename, bool useMmap,
+                uint64_t begByte, uint64_t endByte);
+  void readHeader(unsigned char const* data);
+  void readPackets(unsigned char const* data, uint64_t begByte,
+                   uint64_t endByte);
+  void readPcapngHeader(unsigned char const* data);
+  void readPcapngPackets(unsigned char const* data, uint64_t begByte,
+                         uint64_t endByte);
+  void readCompressedFile(std::string const& filename, uint64_t begByte,
+                          uint64_t endByte);
+
+  /**
+   * Reads the packets in [begByte, endByte) from the file's packet index.
+   * \return Returns false if the index couldn't be used.
+   */
+  bool readIndex(std::string const& filename, uint64_t begByte,
+                 uint64_t endByte);
+
+  /**
+   * Writes the packet index of the file.  Failing to write it is not an
+   * error.
+   */
+  void writeIndex(std::string const& filename) const;
+
+  /**
+   * Parses the header and finds the packets of the file contents.
+   */
+  void readContents(std::string const& filename, unsigned char const* data,
+                    uint64_t begByte, uint64_t endByte);
 };
 
 inline void Pcap::setRestored(bool restored)
@@ -239,10 +517,17 @@ inline void Pcap::setRestored(bool restored)
   this->restored = restored;
 }
 
-inline Pcap::Pcap(std::string const& filename)//, size_t numThreads) 
+inline Pcap::Pcap(std::string const& filename, bool useMmap)
 {
   this->restored = false;
-  readFile(filename);
+  readFile(filename, useMmap, 0, std::numeric_limits<uint64_t>::max());
+}
+
+inline Pcap::Pcap(std::string const& filename, uint64_t begByte,
+                  uint64_t endByte, bool useMmap)
+{
+  this->restored = false;
+  readFile(filename, useMmap, begByte, endByte);
 }
 
 inline Pcap::~Pcap()
@@ -256,8 +541,38 @@ inline Pcap::~Pcap()
   }
 }
 
-inline void Pcap::readFile(std::string const& filename)
+inline void Pcap::readFile(std::string const& filename, bool useMmap,
+                           uint64_t begByte, uint64_t endByte)
 {
+  if (DecompressingReader::isCompressedFile(filename)) {
+    readCompressedFile(filename, begByte, endByte);
+    return;
+  }
+
+  if (useMmap) {
+    try {
+      mapped = std::make_shared<MappedFile>(filename);
+    } catch (MappedFileException const& e) {
+      // Not a regular file or the mapping failed; read it instead.
+      mapped.reset();
+    }
+  }
+
+  if (mapped) {
+    numBytes = mapped->getSize();
+    if (numBytes < PACKET_DATA_POS) {
+      throw PcapException("File " + filename + " is too small to be a pcap");
+    }
+
+    // We walk the packets front to back exactly once.
+    mapped->adviseSequential();
+    mapped->adviseWillNeed(0, numBytes);
+
+    packets.setBytes(mapped->getData());
+    readContents(filename, mapped->getData(), begByte, endByte);
+    return;
+  }
+
   std::ifstream myfile;
 
   // Open the file in binary at the end of the file.
@@ -281,35 +596,100 @@ inline void Pcap::readFile(std::string const& filename)
     throw PcapException("Could not open file " + filename);
   }
 
-  readHeader(data);
-  readPackets(data);
+  if (numBytes < PACKET_DATA_POS) {
+    throw PcapException("File " + filename + " is too small to be a pcap");
+  }
+
+  packets.setBytes(data);
+  readContents(filename, data, begByte, endByte);
   
   
 }
 
-inline void Pcap::readHeader(unsigned char* data)
+inline void Pcap::readContents(std::string const& filename,
+                               unsigned char const* data,
+                               uint64_t begByte, uint64_t endByte)
 {
-  // this->data should have been populated by now.
-  
-  // Looking at the magic number to determine which byte converter to use.
-  unsigned char* dataPtr = data;
-  if (data[0] == 0xa1 && data[1] == 0xb2 && data[2] == 0xc3 && data[3] == 0xd4)
-  {
-    transformSigned32 = new Int32Transformer();
-    transformUnsigned32 = new Uint32Transformer();
-    transformUnsigned16 = new Uint16Transformer(); 
-    swapped = false;
-  } else
-  if (data[0] == 0xd4 && data[1] == 0xc3 && data[2] == 0xb2 && data[3] == 0xa1)
-  {
-    transformSigned32 = new Int32TransformerSwapped();
-    transformUnsigned32 = new Uint32TransformerSwapped();
-    transformUnsigned16 = new Uint16TransformerSwapped(); 
-    swapped = true;
+  bool pcapng = PcapngParser::isPcapng(data, numBytes);
+  if (pcapng) {
+    readPcapngHeader(data);
+  } else {
+    readHeader(data);
+  }
+
+  if (globalPacketIndex && readIndex(filename, begByte, endByte)) return;
+
+  if (pcapng) {
+    readPcapngPackets(data, begByte, endByte);
   } else {
-    throw PcapException("Tried to get the magic number but it wasn't"
-      "0xa1b2c3d4 or 0xd4c3b2a1");
+    readPackets(data, begByte, endByte);
+  }
+
+  // Only an index of the whole file is useful later.
+  if (globalPacketIndex && begByte == 0 && endByte >= numBytes) {
+    writeIndex(filename);
   }
+}
+
+inline bool Pcap::readIndex(std::string const& filename, uint64_t begByte,
+                            uint64_t endByte)
+{
+  PacketIndexHeader header;
+  if (!PacketIndex::read(filename, header, packets)) return false;
+  if (header.fileSize != numBytes || header.magicNumber != magicNumber) {
+    packets.clear();
+    return false;
+  }
+
+  if (begByte > 0 || endByte < numBytes) {
+    // A pcap record starts 16 bytes before its data.  Pcapng blocks have
+    // headers of different sizes, so ranges of pcapng files are parsed.
+    if (isPcapng()) {
+      packets.clear();
+      return false;
+    }
+
+    // Index of the first packet whose record starts at or after byte.
+    auto firstRecordFrom = [this](uint64_t byte) {
+      size_t lo = 0, hi = this->packets.size();
+      while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (this->packets.getOffset(mid) - 16 < byte) lo = mid + 1;
+        else hi = mid;
+      }
+      return lo;
+    };
+    size_t beg = firstRecordFrom(begByte);
+    size_t end = firstRecordFrom(endByte);
+    packets.slice(beg, end);
+  }
+
+  // Pcapng header fields come from the blocks, which weren't walked.
+  snaplen = header.snaplen;
+  network = header.network;
+  return true;
+}
+
+inline void Pcap::writeIndex(std::string const& filename) const
+{
+  PacketIndexHeader header;
+  header.magicNumber = magicNumber;
+  header.majorVersion = majorVersion;
+  header.minorVersion = minorVersion;
+  header.timeZoneCorrection = timeZoneCorrection;
+  header.sigfigs = sigfigs;
+  header.snaplen = snaplen;
+  header.network = network;
+  PacketIndex::write(filename, header, packets);
+}
+
+inline void Pcap::readHeader(unsigned char const* data)
+{
+  // Looking at the magic number to determine which byte converter to use.
+  unsigned char const* dataPtr = data;
+  swapped = details::createTransformers(data, transformSigned32,
+                                        transformUnsigned32,
+                                        transformUnsigned16);
 
   magicNumber = (*transformUnsigned32)(dataPtr);
   dataPtr += 4;
@@ -328,101 +708,338 @@ inline void Pcap::readHeader(unsigned char* data)
 
 }
 
-inline void Pcap::readPackets(unsigned char* data)
+inline void Pcap::readPackets(unsigned char const* data, uint64_t begByte,
+                              uint64_t endByte)
 {
-  unsigned char* packetData = data + PACKET_DATA_POS;
+  unsigned char const* packetData = data + PACKET_DATA_POS;
   uint64_t numPacketBytes = numBytes - PACKET_DATA_POS;
 
+  // The range of packetData whose packets we keep.
+  uint64_t rangeBeg = begByte > PACKET_DATA_POS ? begByte - PACKET_DATA_POS : 0;
+  uint64_t rangeEnd = endByte > PACKET_DATA_POS ? endByte - PACKET_DATA_POS : 0;
+  if (rangeEnd > numPacketBytes) rangeEnd = numPacketBytes;
+
+  // A header with no packets after it, or an empty range.
+  if (rangeBeg >= rangeEnd || numPacketBytes < 16) return;
+  uint64_t numRangeBytes = rangeEnd - rangeBeg;
+
   // Getting the first timestamp of the first packet.
   uint32_t firstTimestamp = (*transformUnsigned32)(packetData);
 
-  std::mutex lock;
+  size_t mythreadCount = globalNumThreads;
+  
+  // Reducing thread count if we have too many requested for the size of the 
+  // problem
+  if (numRangeBytes / mythreadCount < snaplen) {
+    mythreadCount = numRangeBytes / (static_cast<uint64_t>(snaplen) + 1);
+  }
+  if (mythreadCount < 1) mythreadCount = 1;
+
+  // Each thread finds the packets that start in its part of the range and
+  // puts them in its own table.  The tables are concatenated in file order
+  // at the end, so no locking is needed while parsing.
+  std::vector<PacketTable> tables(mythreadCount);
 
-  auto parseFile = [packetData, numPacketBytes, this,
-                    firstTimestamp, &lock]
+  // Where each thread's first packet starts and where the packet after its
+  // last one starts.  Used to make sure the threads agree on boundaries.
+  std::vector<uint64_t> firstIndex(mythreadCount);
+  std::vector<uint64_t> stopIndex(mythreadCount);
+  std::vector<char> failed(mythreadCount, false);
+
+  auto parseFile = [packetData, numPacketBytes, rangeBeg, numRangeBytes,
+                    firstTimestamp, &tables, &firstIndex, &stopIndex,
+                    &failed, this]
                    (size_t threadId, size_t mythreadCount)
   {
-    uint64_t beg = getBeginIndex(numPacketBytes, threadId, mythreadCount);
-    uint64_t end = getEndIndex(numPacketBytes, threadId, mythreadCount);
-    //std::cout << "threadId " << threadId << " mythreadCount " 
-    //          << mythreadCount << " numPacketBytes "
-    //          << numPacketBytes << std::endl;
-
-    // We go through the first part of the data and find candidates
-    // of what we think could be timestamps (i.e. the begining of a
-    // packet).  We do this by assuming that all timestamps will be
-    // greater than firstTimestamp
-    std::vector<uint64_t> candidates; 
-
-    // number of times in a row the guess has to be correct before
-    // we consider that initial guess was correct.
+    uint64_t beg = rangeBeg + getBeginIndex(numRangeBytes, threadId, 
+                                            mythreadCount);
+    uint64_t end = rangeBeg + getEndIndex(numRangeBytes, threadId,
+                                          mythreadCount);
+
+    uint64_t index = 0;
+    if (beg > 0) {
+      // We go through the first part of the data and find candidates
+      // of what we think could be timestamps (i.e. the begining of a
+      // packet).  We do this by assuming that all timestamps will be
+      // greater than firstTimestamp
+      std::vector<uint64_t> candidates; 
+
+      // number of times in a row the guess has to be correct before
+      // we consider that initial guess was correct.
+      size_t numDesired = 10;
+
+      try {
+        // Go through the first snaplen part of our range, and see which of
+        // the bytes could possibly be the start of a packet.  
+        details::createCandidates(candidates, numDesired, beg, 
+                          numPacketBytes, snaplen, this->transformUnsigned32,
+                          packetData, firstTimestamp, threadId);
+
+        // Check to make sure the first candidate explains the rest and that
+        // we don't have multiple candidates to choose from.  Throws an 
+        // exception if the sequence is off.
+        details::checkSequence(candidates, this->transformUnsigned32, 
+                               packetData);
+      } catch (PcapException const& e) {
+        failed[threadId] = true;
+        return;
+      }
+      index = *(candidates.begin());
+    }
+    firstIndex[threadId] = index;
+
+    // Process all the packets.  A truncated record at the end of the file
+    // is dropped.
+    PacketTable& table = tables[threadId];
+    while (index < end && index + 16 <= numPacketBytes) {
+      PacketHeader header(&packetData[index], this->transformUnsigned32);
+      if (index + 16 + header.getIncludedLength() > numPacketBytes) break;
+
+      // Packet data offsets are relative to the start of the file.
+      table.append(PACKET_DATA_POS + index + 16, header);
+      index = index + header.getIncludedLength() + 16;
+    }
+    stopIndex[threadId] = index;
+  };
+
+  parallelFor(mythreadCount, [&parseFile, mythreadCount](size_t threadId) {
+    parseFile(threadId, mythreadCount);
+  });
+
+  // Every thread after the first has to pick up exactly where the previous 
+  // one stopped.  If a thread couldn't find a packet boundary or guessed
+  // the wrong one, walk the whole range with one thread instead.
+  bool consistent = !failed[0];
+  for (size_t i = 1; i < mythreadCount && consistent; i++) {
+    consistent = !failed[i] && firstIndex[i] == stopIndex[i - 1];
+  }
+  if (!consistent) {
+    tables.assign(1, PacketTable());
+    failed[0] = false;
+    parseFile(0, 1);
+    if (failed[0]) {
+      throw PcapException("Pcap::readPackets(): could not find the start of"
+        " a packet at byte " + boost::lexical_cast<std::string>(begByte));
+    }
+  }
+
+  size_t numPackets = 0;
+  for (PacketTable const& table : tables) {
+    numPackets += table.size();
+  }
+  packets.reserve(packets.size() + numPackets);
+  for (PacketTable const& table : tables) {
+    packets.append(table);
+  }
+}
+
+inline void Pcap::readPcapngHeader(unsigned char const* data)
+{
+  if (numBytes < PcapngParser::SECTION_HEADER_SIZE) {
+    throw PcapException("File is too small to be a pcapng");
+  }
+
+  swapped = PcapngParser::createTransformers(data, transformSigned32,
+                                             transformUnsigned32,
+                                             transformUnsigned16);
+
+  magicNumber = PcapngParser::SECTION_HEADER_BLOCK;
+  majorVersion = (*transformUnsigned16)(data + 
+                                        PcapngParser::VERSION_MAJOR_POS);
+  minorVersion = (*transformUnsigned16)(data + 
+                                        PcapngParser::VERSION_MINOR_POS);
+  timeZoneCorrection = 0;
+  sigfigs = 0;
+
+  // Filled in from the first interface description block.
+  snaplen = 0;
+  network = 0;
+}
+
+inline void Pcap::readPcapngPackets(unsigned char const* data, 
+                                    uint64_t begByte, uint64_t endByte)
+{
+  uint64_t rangeEnd = endByte < numBytes ? endByte : numBytes;
+  if (begByte >= rangeEnd) return;
+
+  PcapngParser parser(this->transformUnsigned32, this->transformUnsigned16);
+
+  // Packets can't be converted without the interface descriptions that
+  // come before them, so the blocks before begByte are walked too, but
+  // only their metadata blocks are kept.
+  size_t mythreadCount = globalNumThreads;
+  if (rangeEnd / mythreadCount < PCAPNG_MIN_BYTES_PER_THREAD) {
+    mythreadCount = rangeEnd / PCAPNG_MIN_BYTES_PER_THREAD;
+  }
+  if (mythreadCount < 1) mythreadCount = 1;
+
+  // First each thread finds the block boundary at or after the start of its
+  // part of the range and walks the blocks that start in its part.
+  std::vector<PcapngRecords> records(mythreadCount);
+  std::vector<uint64_t> firstIndex(mythreadCount);
+  std::vector<uint64_t> stopIndex(mythreadCount);
+  std::vector<char> failed(mythreadCount, false);
+
+  auto walkBlocks = [data, rangeEnd, begByte, &parser, &records,
+                     &firstIndex, &stopIndex, &failed, this]
+                    (size_t threadId, size_t mythreadCount)
+  {
+    uint64_t beg = getBeginIndex(rangeEnd, threadId, mythreadCount);
+    uint64_t end = getEndIndex(rangeEnd, threadId, mythreadCount);
+
+    // number of blocks in a row that have to look right before we believe
+    // we found a block boundary.
     size_t numDesired = 10;
 
-    // We know the largest a packet can be is snaplen long.  So we find
-    // candidates over that range.  However, for now we throw an exception
-    // if our range over the data is smaller than snaplen
-    //if ( end - beg < snaplen) {
-    //  std::string message = "Pcap::readPackets(): in thread looking at data"
-    //    "beg-end < snaplen, which we don't handle currently.  Implement a"
-    //    " better approach or reduce the number of threads. " 
-    //    "Beg: " + boost::lexical_cast<std::string>(beg) +
-    //    " End: " + boost::lexical_cast<std::string>(end) +
-    //    " snaplen: " + boost::lexical_cast<std::string>(snaplen);
-    //  throw PcapException(message);
-    //}
-
-    // Go through the first snaplen part of packetData, and see which of the 
-    // the bytes could possibly be the start of a packet.  
-    details::createCandidates(candidates, numDesired, beg, end, snaplen, 
-                      this->transformUnsigned32, packetData,
-                      firstTimestamp, threadId);
-
-    // Check to make sure the first candidate explains the rest and that we
-    // don't have multiple candidates to choose from.  Throws an exception
-    // if the sequence is off.
-    details::checkSequence(candidates, this->transformUnsigned32, packetData);
-
-    // Process all the packets
-    uint64_t index = *(candidates.begin());
-    while (index < end) {
-  
-      lock.lock();
-      packets.push_back(Packet(&packetData[index], this->transformUnsigned32));
-      lock.unlock();
-      uint32_t lengthPacket = (*this->transformUnsigned32)
-                              (&packetData[index + 8]);
-      index = index + lengthPacket + 16;
+    uint64_t index = 0;
+    if (beg > 0 && !parser.findBlock(data, beg, this->numBytes, numDesired,
+                                     index)) 
+    {
+      failed[threadId] = true;
+      return;
     }
-    
+    firstIndex[threadId] = index;
+    stopIndex[threadId] = parser.readBlocks(data, index, end, 
+                                            this->numBytes, begByte,
+                                            records[threadId]);
   };
 
-  
-  bool failed = true;
+  parallelFor(mythreadCount, [&walkBlocks, mythreadCount](size_t threadId) {
+    walkBlocks(threadId, mythreadCount);
+  });
 
-  //size_t mythreadCount = globalNumThreads;
-  // Force mythreadCount = 1 
-  // Having more threads didn't seem to speed up anything.  Just use one thread
-  size_t mythreadCount = 1;
-  
-  // Reducing thread count if we have too many requested for the size of the 
-  // problem
-  if (numPacketBytes / mythreadCount < snaplen) {
-    mythreadCount = numPacketBytes / (snaplen + 1);
-  
+  // Every thread after the first has to pick up exactly where the previous 
+  // one stopped.  Otherwise walk the blocks with one thread.
+  bool consistent = !failed[0];
+  for (size_t i = 1; i < mythreadCount && consistent; i++) {
+    consistent = !failed[i] && firstIndex[i] == stopIndex[i - 1];
   }
-  if (mythreadCount < 1) mythreadCount = 1;
-  std::thread* threads = new std::thread[mythreadCount];
-  for(size_t i = 0; i < mythreadCount; i++) {
-    threads[i] = std::thread(parseFile, i, mythreadCount);
+  if (!consistent) {
+    mythreadCount = 1;
+    records.assign(1, PcapngRecords());
+    walkBlocks(0, 1);
   }
 
-  for(size_t i = 0; i < mythreadCount; i++) {
-    threads[i].join();
+  // The interfaces in effect at the start of each thread's blocks come 
+  // from the metadata blocks of the threads before it.
+  std::vector<PcapngParser> parsers(mythreadCount, parser);
+  for (size_t i = 1; i < mythreadCount; i++) {
+    parsers[i] = parsers[i - 1];
+    for (auto const& block : records[i - 1].metadataBlocks) {
+      parsers[i].readMetadataBlock(data, block.second);
+    }
   }
 
+  // Then each thread converts its packets.
+  std::vector<PacketTable> tables(mythreadCount);
+  std::vector<std::exception_ptr> errors(mythreadCount);
+  auto convert = [data, &parsers, &records, &tables, &errors]
+                 (size_t threadId)
+  {
+    try {
+      parsers[threadId].convertRecords(data, records[threadId],
+                                       tables[threadId]);
+    } catch (...) {
+      errors[threadId] = std::current_exception();
+    }
+  };
+
+  parallelFor(mythreadCount, convert);
+
+  for (std::exception_ptr const& error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
 
-  delete[] threads;
+  PcapngParser const& last = parsers.back();
+  if (last.hasInterface()) {
+    snaplen = last.getFirstInterface().snaplen;
+    network = last.getFirstInterface().linkType;
+  }
 
+  size_t numPackets = 0;
+  for (PacketTable const& table : tables) {
+    numPackets += table.size();
+  }
+  packets.reserve(packets.size() + numPackets);
+  for (PacketTable const& table : tables) {
+    packets.append(table);
+  }
+}
+
+inline void Pcap::readCompressedFile(std::string const& filename,
+                                     uint64_t begByte, uint64_t endByte)
+{
+  // Decompression happens in the reader's threads.  Meanwhile this thread
+  // walks the packets in the data decompressed so far, which is cheap 
+  // compared to decompressing, so the file is parsed by the time it is 
+  // decompressed.
+  DecompressingReader reader(filename);
+  decompressed = std::make_shared<std::vector<unsigned char>>();
+  std::vector<unsigned char>& buffer = *decompressed;
+
+  // Reads the next chunk onto the end of the buffer.  Returns false at the
+  // end of the file.
+  uint64_t chunkSize = DecompressingReader::CHUNK_SIZE;
+  auto readChunk = [&reader, &buffer, chunkSize]()
+  {
+    uint64_t size = buffer.size();
+    buffer.resize(size + chunkSize);
+    uint64_t count = reader.read(buffer.data() + size, chunkSize);
+    buffer.resize(size + count);
+    return count == chunkSize;
+  };
+
+  bool more = readChunk();
+  while (more && buffer.size() < PcapngParser::SECTION_HEADER_SIZE) {
+    more = readChunk();
+  }
+  numBytes = buffer.size();
+
+  bool pcapng = PcapngParser::isPcapng(buffer.data(), numBytes);
+  if (pcapng) {
+    readPcapngHeader(buffer.data());
+  } else {
+    if (numBytes < PACKET_DATA_POS) {
+      throw PcapException("File " + filename + " is too small to be a pcap");
+    }
+    readHeader(buffer.data());
+  }
+
+  PcapngParser parser(this->transformUnsigned32, this->transformUnsigned16);
+  PcapngRecords records;
+  uint64_t index = pcapng ? 0 : PACKET_DATA_POS;
+
+  while (true) {
+    // Walk the records that are complete in the buffer.
+    if (pcapng) {
+      records.clear();
+      index = parser.readBlocks(buffer.data(), index, endByte, buffer.size(),
+                                begByte, records);
+      parser.convertRecords(buffer.data(), records, packets);
+    } else {
+      while (index < endByte && index + 16 <= buffer.size()) {
+        PacketHeader header(&buffer[index], this->transformUnsigned32);
+        if (index + 16 + header.getIncludedLength() > buffer.size()) break;
+        if (index >= begByte) packets.append(index + 16, header);
+        index = index + header.getIncludedLength() + 16;
+      }
+    }
+
+    if (!more || index >= endByte) break;
+    more = readChunk();
+  }
+
+  // When reading a range, the rest of the file is never decompressed, so
+  // this is the number of bytes decompressed rather than the size of the
+  // whole decompressed file.
+  numBytes = buffer.size();
+
+  if (pcapng && parser.hasInterface()) {
+    snaplen = parser.getFirstInterface().snaplen;
+    network = parser.getFirstInterface().linkType;
+  }
+
+  packets.setBytes(buffer.data());
 }
 
 void 
@@ -439,38 +1056,7 @@ void
 Pcap::applyOperator(Operator op, 
                     std::vector<OutputType>& vec) const
 {
-  size_t mythreadCount = globalNumThreads;
-
-  if (vec.size() < this->getNumPackets()) {
-    vec.resize(this->getNumPackets());
-  }
-
-  auto applyFunction = [this, &vec, mythreadCount, op](size_t threadId)
-  {
-    auto t1 = std::chrono::high_resolution_clock::now();
-    uint64_t beg = getBeginIndex(this->getNumPackets(), threadId, 
-                                 mythreadCount);
-    uint64_t end = getEndIndex(this->getNumPackets(), threadId, 
-                                 mythreadCount);
-
-    for(uint64_t i = beg; i < end; i++) 
-    {
-      op( packets[i], vec[i] ); 
-    }
-    auto t2 = std::chrono::high_resolution_clock::now();
-  };
-
-  std::thread* threads = new std::thread[mythreadCount];
-  for(size_t i = 0; i < mythreadCount; i++) {
-    threads[i] = std::thread(applyFunction, i);
-  }
-
-  for(size_t i = 0; i < mythreadCount; i++) {
-    threads[i].join();
-  }
-
-  delete[] threads;
-  
+  packets.applyOperator<Operator, OutputType>(op, vec);
 }
 
 }
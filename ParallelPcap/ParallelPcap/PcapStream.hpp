@@ -0,0 +1,306 @@
+#ifndef PARALLELPCAP_PCAP_STREAM_HPP
+#define PARALLELPCAP_PCAP_STREAM_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <memory>
+#include <ParallelPcap/Pcap.hpp>
+#include <ParallelPcap/Pcapng.hpp>
+#include <ParallelPcap/DecompressingReader.hpp>
+#include <ParallelPcap/PacketTable.hpp>
+#include <ParallelPcap/Util.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * Roughly how many bytes of memory processing one byte of packet data
+ * takes downstream of the reader: every byte offset of a packet becomes an
+ * std::string ngram (twice, once more when flattened) and then one or two
+ * size_t ids.
+ */
+#define STREAM_BYTES_PER_PACKET_BYTE 100
+
+/**
+ * Reads a pcap file a fixed size window at a time, so that files larger
+ * than memory can be processed.  Each call to nextBatch() returns a
+ * PacketTable of the packets that are complete in the current window.  A
+ * packet that straddles the end of the window is moved to the front of the
+ * next one, so each packet shows up in exactly one batch and packets are
+ * returned in file order.  Pcapng files are read the same way a block at a
+ * time; a block larger than the window grows the window.  Gzip and zstd
+ * compressed files are decompressed on the fly by a DecompressingReader.
+ */
+class PcapStream
+{
+private:
+  DecompressingReader reader;
+
+  /// Holds the current window of the file.
+  std::vector<unsigned char> window;
+
+  /// How many bytes of window hold file data.
+  uint64_t windowFill = 0;
+
+  /// How many bytes at the front of window the last batch used.
+  uint64_t consumed = 0;
+
+  /// True once the whole file has been read into a window.
+  bool eof = false;
+
+  /// Total number of packets returned so far.
+  size_t numPacketsRead = 0;
+
+  // Pcap header fields
+  uint32_t magicNumber;
+  uint16_t majorVersion;
+  uint16_t minorVersion;
+  int32_t  timeZoneCorrection;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t network;
+  uint64_t numBytes;
+
+  AbstractInt32Transformer* transformSigned32 = 0;
+  AbstractUint32Transformer* transformUnsigned32 = 0;
+  AbstractUint16Transformer* transformUnsigned16 = 0;
+
+  /// Keeps track of the interfaces when reading a pcapng file.  Null for
+  /// pcap files.
+  std::unique_ptr<PcapngParser> pcapngParser;
+
+  /// Reused for each window of a pcapng file.
+  PcapngRecords pcapngRecords;
+
+public:
+  /**
+   * Opens the file and reads the pcap header.
+   * \param filename The path to the pcap file.
+   * \param windowSize The number of bytes of the file to hold in memory
+   *                   at a time.  Raised to the largest possible packet
+   *                   record if it is smaller than that.
+   */
+  PcapStream(std::string const& filename, uint64_t windowSize);
+  ~PcapStream();
+
+  PcapStream(PcapStream const& other) = delete;
+  PcapStream& operator=(PcapStream const& other) = delete;
+
+  /**
+   * Reads the next window of the file and finds the packets in it.
+   * \param batch Filled with the packets.  The packet data points into the
+   *              stream's window, so it is only valid until the next call.
+   * \return Returns false when there are no more packets.
+   */
+  bool nextBatch(PacketTable& batch);
+
+  size_t getNumPacketsRead() const { return numPacketsRead; }
+
+  /**
+   * Returns how many bytes at the front of the window the last batch
+   * spans.  Copying them elsewhere and pointing the batch there with
+   * PacketTable::setBytes() keeps the batch valid after the next call.
+   */
+  uint64_t getBatchBytes() const { return consumed; }
+  uint64_t getWindowSize() const { return window.size(); }
+
+  /**
+   * Returns the size of the file.  For a compressed file this is the 
+   * decompressed size, which is only known once the whole file has been
+   * read.
+   */
+  uint64_t getNumBytes() const { return numBytes; }
+  uint32_t getMagicNumber() const { return magicNumber; }
+  uint16_t getMajorVersion() const { return majorVersion; }
+  uint16_t getMinorVersion() const { return minorVersion; }
+  int32_t getTimeZoneCorrection() const { return timeZoneCorrection; }
+  uint32_t getSigfigs() const { return sigfigs; }
+  uint32_t getSnaplen() const;
+  uint32_t getNetwork() const;
+
+  bool isPcapng() const { return static_cast<bool>(pcapngParser); }
+
+  /**
+   * Returns the window size to use so that processing a window stays
+   * within memoryLimit bytes.
+   */
+  static uint64_t windowSizeForMemoryLimit(uint64_t memoryLimit) {
+    return memoryLimit / STREAM_BYTES_PER_PACKET_BYTE;
+  }
+
+private:
+  void fillWindow();
+
+  /**
+   * Finds the complete packet records (or pcapng blocks) at the front of
+   * the window.
+   * \return Returns how many bytes of the window were used.
+   */
+  uint64_t readWindow(PacketTable& batch);
+};
+
+inline PcapStream::PcapStream(std::string const& filename,
+                              uint64_t windowSize)
+  : reader(filename)
+{
+  numBytes = reader.isCompressed() ? 0 : reader.getFileBytes();
+
+  // The window has to at least hold the file header.
+  if (windowSize < PcapngParser::SECTION_HEADER_SIZE) {
+    windowSize = PcapngParser::SECTION_HEADER_SIZE;
+  }
+  window.resize(windowSize);
+  fillWindow();
+
+  if (PcapngParser::isPcapng(window.data(), windowFill)) {
+    if (windowFill < PcapngParser::SECTION_HEADER_SIZE) {
+      throw PcapException("File " + filename + " is too small to be a pcapng");
+    }
+    PcapngParser::createTransformers(window.data(), transformSigned32,
+                                     transformUnsigned32, transformUnsigned16);
+    pcapngParser.reset(new PcapngParser(transformUnsigned32,
+                                        transformUnsigned16));
+
+    magicNumber = PcapngParser::SECTION_HEADER_BLOCK;
+    majorVersion = (*transformUnsigned16)(window.data() + 
+                                          PcapngParser::VERSION_MAJOR_POS);
+    minorVersion = (*transformUnsigned16)(window.data() + 
+                                          PcapngParser::VERSION_MINOR_POS);
+    timeZoneCorrection = 0;
+    sigfigs = 0;
+    snaplen = 0;
+    network = 0;
+
+    // The section header is walked like any other block.
+    return;
+  }
+
+  if (windowFill < Pcap::PACKET_DATA_POS) {
+    throw PcapException("File " + filename + " is too small to be a pcap");
+  }
+
+  unsigned char const* header = window.data();
+  details::createTransformers(header, transformSigned32, transformUnsigned32,
+                              transformUnsigned16);
+  magicNumber = (*transformUnsigned32)(header + Pcap::MAGIC_NUMBER_POS);
+  majorVersion = (*transformUnsigned16)(header + Pcap::VERSION_MAJOR_POS);
+  minorVersion = (*transformUnsigned16)(header + Pcap::VERSION_MINOR_POS);
+  timeZoneCorrection = (*transformSigned32)(header + Pcap::THISZONE_POS);
+  sigfigs = (*transformUnsigned32)(header + Pcap::SIGFIGS_POS);
+  snaplen = (*transformUnsigned32)(header + Pcap::SNAPLEN_POS);
+  network = (*transformUnsigned32)(header + Pcap::NETWORK_POS);
+  consumed = Pcap::PACKET_DATA_POS;
+
+  // A window has to be able to hold at least one whole packet.
+  uint64_t largestRecord = 16 + static_cast<uint64_t>(snaplen);
+  if (window.size() < largestRecord) window.resize(largestRecord);
+}
+
+inline PcapStream::~PcapStream()
+{
+  delete transformSigned32;
+  delete transformUnsigned32;
+  delete transformUnsigned16;
+}
+
+inline uint32_t PcapStream::getSnaplen() const
+{
+  if (pcapngParser && pcapngParser->hasInterface()) {
+    return pcapngParser->getFirstInterface().snaplen;
+  }
+  return snaplen;
+}
+
+inline uint32_t PcapStream::getNetwork() const
+{
+  if (pcapngParser && pcapngParser->hasInterface()) {
+    return pcapngParser->getFirstInterface().linkType;
+  }
+  return network;
+}
+
+inline void PcapStream::fillWindow()
+{
+  // Move the unused tail of the last window (a packet that straddled the
+  // end of it) to the front.
+  if (consumed > 0) {
+    std::memmove(window.data(), window.data() + consumed,
+                 windowFill - consumed);
+    windowFill -= consumed;
+    consumed = 0;
+  }
+
+  while (!eof && windowFill < window.size()) {
+    uint64_t count = window.size() - windowFill;
+    uint64_t numRead = reader.read(window.data() + windowFill, count);
+    windowFill += numRead;
+    if (numRead < count) eof = true;
+  }
+
+  if (eof && reader.isCompressed()) {
+    numBytes = reader.getNumBytesRead();
+  }
+}
+
+inline uint64_t PcapStream::readWindow(PacketTable& batch)
+{
+  if (pcapngParser) {
+    pcapngRecords.clear();
+    uint64_t index = pcapngParser->readBlocks(window.data(), 0, windowFill,
+                                              windowFill, 0, pcapngRecords);
+    pcapngParser->convertRecords(window.data(), pcapngRecords, batch);
+    return index;
+  }
+
+  uint64_t index = 0;
+  while (index + 16 <= windowFill) {
+    PacketHeader header(&window[index], transformUnsigned32);
+    uint64_t recordEnd = index + 16 + header.getIncludedLength();
+    if (recordEnd > windowFill) break;
+
+    batch.append(index + 16, header);
+    index = recordEnd;
+  }
+  return index;
+}
+
+inline bool PcapStream::nextBatch(PacketTable& batch)
+{
+  batch.clear();
+
+  while (true) {
+    fillWindow();
+    batch.setBytes(window.data());
+    consumed = this->readWindow(batch);
+    if (batch.size() > 0) break;
+
+    // Anything left over at the end of the file is a truncated record,
+    // which is dropped like it is by Pcap.
+    if (eof && consumed == 0) return false;
+
+    // The window was all pcapng blocks without packets; read more.
+    if (consumed > 0) continue;
+
+    // Nothing fit in a full window.  A pcapng block can be any size, so 
+    // make room for it; a pcap record can't be larger than the snaplen.
+    uint32_t blockLength = pcapngParser && windowFill >= 12 ?
+      pcapngParser->getBlockLength(window.data(), 0) : 0;
+    if (blockLength > window.size() && 
+        (reader.isCompressed() || blockLength <= numBytes) &&
+        blockLength % 4 == 0) 
+    {
+      window.resize(blockLength);
+      continue;
+    }
+    throw PcapException("PcapStream::nextBatch(): found a packet record"
+      " larger than the snaplen.  The file is corrupt.");
+  }
+
+  numPacketsRead += batch.size();
+  return true;
+}
+
+}
+
+#endif
@@ -0,0 +1,489 @@
+#ifndef PARALLELPCAP_PCAPNG_HPP
+#define PARALLELPCAP_PCAPNG_HPP
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <utility>
+#include <ParallelPcap/ByteManipulations.hpp>
+#include <ParallelPcap/Packet.hpp>
+#include <ParallelPcap/PacketTable.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The exception type generated by the PcapngParser class.
+ */
+class PcapngException : public std::runtime_error {
+public:
+  PcapngException(char const* message) : std::runtime_error(message) {}
+  PcapngException(std::string message) : std::runtime_error(message) {}
+};
+
+/**
+ * What an Interface Description Block says about an interface.
+ */
+class PcapngInterface
+{
+public:
+  uint16_t linkType = 0;
+  uint32_t snaplen = 0; ///< 0 means no limit
+
+  /// Timestamp units per second (the if_tsresol option).
+  uint64_t ticksPerSecond = 1000000;
+
+  /// Seconds to add to every timestamp (the if_tsoffset option).
+  int64_t offsetSeconds = 0;
+};
+
+/**
+ * The packets found by walking a run of pcapng blocks.  The timestamps are
+ * left in the units of their interface, since the interface descriptions
+ * in effect may be in blocks that another thread walked.
+ */
+class PcapngRecords
+{
+public:
+  std::vector<uint64_t> offsets; ///< Offset of each packet's data
+  std::vector<uint32_t> includedLengths;
+  std::vector<uint32_t> originalLengths;
+  std::vector<uint32_t> interfaceIds;
+  std::vector<uint64_t> timestamps; ///< In the interface's units
+
+  /// The section header and interface description blocks that were walked
+  /// over, as (number of packets found before the block, block offset).
+  std::vector<std::pair<size_t, uint64_t>> metadataBlocks;
+
+  size_t size() const { return offsets.size(); }
+
+  void clear() {
+    offsets.clear();
+    includedLengths.clear();
+    originalLengths.clear();
+    interfaceIds.clear();
+    timestamps.clear();
+    metadataBlocks.clear();
+  }
+};
+
+/**
+ * Parses the blocks of a pcapng file.  Every block starts with its type and
+ * total length and ends with the total length again, and blocks are 4-byte
+ * aligned from the start of the file, which is what lets a thread that
+ * starts in the middle of the file find the next block boundary.
+ *
+ * Walking the blocks (readBlocks) only depends on the byte order, so it can
+ * be done by several threads at once.  Turning the packets into a
+ * PacketTable (convertRecords) needs the interface descriptions that came
+ * before them, which the parser keeps track of.
+ *
+ * Files where sections have different byte orders are not supported.
+ */
+class PcapngParser
+{
+private:
+  /// Not owned; the Pcap or PcapStream that created them owns them.
+  AbstractUint32Transformer* transformUnsigned32 = 0;
+  AbstractUint16Transformer* transformUnsigned16 = 0;
+
+  /// The interfaces of the current section, indexed by interface id.
+  std::vector<PcapngInterface> interfaces;
+
+  /// The first interface in the file.  Used for the pcap header fields.
+  PcapngInterface firstInterface;
+  bool hasFirstInterface = false;
+
+public:
+  // Block types
+  static const uint32_t SECTION_HEADER_BLOCK       = 0x0A0D0D0A;
+  static const uint32_t INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+  static const uint32_t PACKET_BLOCK               = 0x00000002; ///< Obsolete
+  static const uint32_t SIMPLE_PACKET_BLOCK        = 0x00000003;
+  static const uint32_t ENHANCED_PACKET_BLOCK      = 0x00000006;
+
+  /// Written in the section header in the byte order of the section.
+  static const uint32_t BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+
+  // Offsets into a section header block
+  static const uint64_t BYTE_ORDER_MAGIC_POS = 8;
+  static const uint64_t VERSION_MAJOR_POS    = 12;
+  static const uint64_t VERSION_MINOR_POS    = 14;
+  static const uint64_t SECTION_HEADER_SIZE  = 28; ///< Without options
+
+  // Interface description block options
+  static const uint16_t OPTION_END_OF_OPT = 0;
+  static const uint16_t OPTION_TSRESOL    = 9;
+  static const uint16_t OPTION_TSOFFSET   = 14;
+
+  PcapngParser() {}
+
+  /**
+   * \param transformUnsigned32 Converts 32-bit fields in the file's byte
+   *                            order.
+   * \param transformUnsigned16 Converts 16-bit fields in the file's byte
+   *                            order.
+   */
+  PcapngParser(AbstractUint32Transformer* transformUnsigned32,
+               AbstractUint16Transformer* transformUnsigned16)
+    : transformUnsigned32(transformUnsigned32),
+      transformUnsigned16(transformUnsigned16) {}
+
+  /**
+   * Returns true if the data starts with a pcapng section header.
+   * \param data The start of the file.
+   * \param numBytes How many bytes of data there are.
+   */
+  static bool isPcapng(unsigned char const* data, uint64_t numBytes) {
+    return numBytes >= 4 && data[0] == 0x0A && data[1] == 0x0D &&
+           data[2] == 0x0D && data[3] == 0x0A;
+  }
+
+  /**
+   * Looks at the byte order magic of the section header at the start of the
+   * file and creates the byte converters that match it.  The caller owns
+   * the converters.
+   * \param data The start of the file.
+   * \return Returns true if the file's byte order is swapped.
+   */
+  static bool createTransformers(unsigned char const* data,
+                                 AbstractInt32Transformer*& transformSigned32,
+                                 AbstractUint32Transformer*& transformUnsigned32,
+                                 AbstractUint16Transformer*& transformUnsigned16);
+
+  uint32_t getBlockType(unsigned char const* data, uint64_t index) const {
+    return (*transformUnsigned32)(&data[index]);
+  }
+
+  uint32_t getBlockLength(unsigned char const* data, uint64_t index) const {
+    return (*transformUnsigned32)(&data[index + 4]);
+  }
+
+  /**
+   * Returns true if a well formed block starts at index: its length is a
+   * multiple of 4, it ends by end, and the trailing copy of the length
+   * matches.
+   */
+  bool isBlock(unsigned char const* data, uint64_t index, uint64_t end) const;
+
+  /**
+   * Returns true if numDesired well formed blocks in a row start at index,
+   * or if well formed blocks run from index up to end (the last may be cut
+   * off by end).
+   */
+  bool isBlockSequence(unsigned char const* data, uint64_t index,
+                       uint64_t end, size_t numDesired) const;
+
+  /**
+   * Finds the first block that starts at or after beg.
+   * \param index Set to the offset of the block.
+   * \param numDesired How many blocks in a row have to look right.
+   * \return Returns false if no block was found before end.
+   */
+  bool findBlock(unsigned char const* data, uint64_t beg, uint64_t end,
+                 size_t numDesired, uint64_t& index) const;
+
+  /**
+   * Walks the blocks starting at index, stopping at the first block that
+   * starts at or after stop, or at a block that is cut off by end.  Only
+   * reads the block framing and the packet block fields, so any number of
+   * threads can walk different parts of the file at once.
+   * Throws a PcapngException at a section header in the other byte order.
+   * \param records Gets the packets whose blocks start at or after keepFrom,
+   *                and all of the whole metadata blocks.
+   * \return Returns the offset where the walk stopped.
+   */
+  uint64_t readBlocks(unsigned char const* data, uint64_t index,
+                      uint64_t stop, uint64_t end, uint64_t keepFrom,
+                      PcapngRecords& records) const;
+
+  /**
+   * Updates the interfaces from a section header or interface description
+   * block.
+   * \param data The buffer the block is in.
+   * \param index Offset of the block.
+   */
+  void readMetadataBlock(unsigned char const* data, uint64_t index);
+
+  /**
+   * Applies the metadata blocks of records in order and adds its packets
+   * to table with their timestamps converted to seconds and microseconds.
+   * Afterwards the parser's interfaces are the ones in effect at the end
+   * of the records.
+   * \param data The buffer the records were read from.
+   */
+  void convertRecords(unsigned char const* data, PcapngRecords const& records,
+                      PacketTable& table);
+
+  size_t getNumInterfaces() const { return interfaces.size(); }
+  bool hasInterface() const { return hasFirstInterface; }
+  PcapngInterface const& getFirstInterface() const { return firstInterface; }
+
+private:
+  uint32_t readUint32(unsigned char const* data, uint64_t index) const {
+    return (*transformUnsigned32)(&data[index]);
+  }
+
+  uint16_t readUint16(unsigned char const* data, uint64_t index) const {
+    return (*transformUnsigned16)(&data[index]);
+  }
+};
+
+inline bool PcapngParser::createTransformers(unsigned char const* data,
+                               AbstractInt32Transformer*& transformSigned32,
+                               AbstractUint32Transformer*& transformUnsigned32,
+                               AbstractUint16Transformer*& transformUnsigned16)
+{
+  unsigned char const* magic = data + BYTE_ORDER_MAGIC_POS;
+  if (magic[0] == 0x1A && magic[1] == 0x2B &&
+      magic[2] == 0x3C && magic[3] == 0x4D)
+  {
+    transformSigned32 = new Int32Transformer();
+    transformUnsigned32 = new Uint32Transformer();
+    transformUnsigned16 = new Uint16Transformer();
+    return false;
+  } else
+  if (magic[0] == 0x4D && magic[1] == 0x3C &&
+      magic[2] == 0x2B && magic[3] == 0x1A)
+  {
+    transformSigned32 = new Int32TransformerSwapped();
+    transformUnsigned32 = new Uint32TransformerSwapped();
+    transformUnsigned16 = new Uint16TransformerSwapped();
+    return true;
+  }
+  throw PcapngException("Tried to get the pcapng byte order magic but it"
+    " wasn't 0x1a2b3c4d or 0x4d3c2b1a");
+}
+
+inline bool PcapngParser::isBlock(unsigned char const* data, uint64_t index,
+                                  uint64_t end) const
+{
+  if (index + 12 > end) return false;
+  uint32_t length = getBlockLength(data, index);
+  if (length < 12 || length % 4 != 0) return false;
+  if (index + length > end) return false;
+  return readUint32(data, index + length - 4) == length;
+}
+
+inline bool PcapngParser::isBlockSequence(unsigned char const* data,
+                                          uint64_t index, uint64_t end,
+                                          size_t numDesired) const
+{
+  size_t j = 0;
+  while (j < numDesired && index < end) {
+    if (!isBlock(data, index, end)) {
+      // A block cut off by end still counts if the ones before it were
+      // fine; whoever walks past end will sort it out.
+      if (j == 0 || index + 12 > end) return j > 0;
+      uint32_t length = getBlockLength(data, index);
+      return length >= 12 && length % 4 == 0 && index + length > end;
+    }
+    index += getBlockLength(data, index);
+    j++;
+  }
+  return true;
+}
+
+inline bool PcapngParser::findBlock(unsigned char const* data, uint64_t beg,
+                                    uint64_t end, size_t numDesired,
+                                    uint64_t& index) const
+{
+  // Blocks are 4-byte aligned from the start of the file.
+  for (uint64_t i = (beg + 3) & ~static_cast<uint64_t>(3); i + 12 <= end;
+       i += 4)
+  {
+    if (isBlockSequence(data, i, end, numDesired)) {
+      index = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline uint64_t PcapngParser::readBlocks(unsigned char const* data,
+                                         uint64_t index, uint64_t stop,
+                                         uint64_t end, uint64_t keepFrom,
+                                         PcapngRecords& records) const
+{
+  while (index < stop && index + 12 <= end) {
+    uint32_t type = getBlockType(data, index);
+
+    // Checked before the length, which a section header in the other byte
+    // order would have the wrong way around.
+    if (type == SECTION_HEADER_BLOCK && 
+        index + BYTE_ORDER_MAGIC_POS + 4 <= end &&
+        readUint32(data, index + BYTE_ORDER_MAGIC_POS) != BYTE_ORDER_MAGIC)
+    {
+      throw PcapngException("PcapngParser: found a section with a different"
+        " byte order than the first one, which is not supported");
+    }
+
+    // A block cut off by end is walked again by whoever reads past end, so
+    // it is only recorded once it is whole.
+    if (!isBlock(data, index, end)) break;
+    uint32_t length = getBlockLength(data, index);
+
+    if (type == SECTION_HEADER_BLOCK || type == INTERFACE_DESCRIPTION_BLOCK) {
+      records.metadataBlocks.push_back(
+        std::make_pair(records.size(), index));
+    }
+
+    if (index >= keepFrom) {
+      if (type == ENHANCED_PACKET_BLOCK && length >= 32) {
+        uint32_t includedLength = readUint32(data, index + 20);
+        if (includedLength <= length - 32) {
+          uint64_t timestamp =
+            (static_cast<uint64_t>(readUint32(data, index + 12)) << 32) |
+            readUint32(data, index + 16);
+          records.offsets.push_back(index + 28);
+          records.includedLengths.push_back(includedLength);
+          records.originalLengths.push_back(readUint32(data, index + 24));
+          records.interfaceIds.push_back(readUint32(data, index + 8));
+          records.timestamps.push_back(timestamp);
+        }
+      } else
+      if (type == PACKET_BLOCK && length >= 32) {
+        uint32_t includedLength = readUint32(data, index + 20);
+        if (includedLength <= length - 32) {
+          uint64_t timestamp =
+            (static_cast<uint64_t>(readUint32(data, index + 12)) << 32) |
+            readUint32(data, index + 16);
+          records.offsets.push_back(index + 28);
+          records.includedLengths.push_back(includedLength);
+          records.originalLengths.push_back(readUint32(data, index + 24));
+          records.interfaceIds.push_back(readUint16(data, index + 8));
+          records.timestamps.push_back(timestamp);
+        }
+      } else
+      if (type == SIMPLE_PACKET_BLOCK && length >= 16) {
+        // Simple packet blocks have no timestamp, and the captured length
+        // is whatever of the original length fits in the block.
+        uint32_t originalLength = readUint32(data, index + 8);
+        uint32_t includedLength = length - 16;
+        if (originalLength < includedLength) includedLength = originalLength;
+        records.offsets.push_back(index + 12);
+        records.includedLengths.push_back(includedLength);
+        records.originalLengths.push_back(originalLength);
+        records.interfaceIds.push_back(0);
+        records.timestamps.push_back(0);
+      }
+    }
+
+    index += length;
+  }
+  return index;
+}
+
+inline void PcapngParser::readMetadataBlock(unsigned char const* data,
+                                            uint64_t index)
+{
+  uint32_t type = getBlockType(data, index);
+  if (type == SECTION_HEADER_BLOCK) {
+    if (readUint32(data, index + BYTE_ORDER_MAGIC_POS) != BYTE_ORDER_MAGIC) {
+      throw PcapngException("PcapngParser: found a section with a different"
+        " byte order than the first one, which is not supported");
+    }
+    // Interface ids start over in each section.
+    interfaces.clear();
+    return;
+  }
+
+  if (type != INTERFACE_DESCRIPTION_BLOCK) return;
+
+  uint32_t length = getBlockLength(data, index);
+  if (length < 20) {
+    throw PcapngException("PcapngParser: interface description block is"
+      " too short");
+  }
+
+  PcapngInterface interface;
+  interface.linkType = readUint16(data, index + 8);
+  interface.snaplen = readUint32(data, index + 12);
+
+  // Walk the options for the timestamp resolution and offset.
+  uint64_t option = index + 16;
+  uint64_t optionsEnd = index + length - 4;
+  while (option + 4 <= optionsEnd) {
+    uint16_t code = readUint16(data, option);
+    uint16_t optionLength = readUint16(data, option + 2);
+    if (code == OPTION_END_OF_OPT) break;
+    uint64_t value = option + 4;
+    if (value + optionLength > optionsEnd) break;
+
+    if (code == OPTION_TSRESOL && optionLength >= 1) {
+      // Either a power of 10 or, with the top bit set, a power of 2.
+      unsigned char resolution = data[value];
+      unsigned char exponent = resolution & 0x7f;
+      uint64_t ticks = 1;
+      if (resolution & 0x80) {
+        if (exponent < 64) ticks = static_cast<uint64_t>(1) << exponent;
+      } else {
+        for (unsigned char e = 0; e < exponent && e < 19; e++) ticks *= 10;
+      }
+      interface.ticksPerSecond = ticks;
+    } else
+    if (code == OPTION_TSOFFSET && optionLength >= 8) {
+      interface.offsetSeconds = static_cast<int64_t>(
+        (static_cast<uint64_t>(readUint32(data, value)) << 32) |
+        readUint32(data, value + 4));
+    }
+
+    // Option values are padded to 32 bits.
+    option = value + ((static_cast<uint64_t>(optionLength) + 3) & ~3ull);
+  }
+
+  interfaces.push_back(interface);
+  if (!hasFirstInterface) {
+    firstInterface = interface;
+    hasFirstInterface = true;
+  }
+}
+
+inline void PcapngParser::convertRecords(unsigned char const* data,
+                                         PcapngRecords const& records,
+                                         PacketTable& table)
+{
+  table.reserve(table.size() + records.size());
+
+  size_t m = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    // Apply the metadata blocks that come before this packet.
+    while (m < records.metadataBlocks.size() &&
+           records.metadataBlocks[m].first <= i)
+    {
+      readMetadataBlock(data, records.metadataBlocks[m].second);
+      m++;
+    }
+
+    uint32_t interfaceId = records.interfaceIds[i];
+    if (interfaceId >= interfaces.size()) {
+      throw PcapngException("PcapngParser: packet refers to interface " +
+        std::to_string(interfaceId) + " but the section only describes " +
+        std::to_string(interfaces.size()));
+    }
+    PcapngInterface const& interface = interfaces[interfaceId];
+
+    uint64_t ticks = records.timestamps[i];
+    uint64_t seconds = ticks / interface.ticksPerSecond;
+    uint64_t fraction = ticks % interface.ticksPerSecond;
+    uint64_t useconds;
+    if (interface.ticksPerSecond % 1000000 == 0) {
+      useconds = fraction / (interface.ticksPerSecond / 1000000);
+    } else {
+      useconds = static_cast<uint64_t>(static_cast<long double>(fraction) *
+        1000000 / interface.ticksPerSecond);
+    }
+
+    table.append(records.offsets[i],
+      PacketHeader(static_cast<uint32_t>(seconds + interface.offsetSeconds),
+                   static_cast<uint32_t>(useconds),
+                   records.includedLengths[i], records.originalLengths[i]));
+  }
+
+  for (; m < records.metadataBlocks.size(); m++) {
+    readMetadataBlock(data, records.metadataBlocks[m].second);
+  }
+}
+
+}
+
+#endif
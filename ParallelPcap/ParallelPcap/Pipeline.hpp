@@ -0,0 +1,250 @@
+#ifndef PARALLELPCAP_PIPELINE_HPP
+#define PARALLELPCAP_PIPELINE_HPP
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <stdexcept>
+
+namespace parallel_pcap {
+
+/**
+ * Thrown inside the stages of a Pipeline that has been cancelled because
+ * another stage failed, to unwind them.  Never escapes Pipeline::run().
+ */
+class PipelineCancelled : public std::runtime_error {
+public:
+  PipelineCancelled() : std::runtime_error("Pipeline cancelled") {}
+};
+
+/**
+ * Runs items through three stages: a read stage on its own thread, a
+ * process stage on the calling thread and a write stage on its own thread,
+ * with queues of at most depth items between them.  So while one item is
+ * being processed, the next ones are being read and the previous ones
+ * written.  Each stage sees the items in the order they were read.
+ *
+ * The read stage can also bound the memory held by the items: it reserves
+ * an item's bytes before making it, waiting while the items already made
+ * and not yet written hold too many, and the write stage releases them.
+ * One item is always let through, however large.
+ *
+ * With a depth of 0 there are no threads or queues: each item is
+ * processed and written as soon as it is read, on the calling thread.
+ *
+ * If a stage throws, the other stages are stopped at their next push, pop
+ * or reserve, and run() rethrows the first exception.
+ */
+template <typename Item>
+class Pipeline
+{
+public:
+  typedef std::function<void(Item&&)> Emit;
+
+  /**
+   * \param depth The most items each queue holds.  0 runs the stages one
+   *              after another.
+   * \param maxBytes The most bytes the items in flight may reserve.  0
+   *                 means no limit.
+   */
+  Pipeline(size_t depth, uint64_t maxBytes)
+    : depth(depth), maxBytes(maxBytes) {}
+
+  Pipeline(Pipeline const&) = delete;
+  Pipeline& operator=(Pipeline const&) = delete;
+
+  size_t getDepth() const { return depth; }
+
+  /**
+   * Runs the stages until read returns and every item it emitted has been
+   * written.
+   * \param read Calls its argument with each item, in order.
+   * \param process Called with each item.
+   * \param write Called with each processed item.
+   */
+  void run(std::function<void(Emit const&)> read,
+           std::function<void(Item&)> process,
+           std::function<void(Item&)> write);
+
+  /**
+   * Called by the read stage before it makes an item that will hold about
+   * numBytes bytes.  Waits until that many can be held.
+   */
+  void reserve(uint64_t numBytes);
+
+  /**
+   * Called by the write stage once an item's reserved bytes are freed.
+   */
+  void release(uint64_t numBytes);
+
+private:
+  /// A bounded queue between two stages.
+  struct Queue
+  {
+    std::deque<Item> items;
+    bool closed = false;
+    std::condition_variable changed;
+  };
+
+  size_t depth;
+  uint64_t maxBytes;
+
+  std::mutex mutex;
+  Queue readQueue;
+  Queue writeQueue;
+
+  uint64_t reservedBytes = 0;
+  std::condition_variable bytesReleased;
+
+  std::exception_ptr error;
+  bool cancelled = false;
+
+  void push(Queue& queue, Item&& item);
+
+  /**
+   * Takes the next item.  Returns false once the queue is closed and
+   * empty.
+   */
+  bool pop(Queue& queue, Item& item);
+
+  void close(Queue& queue);
+
+  /**
+   * Records the exception being handled, unless it is the cancellation
+   * itself, and stops the other stages.
+   */
+  void fail();
+};
+
+template <typename Item>
+void Pipeline<Item>::run(std::function<void(Emit const&)> read,
+                         std::function<void(Item&)> process,
+                         std::function<void(Item&)> write)
+{
+  if (depth == 0) {
+    read([&process, &write](Item&& item) {
+      process(item);
+      write(item);
+    });
+    return;
+  }
+
+  std::thread reader([this, &read] {
+    try {
+      read([this](Item&& item) { this->push(this->readQueue,
+                                            std::move(item)); });
+    } catch (...) {
+      this->fail();
+    }
+    this->close(this->readQueue);
+  });
+
+  std::thread writer([this, &write] {
+    try {
+      Item item;
+      while (this->pop(this->writeQueue, item)) {
+        write(item);
+      }
+    } catch (...) {
+      this->fail();
+    }
+  });
+
+  try {
+    Item item;
+    while (this->pop(this->readQueue, item)) {
+      process(item);
+      this->push(this->writeQueue, std::move(item));
+    }
+  } catch (...) {
+    this->fail();
+  }
+  this->close(this->writeQueue);
+
+  reader.join();
+  writer.join();
+  if (error) std::rethrow_exception(error);
+}
+
+template <typename Item>
+void Pipeline<Item>::reserve(uint64_t numBytes)
+{
+  if (depth == 0) return;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  bytesReleased.wait(lock, [this, numBytes] {
+    return this->cancelled || this->maxBytes == 0 ||
+           this->reservedBytes == 0 ||
+           this->reservedBytes + numBytes <= this->maxBytes;
+  });
+  if (cancelled) throw PipelineCancelled();
+  reservedBytes += numBytes;
+}
+
+template <typename Item>
+void Pipeline<Item>::release(uint64_t numBytes)
+{
+  if (depth == 0) return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  reservedBytes -= numBytes;
+  bytesReleased.notify_all();
+}
+
+template <typename Item>
+void Pipeline<Item>::push(Queue& queue, Item&& item)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  queue.changed.wait(lock, [this, &queue] {
+    return this->cancelled || queue.items.size() < this->depth;
+  });
+  if (cancelled) throw PipelineCancelled();
+  queue.items.push_back(std::move(item));
+  queue.changed.notify_all();
+}
+
+template <typename Item>
+bool Pipeline<Item>::pop(Queue& queue, Item& item)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  queue.changed.wait(lock, [this, &queue] {
+    return this->cancelled || !queue.items.empty() || queue.closed;
+  });
+  if (cancelled) throw PipelineCancelled();
+  if (queue.items.empty()) return false;
+  item = std::move(queue.items.front());
+  queue.items.pop_front();
+  queue.changed.notify_all();
+  return true;
+}
+
+template <typename Item>
+void Pipeline<Item>::close(Queue& queue)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  queue.closed = true;
+  queue.changed.notify_all();
+}
+
+template <typename Item>
+void Pipeline<Item>::fail()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  try {
+    throw;
+  } catch (PipelineCancelled const&) {
+  } catch (...) {
+    if (!error) error = std::current_exception();
+  }
+  cancelled = true;
+  readQueue.changed.notify_all();
+  writeQueue.changed.notify_all();
+  bytesReleased.notify_all();
+}
+
+}
+
+#endif
@@ -3,8 +3,18 @@
 #define DETAIL_TIMING
 
 #include <ParallelPcap/Pcap.hpp>
+#include <ParallelPcap/PcapStream.hpp>
+#include <ParallelPcap/PacketStore.hpp>
+#include <ParallelPcap/NgramSpill.hpp>
+#include <ParallelPcap/TokenTable.hpp>
+#include <ParallelPcap/TokenStore.hpp>
 #include <ParallelPcap/Util.hpp>
 #include <ParallelPcap/CountDictionary.hpp>
+#include <ParallelPcap/DenseCountDictionary.hpp>
+#include <ParallelPcap/FlatCountDictionary.hpp>
+#include <ParallelPcap/SpaceSavingDictionary.hpp>
+#include <ParallelPcap/MappedDictionary.hpp>
+#include <ParallelPcap/Pipeline.hpp>
 #include <boost/program_options.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -14,6 +24,10 @@
 #include <iostream>
 #include <fstream>
 #include <chrono>
+#include <memory>
+#include <functional>
+#include <limits>
+#include <algorithm>
 
 namespace bp = boost::python;
 namespace po = boost::program_options;
@@ -22,6 +36,15 @@ namespace bf = boost::filesystem;
 
 namespace parallel_pcap {
 
+/**
+ * The exception type generated by the ReadPcap class.
+ */
+class ReadPcapException : public std::runtime_error {
+public:
+  ReadPcapException(char const* message) : std::runtime_error(message) {}
+  ReadPcapException(std::string message) : std::runtime_error(message) {}
+};
+
 class ReadPcap {
 
 public:
@@ -51,12 +74,30 @@ public:
   ~ReadPcap() { }
 
 private:
+  /// The hashed dictionary for ngrams of type KeyType.  Ngrams are packed
+  /// into uint64_t keys when all of the ngram sizes fit (see
+  /// canPackNgrams()), and are strings otherwise.  Packed ngrams of up to 3
+  /// bytes are counted by a DenseCountDictionary instead.
+  template <typename KeyType>
+  using DictionaryType = 
+    FlatCountDictionary<KeyType, typename NgramTraits<KeyType>::HashFunction>;
+
+  /// The hashed dictionary used instead of DictionaryType when the
+  /// dictionary has a memory budget (globalDictionaryMemory).
+  template <typename KeyType>
+  using ApproximateDictionaryType = SpaceSavingDictionary<KeyType,
+    typename NgramTraits<KeyType>::HashFunction>;
+
   /// Vector of files to read
   std::vector<std::string> _files;
 
   /// This holds the list of ngram sizes that we want to compute
   bp::list _ngrams;
 
+  /// The ngram sizes, read out of _ngrams once so that the threads that
+  /// process files don't touch the Python list.
+  std::vector<size_t> _ngramSizes;
+
   /// The top vocabSize ngrams are given integer ids. The uncommon ones
   /// are assigned the UNK (unknown) symbol.
   size_t _vocabSize;
@@ -73,11 +114,308 @@ private:
   /// Messenger for printing
   Messenger _msg;
 
+  /**
+   * What goes through the pipeline of each pass (see Pipeline): the
+   * packets of a whole capture file, the packets of a window of one when
+   * streaming, or the end of a streamed file.
+   */
+  template <typename KeyType>
+  struct PipelineItem
+  {
+    size_t fileIndex = 0;
+
+    /// Set on a whole file, and on the item after the last window of a
+    /// streamed file.
+    bool endOfFile = false;
+
+    /// The whole file, when not streaming.
+    std::shared_ptr<Pcap> pcap;
+
+    /// The file being streamed.  Its header fields go in the packet store.
+    std::shared_ptr<PcapStream> stream;
+
+    /// A window's packets, and their data when it was copied out of the
+    /// stream's window (only needed to read ahead).
+    PacketTable batch;
+    std::vector<unsigned char> bytes;
+
+    /// The ngrams of the packets, when the first pass spills them.
+    NgramSpillBatch<KeyType> spill;
+
+    /// The ids of the packets' ngrams, made by the second pass.
+    TokenTable tokens;
+
+    /// Bytes reserved from the pipeline for the item.
+    uint64_t reservedBytes = 0;
+
+    /// False for the item that only ends a streamed file.  Stays set once
+    /// the packets are freed.
+    bool hasPackets = false;
+
+    PacketTable const& getPackets() const {
+      return pcap ? pcap->getPacketTable() : batch;
+    }
+  };
+
+  /**
+   * The read stage of both passes: reads the files a whole file or a
+   * window at a time, reserving each item's memory from the pipeline
+   * first.
+   * \param pipeline The pipeline the stage belongs to.
+   * \param emit Gets each item.
+   * \param fileIndices The files to read, by index in _files.
+   * \param pass Names the pass in messages.
+   * \param windowSize The window size when streaming.
+   * \param windowMemory The bytes to reserve for each window.
+   */
+  template <typename KeyType>
+  void readCaptures(
+    Pipeline<PipelineItem<KeyType>>& pipeline,
+    typename Pipeline<PipelineItem<KeyType>>::Emit const& emit,
+    std::vector<size_t> const& fileIndices, std::string const& pass,
+    uint64_t windowSize, uint64_t windowMemory);
+
+  /**
+   * The writers of the outputs of the file in a pass's write stage, open
+   * from its first item to its last.
+   */
+  template <typename KeyType>
+  struct FileWriters
+  {
+    std::unique_ptr<PacketStoreWriter> store;
+    std::unique_ptr<NgramSpillWriter<KeyType>> spill;
+    std::unique_ptr<std::ofstream> intVectorStream;
+    std::unique_ptr<TokenStoreWriter> vvWriter;
+  };
+
+  /**
+   * The process stage of the first pass: counts the item's ngrams, and
+   * keeps them in the item's spill batch when spilling.
+   */
+  template <typename KeyType, typename Dictionary>
+  void countItem(PipelineItem<KeyType>& item, Dictionary& d);
+
+  /**
+   * The write stage of the first pass: writes the item's packets to the
+   * file's packet store, and its ngrams to the file's spill.
+   */
+  template <typename KeyType>
+  void storeItem(PipelineItem<KeyType>& item, FileWriters<KeyType>& writers);
+
+  /**
+   * The process stage of the second pass: translates the item's packets
+   * into its tokens and frees the packets.
+   */
+  template <typename KeyType, typename Dictionary>
+  void translateItem(PipelineItem<KeyType>& item, Dictionary const& d);
+
+  /**
+   * The write stage of the second pass: appends the item's tokens to the
+   * file's outputs.
+   */
+  template <typename KeyType>
+  void writeItem(PipelineItem<KeyType>& item, FileWriters<KeyType>& writers);
+
+  /**
+   * Runs the files through a pipeline of readCaptures(), process and
+   * write, and frees each item once it is written.
+   * \param fileIndices The files, by index in _files.
+   * \param pass Names the pass in messages.
+   * \param depth The depth of the pipeline.
+   * \param memoryLimit The memory the windows in flight may take, when
+   *                    streaming.
+   */
+  template <typename KeyType>
+  void runPass(
+    std::vector<size_t> const& fileIndices, std::string const& pass,
+    size_t depth, uint64_t memoryLimit,
+    std::function<void(PipelineItem<KeyType>&)> process,
+    std::function<void(PipelineItem<KeyType>&, FileWriters<KeyType>&)> write);
+
+  /**
+   * Calls f(threadId, i) for each of the files, several at once, largest
+   * file first (see parallelForLargestFirst()).
+   * \param fileIndices The files, by index in _files.
+   */
+  template <typename Function>
+  void forEachFile(std::vector<size_t> const& fileIndices, Function f);
+
+  /**
+   * Returns true if dictionaries that count parts of the files and are
+   * then merged give the same ids as one that counts all of them, however
+   * the files are split: true of the exact dictionaries.
+   */
+  template <typename Dictionary>
+  static bool mergesExactly(Dictionary const& d) { return true; }
+
+  template <typename KeyType, typename HF>
+  static bool mergesExactly(SpaceSavingDictionary<KeyType, HF> const& d) {
+    return false;
+  }
+
   void processFiles(std::string &inputfile);
 
+  /**
+   * Makes the dictionary from all of the files and translates the files.
+   * \tparam KeyType The type of the ngram keys.
+   * \tparam Dictionary The dictionary type for KeyType keys.
+   */
+  template <typename KeyType, typename Dictionary>
+  void processFiles();
+
+  /**
+   * Makes the dictionary from all of the files and translates the files,
+   * with the hashed dictionary for KeyType keys: the exact one, or the
+   * approximate one when the dictionary has a memory budget.
+   */
+  template <typename KeyType>
+  void processFilesHashed();
+
+  /**
+   * Returns the path of the saved counts of a shard of the files.
+   */
+  std::string shardPath(size_t shardIndex) const {
+    return this->_outputDir + "dict/shards/shard_" +
+           std::to_string(shardIndex) + ".bin";
+  }
+
+  /**
+   * Returns the path of the ngram spill of a file.
+   */
+  std::string spillPath(size_t fileIndex) const {
+    return this->_outputDir + "spill/" + fileStem(this->_files[fileIndex]) +
+           ".spill";
+  }
+
+  /**
+   * Loads the saved counts of all globalNumShards shards and merges them
+   * into the dictionary.  Up to globalNumThreads shards are read at a
+   * time, each by its own thread.
+   */
+  template <typename Dictionary>
+  void mergeShards(Dictionary& d);
+
+  /**
+   * Reports how approximate the finalized dictionary is.  Exact
+   * dictionaries have nothing to report.
+   */
+  template <typename Dictionary>
+  void reportErrorBounds(Dictionary const& d) {}
+
+  /**
+   * Prints the error bounds of the vocabulary and writes the bounds of
+   * each id to dict/dictionary_bounds.txt, one "id lower upper" line each.
+   */
+  template <typename KeyType, typename HF>
+  void reportErrorBounds(SpaceSavingDictionary<KeyType, HF> const& d);
+
   void createDirectories();
+
+  /**
+   * Returns the name of a capture file without its directory, its
+   * compression extension (.gz, .zst) or its capture extension.  Used to
+   * name the output files.
+   */
+  static std::string fileStem(std::string const& file);
+
+  /**
+   * Computes the ngrams of each of a run of packets for each of the ngram
+   * sizes.
+   * \param packets The packets to ngram.
+   * \param beg The first packet of the run.
+   * \param end One past the last packet of the run.
+   * \param ngramVector Set to the ngrams of packet beg + i in entry i.
+   */
+  template <typename KeyType>
+  void computeNgrams(PacketTable const& packets, size_t beg, size_t end,
+                     std::vector<std::vector<KeyType>>& ngramVector);
+
+  /**
+   * Counts the ngrams of each packet and adds them to a spill batch.  The
+   * packets are ngrammed SPILL_BATCH_BYTES of packet data at a time, so
+   * only that many packets' ngram vectors exist at once.
+   */
+  template <typename KeyType, typename Dictionary>
+  void countSpilledNgrams(PacketTable const& packets, Dictionary& d,
+                          NgramSpillBatch<KeyType>& spill);
+
+  /// How many bytes of packet data countSpilledNgrams() ngrams at a time.
+  static const uint64_t SPILL_BATCH_BYTES = 1 << 22;
+
+  /**
+   * Returns an ngram operator for each of the ngram sizes.
+   */
+  template <typename KeyType>
+  std::vector<typename NgramTraits<KeyType>::Operator> ngramOperators();
+
+  /**
+   * Adds the ngrams of each packet to the dictionary counts, without making
+   * the ngram vectors (see Dictionary::processPackets).
+   */
+  template <typename KeyType, typename Dictionary>
+  void countPackets(PacketTable const& packets, Dictionary& d);
+
+  /**
+   * Translates the ngrams of each packet to integer ids, without making
+   * the ngram vectors (see TokenTable::translatePackets).
+   * \param packets The packets to translate.
+   * \param d The finalized dictionary.
+   * \param tokens Set to the ids of the ngrams of each packet.
+   */
+  template <typename KeyType, typename Dictionary>
+  void translatePackets(PacketTable const& packets, Dictionary const& d,
+                        TokenTable& tokens);
+
+  /**
+   * Translates a batch of an ngram spill to integer ids.
+   * \param keyIds The id of each of the spill's keys.
+   * \param keyIndices The key index of each ngram of the batch.
+   * \param packetOffsets Where the ngrams of each packet of the batch
+   *                      start in keyIndices, plus the end.
+   * \param tokens Set to the ids of the ngrams of each packet.
+   */
+  void translateSpill(std::vector<size_t> const& keyIds,
+                      std::vector<uint32_t> const& keyIndices,
+                      std::vector<uint64_t> const& packetOffsets,
+                      TokenTable& tokens);
+
+  /**
+   * Appends the ids of a table to the outputs of a file.
+   * \param tokens The ids of the ngrams of the packets.
+   * \param intVectorStream Gets all the ids, as binary.
+   * \param vvWriter Gets the ids of each packet.
+   */
+  static void writeTokens(TokenTable const& tokens,
+                          std::ostream& intVectorStream,
+                          TokenStoreWriter& vvWriter);
+
+  /**
+   * Translates a file's ngram spill and writes the outputs.  Used instead of
+   * reading the file again when globalSpillNgrams is set.
+   * \param spillPath The path of the spill.
+   * \param d The finalized dictionary.
+   * \param maxNgrams Roughly how many ngrams to translate at a time.
+   * \param intVectorPath Where to write the ids of all the ngrams.
+   * \param intVectorVectorPath Where to write the ids of each packet.
+   */
+  template <typename KeyType, typename Dictionary>
+  void translateSpillFile(std::string const& spillPath, 
+                          Dictionary& d,
+                          uint64_t maxNgrams,
+                          std::string const& intVectorPath,
+                          std::string const& intVectorVectorPath);
 };
 
+std::string ReadPcap::fileStem(std::string const& file)
+{
+  bf::path p(file);
+  std::string extension = p.extension().string();
+  if (extension == ".gz" || extension == ".zst" || extension == ".zstd") {
+    p = p.stem();
+  }
+  return p.stem().string();
+}
+
 void ReadPcap::createDirectories()
 {
   // Add slash to outputDir string if not there
@@ -99,12 +437,184 @@ void ReadPcap::createDirectories()
   // dictionary
   if (!bf::exists(this->_outputDir + "dict/"))
     bf::create_directory(this->_outputDir + "dict/");
+
+  // saved counts of the shards of the files
+  if (globalNumShards > 0 && !bf::exists(this->_outputDir + "dict/shards/"))
+    bf::create_directory(this->_outputDir + "dict/shards/");
+
+  // ngram spills, removed once they are translated
+  if (globalSpillNgrams && !bf::exists(this->_outputDir + "spill/"))
+    bf::create_directory(this->_outputDir + "spill/");
+}
+
+template <typename KeyType>
+void ReadPcap::computeNgrams(PacketTable const& packets, size_t beg,
+                             size_t end,
+                             std::vector<std::vector<KeyType>>& ngramVector)
+{
+  typedef typename NgramTraits<KeyType>::Operator Operator;
+  auto operators = this->ngramOperators<KeyType>();
+  size_t numThreads = globalNumThreads;
+
+  ngramVector.resize(end - beg);
+  for (std::vector<KeyType>& ngrams : ngramVector) ngrams.clear();
+
+  // The threads take chunks of about the same number of bytes of packets
+  // as they go (see PacketTable::applyOperator).
+  ChunkSchedule schedule(end - beg, numThreads,
+    [&packets, beg](size_t i) -> uint64_t {
+      return packets.getIncludedLength(beg + i);
+    });
+
+  auto ngramFunction = [&packets, beg, &operators, &schedule,
+                        &ngramVector](size_t threadId)
+  {
+    size_t chunkBeg, chunkEnd;
+    while (schedule.next(chunkBeg, chunkEnd)) {
+      for (size_t i = chunkBeg; i < chunkEnd; i++) {
+        for (Operator const& op : operators) {
+          op(packets.getPacket(beg + i), ngramVector[i]);
+        }
+      }
+    }
+  };
+
+  parallelFor(numThreads, ngramFunction);
+}
+
+template <typename KeyType, typename Dictionary>
+void ReadPcap::countSpilledNgrams(PacketTable const& packets, Dictionary& d,
+                                  NgramSpillBatch<KeyType>& spill)
+{
+  this->_msg.printMessage("Calculating and spilling ngrams");
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  std::vector<std::vector<KeyType>> ngramVector;
+  double lockWaitSeconds = 0;
+  size_t beg = 0;
+  while (beg < packets.size()) {
+    size_t end = beg;
+    uint64_t batchBytes = 0;
+    while (end < packets.size() && batchBytes < SPILL_BATCH_BYTES) {
+      batchBytes += packets.getIncludedLength(end++);
+    }
+
+    this->computeNgrams(packets, beg, end, ngramVector);
+    d.processTokens(flatten(ngramVector));
+    lockWaitSeconds += d.getLockWaitSeconds();
+    spill.add(ngramVector);
+    beg = end;
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  this->_msg.printDuration("Time to ngram, count and spill: ", t1, t2);
+  this->_msg.printMessage("Lock wait time in dictionary.processTokens: " +
+    std::to_string(lockWaitSeconds) + " seconds");
+}
+
+template <typename KeyType>
+std::vector<typename NgramTraits<KeyType>::Operator> ReadPcap::ngramOperators()
+{
+  typedef typename NgramTraits<KeyType>::Operator Operator;
+  std::vector<Operator> operators;
+  for (size_t ngram : this->_ngramSizes) {
+    operators.push_back(Operator(ngram));
+  }
+  return operators;
+}
+
+template <typename KeyType, typename Dictionary>
+void ReadPcap::countPackets(PacketTable const& packets, Dictionary& d)
+{
+  auto operators = this->ngramOperators<KeyType>();
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  d.processPackets(packets, operators);
+  auto t2 = std::chrono::high_resolution_clock::now();
+  this->_msg.printDuration("Time for dictionary.processPackets: ", t1, t2);
+  this->_msg.printMessage("Lock wait time in dictionary.processPackets: " +
+    std::to_string(d.getLockWaitSeconds()) + " seconds");
+}
+
+template <typename KeyType, typename Dictionary>
+void ReadPcap::translatePackets(PacketTable const& packets, 
+                                Dictionary const& d, TokenTable& tokens)
+{
+  auto operators = this->ngramOperators<KeyType>();
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  tokens.translatePackets(packets, operators, d);
+  auto t2 = std::chrono::high_resolution_clock::now();
+  this->_msg.printDuration("Time for tokens.translatePackets: ", t1, t2);
+}
+
+void ReadPcap::translateSpill(std::vector<size_t> const& keyIds,
+                              std::vector<uint32_t> const& keyIndices,
+                              std::vector<uint64_t> const& packetOffsets,
+                              TokenTable& tokens)
+{
+  // The spill batch is already laid out like the table.
+  size_t numThreads = globalNumThreads;
+  tokens.setOffsets(packetOffsets);
+
+  auto translateFunction = [&keyIds, &keyIndices, &tokens, 
+                            numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(keyIndices.size(), threadId, numThreads);
+    size_t end = getEndIndex(keyIndices.size(), threadId, numThreads);
+
+    size_t* ids = tokens.getPacketIds(0);
+    for (size_t i = beg; i < end; i++) {
+      ids[i] = keyIds[keyIndices[i]];
+    }
+  };
+
+  parallelFor(numThreads, translateFunction);
+}
+
+void ReadPcap::writeTokens(TokenTable const& tokens,
+                           std::ostream& intVectorStream,
+                           TokenStoreWriter& vvWriter)
+{
+  writeBinary(tokens.getIds(), intVectorStream);
+  vvWriter.write(tokens);
+}
+
+template <typename KeyType, typename Dictionary>
+void ReadPcap::translateSpillFile(std::string const& spillPath,
+                                  Dictionary& d, 
+                                  uint64_t maxNgrams,
+                                  std::string const& intVectorPath,
+                                  std::string const& intVectorVectorPath)
+{
+  NgramSpillReader<KeyType> spill(spillPath);
+
+  // Each distinct ngram of the file is looked up in the dictionary once.
+  auto t1 = std::chrono::high_resolution_clock::now();
+  std::vector<size_t> keyIds = d.translate(spill.getKeys());
+  auto t2 = std::chrono::high_resolution_clock::now();
+  this->_msg.printDuration("Time for dictionary.translate (spill keys): ", 
+                           t1, t2);
+
+  std::ofstream intVectorStream(intVectorPath, std::ios::binary);
+  TokenStoreWriter vvWriter(intVectorVectorPath, this->_vocabSize);
+
+  std::vector<uint32_t> keyIndices;
+  std::vector<uint64_t> packetOffsets;
+  TokenTable tokens;
+  while (spill.nextBatch(maxNgrams, keyIndices, packetOffsets)) {
+    this->translateSpill(keyIds, keyIndices, packetOffsets, tokens);
+    writeTokens(tokens, intVectorStream, vvWriter);
+  }
+  vvWriter.finish();
 }
 
 void ReadPcap::processFiles(std::string &inputDir) 
 {
   auto everythingt1 = std::chrono::high_resolution_clock::now();
-  typedef CountDictionary<std::string, StringHashFunction> DictionaryType;
+  size_t numTasksBefore = globalThreadPool.getNumTasksDispatched();
+  size_t numLoopsBefore = globalThreadPool.getNumLoops();
+  std::vector<double> busyBefore = globalThreadPool.getBusySeconds();
 
   // Create directories
   this->createDirectories();
@@ -115,65 +625,443 @@ void ReadPcap::processFiles(std::string &inputDir)
       this->_files.push_back(itr->path().string());
   }
 
+  // In name order, so that every process agrees on the shards.
+  std::sort(this->_files.begin(), this->_files.end());
+
+  if (globalNumShards > 0 && globalDictionaryMemory > 0) {
+    throw ReadPcapException("ReadPcap: dictionary shards can't be saved"
+      " with a dictionary memory budget (the approximate dictionary only"
+      " saves its final counters)");
+  }
+  if (globalNumShards > 0 && !globalMergeShards &&
+      globalShardIndex >= globalNumShards)
+  {
+    throw ReadPcapException("ReadPcap: shard " +
+      std::to_string(globalShardIndex) + " of " +
+      std::to_string(globalNumShards) + " doesn't exist");
+  }
+
+  std::vector<size_t>& ngramSizes = this->_ngramSizes;
+  for (size_t i = 0; i < bp::len(this->_ngrams); ++i) {
+    ngramSizes.push_back(bp::extract<size_t>(this->_ngrams[i]));
+  }
+
+  // Packed ngrams of up to 3 bytes have few enough possible keys to count
+  // in flat arrays.
+  size_t maxNgramSize = ngramSizes.empty() ? 0 :
+    *std::max_element(ngramSizes.begin(), ngramSizes.end());
+  if (!canPackNgrams(ngramSizes)) {
+    this->processFilesHashed<std::string>();
+  } else if (maxNgramSize == 1) {
+    this->processFiles<uint64_t, DenseCountDictionary<1>>();
+  } else if (maxNgramSize == 2) {
+    this->processFiles<uint64_t, DenseCountDictionary<2>>();
+  } else if (maxNgramSize == 3) {
+    this->processFiles<uint64_t, DenseCountDictionary<3>>();
+  } else {
+    this->processFilesHashed<uint64_t>();
+  }
+
+  auto everythingt2 = std::chrono::high_resolution_clock::now();
+  this->_msg.printDuration("Time for everything: ", everythingt1, everythingt2);
+  this->_msg.printMessage("Thread pool tasks dispatched: " +
+    std::to_string(globalThreadPool.getNumTasksDispatched() - numTasksBefore) +
+    " in " + std::to_string(globalThreadPool.getNumLoops() - numLoopsBefore) +
+    " parallel loops on " + std::to_string(globalThreadPool.getNumThreads()) +
+    " threads");
+
+  // A thread with much less busy time than the others spent the difference
+  // waiting for them at the end of loops.
+  std::vector<double> busy = globalThreadPool.getBusySeconds();
+  std::string busyMessage = "Busy time of each thread (seconds):";
+  for (size_t i = 0; i < busy.size(); i++) {
+    double seconds = busy[i] - (i < busyBefore.size() ? busyBefore[i] : 0);
+    busyMessage += " " + std::to_string(seconds);
+  }
+  this->_msg.printMessage(busyMessage);
+  this->_msg.printPeakMemory("Peak memory: ");
+}
+
+template <typename KeyType>
+void ReadPcap::processFilesHashed()
+{
+  if (globalDictionaryMemory > 0) {
+    this->processFiles<KeyType, ApproximateDictionaryType<KeyType>>();
+  } else {
+    this->processFiles<KeyType, DictionaryType<KeyType>>();
+  }
+}
+
+template <typename KeyType, typename HF>
+void ReadPcap::reportErrorBounds(SpaceSavingDictionary<KeyType, HF> const& d)
+{
+  this->_msg.printMessage(d.getErrorReport());
+
+  std::ofstream bounds(this->_outputDir + "dict/dictionary_bounds.txt");
+  bounds << "# " << d.getErrorReport() << "\n";
+  bounds << "# id lower upper\n";
+  auto const& counters = d.getCounters();
+  size_t numItems = std::min(counters.size(), this->_vocabSize);
+  for (size_t i = 0; i < numItems; i++) {
+    bounds << i + 1 << " " << counters[i].count - counters[i].error << " "
+           << counters[i].count << "\n";
+  }
+}
+
+template <typename Dictionary>
+void ReadPcap::mergeShards(Dictionary& d)
+{
+  for (size_t k = 0; k < globalNumShards; k++) {
+    if (!bf::exists(shardPath(k))) {
+      throw ReadPcapException("ReadPcap: the counts of shard " +
+        std::to_string(k) + " (" + shardPath(k) + ") are missing");
+    }
+  }
+
+  // Parsing the archives takes most of the time, so they are read in
+  // parallel, and merged in shard order.
+  size_t numThreads = std::max<size_t>(1, globalNumThreads);
+  for (size_t first = 0; first < globalNumShards; first += numThreads) {
+    size_t numShards = std::min(numThreads, globalNumShards - first);
+    std::vector<std::unique_ptr<Dictionary>> shards(numShards);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    auto loadFunction = [this, &shards, first](size_t i) {
+      shards[i].reset(new Dictionary(this->_vocabSize));
+      std::ifstream ifs(this->shardPath(first + i));
+      ba::text_iarchive ar(ifs);
+      ar >> *shards[i];
+    };
+    parallelFor(numShards, loadFunction);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("Time to load dictionary shards: ", t1, t2);
+
+    t1 = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < numShards; i++) {
+      d.merge(*shards[i]);
+      shards[i].reset();
+    }
+    t2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("Time to merge dictionary shards: ", t1, t2);
+  }
+}
+
+template <typename KeyType>
+void ReadPcap::readCaptures(
+  Pipeline<PipelineItem<KeyType>>& pipeline,
+  typename Pipeline<PipelineItem<KeyType>>::Emit const& emit,
+  std::vector<size_t> const& fileIndices, std::string const& pass,
+  uint64_t windowSize, uint64_t windowMemory)
+{
+  typedef PipelineItem<KeyType> Item;
+  bool streaming = globalMemoryLimit > 0;
+
+  // The stream reads the next batch into the same window, so a batch the
+  // later stages may still be using is copied out of it.
+  bool copyWindows = pipeline.getDepth() > 0;
+
+  for (size_t i : fileIndices) {
+    std::string message = pass + ": Processing pcap file "
+                          + this->_files[i]
+                          + " number " + std::to_string(i + 1)
+                          + " out of " + std::to_string(this->_files.size());
+    this->_msg.printMessage(message);
+
+    if (streaming) {
+      std::shared_ptr<PcapStream> stream(
+        new PcapStream(this->_files[i], windowSize));
+      while (true) {
+        pipeline.reserve(windowMemory);
+        Item item;
+        item.fileIndex = i;
+        item.stream = stream;
+        item.reservedBytes = windowMemory;
+        item.hasPackets = true;
+        if (!stream->nextBatch(item.batch)) {
+          pipeline.release(windowMemory);
+          break;
+        }
+        if (copyWindows) {
+          item.bytes.assign(item.batch.getBytes(),
+                            item.batch.getBytes() + stream->getBatchBytes());
+          item.batch.setBytes(item.bytes.data());
+        }
+        emit(std::move(item));
+      }
+
+      Item end;
+      end.fileIndex = i;
+      end.endOfFile = true;
+      end.stream = stream;
+      emit(std::move(end));
+    } else {
+      // A whole file is taken to need as much memory per byte as a
+      // window, so the files in flight are capped like windows are.  The
+      // bytes are those on disk, which undercounts compressed files.
+      uint64_t fileMemory = 
+        bf::file_size(this->_files[i]) * STREAM_BYTES_PER_PACKET_BYTE;
+      pipeline.reserve(fileMemory);
+
+      Item item;
+      item.fileIndex = i;
+      item.endOfFile = true;
+      item.hasPackets = true;
+      item.reservedBytes = fileMemory;
+
+      auto t1 = std::chrono::high_resolution_clock::now();
+      item.pcap.reset(new Pcap(this->_files[i]));
+      auto t2 = std::chrono::high_resolution_clock::now();
+      this->_msg.printDuration("Time to create pcap object:", t1, t2);
+      this->_msg.printMessage("Num packets: " +
+                              std::to_string(item.pcap->getNumPackets()));
+      emit(std::move(item));
+    }
+  }
+}
+
+template <typename KeyType, typename Dictionary>
+void ReadPcap::countItem(PipelineItem<KeyType>& item, Dictionary& d)
+{
+  if (!item.hasPackets) return;
+
+  // The ngram vectors are only made when they are spilled; otherwise
+  // the packets are counted directly.
+  if (globalSpillNgrams) {
+    this->countSpilledNgrams(item.getPackets(), d, item.spill);
+  } else {
+    this->countPackets<KeyType>(item.getPackets(), d);
+  }
+}
+
+template <typename KeyType>
+void ReadPcap::storeItem(PipelineItem<KeyType>& item,
+                         FileWriters<KeyType>& writers)
+{
+  if (!writers.store) {
+    /// Save pcap file on first pass for later use
+    std::string stem = fileStem(this->_files[item.fileIndex]);
+    writers.store.reset(new PacketStoreWriter(this->_outputDir + "pcaps/" +
+                                              stem + ".bin"));
+    if (globalSpillNgrams) {
+      writers.spill.reset(
+        new NgramSpillWriter<KeyType>(this->spillPath(item.fileIndex)));
+    }
+  }
+
+  if (item.hasPackets) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    writers.store->write(item.getPackets());
+    auto t2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("Time to write packet store: ", t1, t2);
+    if (writers.spill) writers.spill->write(item.spill);
+  }
+
+  if (item.endOfFile) {
+    if (item.pcap) {
+      writers.store->finish(*item.pcap);
+    } else {
+      writers.store->finish(*item.stream);
+    }
+    writers.store.reset();
+    if (writers.spill) writers.spill->finish();
+    writers.spill.reset();
+    this->_msg.printPeakMemory("Peak memory so far: ");
+  }
+}
+
+template <typename KeyType, typename Dictionary>
+void ReadPcap::translateItem(PipelineItem<KeyType>& item, Dictionary const& d)
+{
+  if (!item.hasPackets) return;
+  this->translatePackets<KeyType>(item.getPackets(), d, item.tokens);
+
+  // Only the ids are written, so the packets can go.
+  item.pcap.reset();
+  item.batch = PacketTable();
+  std::vector<unsigned char>().swap(item.bytes);
+}
+
+template <typename KeyType>
+void ReadPcap::writeItem(PipelineItem<KeyType>& item,
+                         FileWriters<KeyType>& writers)
+{
+  auto t1 = std::chrono::high_resolution_clock::now();
+  if (!writers.vvWriter) {
+    std::string stem = fileStem(this->_files[item.fileIndex]);
+    writers.intVectorStream.reset(new std::ofstream(this->_outputDir +
+      "intVector/" + this->_filePrefixIntVector + "_" + stem + ".bin",
+      std::ios::binary));
+    writers.vvWriter.reset(new TokenStoreWriter(this->_outputDir +
+      "intVectorVector/" + this->_filePrefixIntVectorVector + "_" +
+      stem + ".bin", this->_vocabSize));
+  }
+
+  /// Write the ids out to disk.
+  if (item.hasPackets) {
+    writeTokens(item.tokens, *writers.intVectorStream, *writers.vvWriter);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("Time to write tokens: ", t1, t2);
+  }
+
+  if (item.endOfFile) {
+    writers.vvWriter->finish();
+    writers.vvWriter.reset();
+    writers.intVectorStream.reset();
+  }
+}
+
+template <typename KeyType>
+void ReadPcap::runPass(
+  std::vector<size_t> const& fileIndices, std::string const& pass,
+  size_t depth, uint64_t memoryLimit,
+  std::function<void(PipelineItem<KeyType>&)> process,
+  std::function<void(PipelineItem<KeyType>&, FileWriters<KeyType>&)> write)
+{
+  typedef PipelineItem<KeyType> Item;
+
+  // Up to depth + 1 windows are held at once, and they share the limit.
+  uint64_t windowMemory = memoryLimit / (depth + 1);
+  uint64_t windowSize = PcapStream::windowSizeForMemoryLimit(windowMemory);
+
+  // Whole files reserve what they are estimated to take (see
+  // readCaptures()).  Without a limit they share the machine's memory.
+  uint64_t pipelineMemory = memoryLimit > 0 ? memoryLimit : 
+                                              getPhysicalMemory();
+  Pipeline<Item> pipeline(depth, pipelineMemory);
+  FileWriters<KeyType> writers;
+
+  auto readFiles = [this, &pipeline, &fileIndices, &pass, windowSize,
+                    windowMemory](typename Pipeline<Item>::Emit const& emit)
+  {
+    this->readCaptures<KeyType>(pipeline, emit, fileIndices, pass,
+                                windowSize, windowMemory);
+  };
+
+  auto writeItem = [&pipeline, &writers, &write](Item& item)
+  {
+    uint64_t reservedBytes = item.reservedBytes;
+    write(item, writers);
+    item = Item();
+    pipeline.release(reservedBytes);
+  };
+
+  pipeline.run(readFiles, process, writeItem);
+}
+
+template <typename Function>
+void ReadPcap::forEachFile(std::vector<size_t> const& fileIndices,
+                           Function f)
+{
+  std::vector<uint64_t> sizes;
+  for (size_t i : fileIndices) {
+    sizes.push_back(bf::file_size(this->_files[i]));
+  }
+  parallelForLargestFirst(sizes, [&fileIndices, &f](size_t threadId,
+                                                    size_t k) {
+    f(threadId, fileIndices[k]);
+  });
+}
+
+template <typename KeyType, typename Dictionary>
+void ReadPcap::processFiles()
+{
+  typedef PipelineItem<KeyType> Item;
+
   // Create the dictionary
-  DictionaryType d(this->_vocabSize);
+  Dictionary d(this->_vocabSize);
+
+  // With a memory limit, files are read a window at a time instead of
+  // all at once.
+  bool streaming = globalMemoryLimit > 0;
+
+  // With globalFileParallelism, each thread reads its own files, one at a
+  // time and without a pipeline, and the threads share the memory limit.
+  // The counts of an approximate dictionary depend on the order of the
+  // files, so it still counts them one at a time.  So does an exact one
+  // with a memory limit: counting in parallel takes a dictionary for each
+  // thread, which the limit doesn't cover (a dense one is hundreds of MB
+  // and a hashed one grows with the files).
+  bool fileParallel = globalFileParallelism;
+  bool countFileParallel = fileParallel && mergesExactly(d) && !streaming;
+  size_t depth = fileParallel ? 0 : globalPipelineDepth;
+  uint64_t fileMemory = fileParallel ? globalMemoryLimit / globalNumThreads :
+                                       globalMemoryLimit;
+  uint64_t windowSize = 
+    PcapStream::windowSizeForMemoryLimit(fileMemory / (depth + 1));
+
+  // With globalSpillNgrams, the first pass keeps each file's ngrams and the
+  // second pass translates those instead of reading the file again.
+  bool spilling = globalSpillNgrams;
+
+  // With shards, this process either only counts its shard of the files
+  // (the first pass), or only merges the counts of the shards (the second
+  // pass).
+  bool countingShard = globalNumShards > 0 && !globalMergeShards;
+  bool mergingShards = globalNumShards > 0 && globalMergeShards;
 
   this->_msg.printMessage("Total numer of files " + std::to_string(this->_files.size()));
 
+  std::vector<size_t> firstPassFiles;
+  for (size_t i = 0; i < this->_files.size() && !mergingShards; i++) {
+    if (countingShard && i % globalNumShards != globalShardIndex) continue;
+    firstPassFiles.push_back(i);
+  }
+
+  auto storeItem = [this](Item& item, FileWriters<KeyType>& writers)
+  {
+    this->storeItem(item, writers);
+  };
+
   /// We run through all the pcap files.  In this first pass we
   /// 1) Create a pcap object from each file and save that to disk using
-  ///    Boost serialize.
+  ///    a PacketStoreWriter.
   /// 2) Create a vector of all the string ngrams found in the pcap file.
   /// 3) Feed that vector of string ngrams into the dictionary object to
   ///    iteratively update the dictionary counts for each ngram. 
-  for (size_t i = 0; i < this->_files.size(); i++) 
-  {
-    std::string message = "First pass: Processing pcap file " 
-                          + this->_files[i]
-                          + " number " + std::to_string(i + 1) 
-                          + " out of " + std::to_string(this->_files.size());
-    this->_msg.printMessage(message);
-    
-    auto t1 = std::chrono::high_resolution_clock::now();
-    Pcap pcap(this->_files[i]);
-    auto t2 = std::chrono::high_resolution_clock::now();
-    
-    this->_msg.printDuration("Time to create pcap object:", t1, t2);
+  /// 4) When spilling, write the ngrams to the file's ngram spill.
+  /// Reading (and the packet store and spill writes) run in stages of
+  /// their own, alongside the counting, when there is a pipeline.
+  if (countFileParallel) {
+    // Each thread counts its files into a dictionary of its own.  The
+    // counts are exact, so adding them up gives the same ids whichever
+    // thread counted which file.
+    std::vector<std::unique_ptr<Dictionary>> threadDictionaries(
+      globalNumThreads);
+    this->forEachFile(firstPassFiles, [this, &threadDictionaries, &storeItem,
+                                       fileMemory](size_t threadId, size_t i)
+    {
+      std::unique_ptr<Dictionary>& counts = threadDictionaries[threadId];
+      if (!counts) counts.reset(new Dictionary(this->_vocabSize));
+      this->runPass<KeyType>(std::vector<size_t>(1, i), "First pass", 0,
+        fileMemory, [this, &counts](Item& item) {
+          this->countItem<KeyType>(item, *counts);
+        }, storeItem);
+    });
 
-    /// Save pcap file on first pass for later use
-    bf::path p(this->_files[i]);
-    std::string save_path = this->_outputDir + "pcaps/" + 
-                            p.stem().string() + ".bin";
-    std::ofstream ofs(save_path);
-    ba::text_oarchive ar(ofs);
-    ar << pcap;
-
-    // Calculate the ngrams
-    std::vector<std::vector<std::string>> ngramVector;
-    typedef std::vector<std::string> OutputType;
-    this->_msg.printMessage("Calculating Ngrams");
-
-    for (size_t i = 0; i < bp::len(this->_ngrams); ++i) {
-      size_t ngram = bp::extract<size_t>(this->_ngrams[i]);
-
-      t1 = std::chrono::high_resolution_clock::now();
-      NgramOperator ngramOperator(ngram);
-      pcap.applyOperator<NgramOperator, OutputType>(ngramOperator,
-                                                      ngramVector);
-      t2 = std::chrono::high_resolution_clock::now();
-
-      this->_msg.printDuration("Time to create ngram: ", t1, t2);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (std::unique_ptr<Dictionary>& counts : threadDictionaries) {
+      if (counts) d.merge(*counts);
+      counts.reset();
     }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("Time to merge the threads' dictionaries: ",
+                             t1, t2);
+  } else {
+    this->runPass<KeyType>(firstPassFiles, "First pass", depth,
+      globalMemoryLimit,
+      [this, &d](Item& item) { this->countItem<KeyType>(item, d); },
+      storeItem);
+  }
 
-    t1 = std::chrono::high_resolution_clock::now();
-    std::vector<std::string> allNgrams = flatten(ngramVector);
-    t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("Time to flatten ngram: ", t1, t2);
-  
-    t1 = std::chrono::high_resolution_clock::now();
-    d.processTokens(allNgrams);
-    t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("Time for dictionary.processTokens: ", t1, t2);
+  if (countingShard) {
+    // The counts are merged and the files translated by the merging run.
+    std::ofstream shardStream(shardPath(globalShardIndex));
+    ba::text_oarchive shardArchive(shardStream);
+    shardArchive << d;
+    return;
+  }
+  if (mergingShards) {
+    this->mergeShards(d);
   }
 
   /// The dictionary has all the counts for all the ngrams in all the files.
@@ -182,72 +1070,96 @@ void ReadPcap::processFiles(std::string &inputDir)
   d.finalize();
   auto t2 = std::chrono::high_resolution_clock::now();
   this->_msg.printDuration("Time for dictionary.finalize: ", t1, t2);
+  this->reportErrorBounds(d);
+  this->_msg.printPeakMemory("Peak memory after the first pass: ");
+
+  // The files whose ngrams were spilled are translated from their spills
+  // and the rest are read again.  A merging run only has the spills of the
+  // shard runs that spilled, so some or all of its files may be read
+  // again whatever its own setting.
+  std::vector<size_t> spilledFiles;
+  std::vector<size_t> secondPassFiles;
+  for (size_t i = 0; i < this->_files.size(); i++) {
+    if (spilling && bf::exists(this->spillPath(i))) {
+      spilledFiles.push_back(i);
+    } else {
+      secondPassFiles.push_back(i);
+    }
+  }
 
   // In this pass we 
-  /// 1) read in the pcap files again,
+  /// 1) read in the pcap files again (or the ngram spills),
   /// 2) translate the pcap file into a single vector of integers, and
   /// 3) also create a vector of vector of integers where the first dimension
   ///    indexes the packet.
-  for (size_t i = 0; i < this->_files.size(); i++) 
-  {
-    bf::path p(this->_files[i]);
-    std::string message = "2nd pass: Processing pcap file " 
-                        + this->_files[i]
-                        + " number " + std::to_string(i + 1)
-                        + " out of " + std::to_string(this->_files.size());
-    this->_msg.printMessage(message);
+  /// The dictionary is only read from here on, so with
+  /// globalFileParallelism every kind of dictionary translates several
+  /// files at once.
+  if (!spilledFiles.empty()) {
+    auto translateFile = [this, &d, streaming, windowSize](size_t i)
+    {
+      std::string stem = fileStem(this->_files[i]);
+      std::string message = "2nd pass: Processing pcap file " 
+                          + this->_files[i]
+                          + " number " + std::to_string(i + 1)
+                          + " out of " + std::to_string(this->_files.size());
+      this->_msg.printMessage(message);
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-    Pcap pcap(this->_files[i]);
-    auto t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("Time to create pcap object:", t1, t2);
-    this->_msg.printMessage("Num packets: " + std::to_string(pcap.getNumPackets()));
-
-    // Calculate the ngrams
-    std::vector<std::vector<std::string>> ngramVector;
-    typedef std::vector<std::string> OutputType;
-
-    this->_msg.printMessage("Calculating ngrams");
-
-    for (size_t i = 0; i < bp::len(this->_ngrams); ++i) {
-      size_t ngram = bp::extract<size_t>(this->_ngrams[i]);
-      
-      t1 = std::chrono::high_resolution_clock::now();
-      NgramOperator ngramOperator(ngram);
-      pcap.applyOperator<NgramOperator, OutputType>(ngramOperator, 
-                                                      ngramVector);
-      t2 = std::chrono::high_resolution_clock::now();
-      this->_msg.printDuration("Time to create ngram: ", t1, t2);
-    }
+      std::string intVectorPath = this->_outputDir + "intVector/" + 
+        this->_filePrefixIntVector + "_" + stem + ".bin";
+      std::string intVectorVectorPath = this->_outputDir + "intVectorVector/" + 
+        this->_filePrefixIntVectorVector + "_" + stem + ".bin";
 
-    t1 = std::chrono::high_resolution_clock::now();
-    std::vector<std::string> allNgrams = flatten(ngramVector);
-    t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("Time to flatten ngram: ", t1, t2);
- 
-    /// We translate the entire vector of strings to a vector of ints and 
-    /// write that out to disk. 
-    t1 = std::chrono::high_resolution_clock::now();
-    std::vector<size_t> translated = d.translate(allNgrams);
-    t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("Time for dictionary.translate (one file): ", t1, t2);
+      // Streaming translates about as many ngrams at a time as fit in a
+      // window; otherwise the whole file at once.
+      uint64_t maxNgrams = streaming ? windowSize / sizeof(size_t) :
+                                       std::numeric_limits<uint64_t>::max();
+      std::string spillPath = this->spillPath(i);
+      this->translateSpillFile<KeyType>(spillPath, d, maxNgrams, intVectorPath,
+                                        intVectorVectorPath);
+      bf::remove(spillPath);
+    };
 
-    std::string path = this->_outputDir + "intVector/" + 
-      this->_filePrefixIntVector + "_" + p.stem().string() + ".bin";
-    writeBinary(translated, path);
+    if (fileParallel) {
+      this->forEachFile(spilledFiles, [&translateFile](size_t threadId,
+                                                       size_t i) {
+        translateFile(i);
+      });
+    } else {
+      for (size_t i : spilledFiles) {
+        translateFile(i);
+      }
+    }
+  }
+  if (!secondPassFiles.empty()) {
+    auto translateItem = [this, &d](Item& item)
+    {
+      this->translateItem<KeyType>(item, d);
+    };
+    auto writeItem = [this](Item& item, FileWriters<KeyType>& writers)
+    {
+      this->writeItem(item, writers);
+    };
 
-    /// Translate the vector of vector of strings into a vector of vector
-    /// of ints.
-    t1 = std::chrono::high_resolution_clock::now();
-    std::vector<std::vector<size_t>> vvtranslated = d.translate(ngramVector); 
-    t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("Time for dictionary.translate (vector of vectors): ", t1, t2);
+    /// Reading and writing the ids run in stages of their own, alongside
+    /// the translation, when there is a pipeline.
+    if (fileParallel) {
+      this->forEachFile(secondPassFiles, [this, &translateItem, &writeItem,
+                                          fileMemory](size_t threadId,
+                                                      size_t i)
+      {
+        this->runPass<KeyType>(std::vector<size_t>(1, i), "2nd pass", 0,
+                               fileMemory, translateItem, writeItem);
+      });
+    } else {
+      this->runPass<KeyType>(secondPassFiles, "2nd pass", depth,
+                             globalMemoryLimit, translateItem, writeItem);
+    }
+  }
 
-    path = this->_outputDir + "intVectorVector/" + 
-      this->_filePrefixIntVectorVector + "_" + p.stem().string() + ".bin";
-    std::ofstream ofs(path);
-    boost::archive::text_oarchive oa(ofs);
-    oa << vvtranslated;
+  // A merging run also removes spills of shard runs it didn't use.
+  if (spilling || mergingShards) {
+    bf::remove_all(this->_outputDir + "spill/");
   }
 
   // Save dictionary to disk for later use
@@ -256,8 +1168,10 @@ void ReadPcap::processFiles(std::string &inputDir)
   ba::text_oarchive d_ar(d_ofs);
   d_ar << d;
 
-  auto everythingt2 = std::chrono::high_resolution_clock::now();
-  this->_msg.printDuration("Time for everything: ", everythingt1, everythingt2);
+  // And the key to id table on its own, which TestPcap can map instead.
+  MappedDictionary<KeyType, typename NgramTraits<KeyType>::HashFunction>::
+    write(this->_outputDir + "dict/dictionary.ids", d.getVocabulary(),
+          this->_vocabSize);
 }
 
 }
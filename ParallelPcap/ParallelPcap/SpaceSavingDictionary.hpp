@@ -0,0 +1,804 @@
+#ifndef PARALLELPCAP_SPACE_SAVING_DICTIONARY_HPP
+#define PARALLELPCAP_SPACE_SAVING_DICTIONARY_HPP
+
+#include <vector>
+#include <map>
+#include <queue>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <boost/serialization/serialization.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/vector.hpp>
+#include <ParallelPcap/Util.hpp>
+#include <ParallelPcap/CountDictionary.hpp>
+#include <ParallelPcap/TranslationTable.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * An approximate CountDictionary that counts in a fixed amount of memory,
+ * however many distinct keys the data has.  Only the vocabSize most
+ * frequent keys get ids, so instead of counting every key exactly, each
+ * counting thread keeps a Space-Saving summary (Metwally et al.) of a
+ * fixed number of counters: a key that has a counter gets its count
+ * bumped, and a key that doesn't takes over the counter with the smallest
+ * count c, starting at c + 1 with an error of c.  Every counter's count is
+ * then an upper bound on its key's true count, and count - error a lower
+ * bound.  A key without a counter occurred at most as often as the
+ * smallest counter, which is at most (keys counted) / (counters).
+ *
+ * finalize() merges the thread summaries into one of the same size, and
+ * the keys with the largest counts get the ids.  The error bounds of the
+ * chosen vocabulary are available afterwards (getMaxError(),
+ * getUntrackedBound(), getNumGuaranteed()).
+ *
+ * The interface matches CountDictionary, and the dictionary is saved in
+ * the archive layout of CountDictionary<KeyType, HF> with the upper bounds
+ * as the counts, so TestPcap loads it like any other dictionary.
+ */
+template <typename KeyType, typename HF>
+class SpaceSavingDictionary
+{
+public:
+  typedef KeyType key_type;
+
+  static const size_t UNK = 0;
+
+  /// A tracked key.  Its true count is in [count - error, count].
+  struct Counter
+  {
+    KeyType key;
+    uint64_t count;
+    uint64_t error;
+  };
+
+  /**
+   * Approximately how much memory each counter takes, with its share of
+   * the summary's hash index.
+   */
+  static size_t bytesPerCounter() {
+    return sizeof(Counter) + 5 * sizeof(uint32_t);
+  }
+
+  /**
+   * \param vocabSize Only the vocabSize most frequent keys get an id.
+   * \param memoryBudget About how many bytes the counters may use.  It is
+   *                     split between the counting threads' summaries and
+   *                     the merged summary.
+   */
+  SpaceSavingDictionary(size_t vocabSize,
+                        size_t memoryBudget = globalDictionaryMemory)
+    : vocabSize(vocabSize), memoryBudget(memoryBudget) {}
+
+  /**
+   * Returns the upper bound on how often the key occurred (0 if the key
+   * isn't tracked).  Only up to date after finalize().
+   */
+  size_t getCount(KeyType const& key) const;
+
+  /**
+   * Returns how much getCount(key) may overcount the key.
+   */
+  size_t getError(KeyType const& key) const;
+
+  /**
+   * Returns the id of the key, or UNK if the key doesn't have one.
+   */
+  size_t getWord2Int(KeyType const& key) const;
+
+  /**
+   * Returns the keys that have ids and their ids, for writing a
+   * MappedDictionary.  Empty until finalized.
+   */
+  std::vector<std::pair<KeyType, size_t>> getVocabulary() const {
+    return translationTable.getEntries();
+  }
+
+  /**
+   * Returns the number of keys tracked by the merged summary, which is at
+   * most the number of counters.  Only up to date after finalize().
+   */
+  size_t getNumKeys() const { return merged.size(); }
+
+  /**
+   * Returns the merged counters by decreasing count, so the counter at i is
+   * that of the key with id i + 1.  Only up to date after finalize().
+   */
+  std::vector<Counter> const& getCounters() const { return merged; }
+
+  /**
+   * Returns the number of counters each summary has, or 0 before the first
+   * count call.
+   */
+  size_t getNumCounters() const { return numCounters; }
+
+  /**
+   * Returns the number of keys counted.
+   */
+  uint64_t getNumTokens() const { return numTokens; }
+
+  /**
+   * Returns the largest error of the keys that got ids.
+   */
+  uint64_t getMaxError() const { return maxError; }
+
+  /**
+   * Returns the most a key that isn't tracked after finalize() can have
+   * occurred.  Keys without ids but tracked have their own bounds.
+   */
+  uint64_t getUntrackedBound() const { return untrackedBound; }
+
+  /**
+   * Returns how many of the keys with ids are certainly among the vocabSize
+   * most frequent: their lower bound is at least the upper bound of every
+   * key without an id.
+   */
+  size_t getNumGuaranteed() const { return numGuaranteed; }
+
+  /**
+   * Summarizes the error bounds of the vocabulary.
+   */
+  std::string getErrorReport() const;
+
+  /**
+   * Space-Saving takes no locks, so this is always 0.
+   */
+  double getLockWaitSeconds() const { return 0; }
+
+  /**
+   * Adds the tokens to the summaries.
+   */
+  void processTokens(std::vector<KeyType> const& v);
+
+  /**
+   * Counts the ngrams of a set of packets without making a vector of all of
+   * them first (see CountDictionary::processPackets).
+   * \param packets The packets (a PacketTable or PacketStore).
+   * \param operators The ngram operators to apply to each packet.
+   */
+  template <typename Packets, typename Operator>
+  void processPackets(Packets const& packets,
+                      std::vector<Operator> const& operators);
+
+  /**
+   * Merges the summaries and assigns the ids.  Call once all of the keys
+   * have been processed.
+   */
+  void finalize();
+
+  /**
+   * Adds the summaries of another dictionary, which finalize() then merges
+   * with these like those of any other counting thread.  Neither dictionary
+   * may be finalized.  The archive of a dictionary has only the merged
+   * counters, so this only combines dictionaries in memory.
+   */
+  void merge(SpaceSavingDictionary const& other);
+
+  /**
+   * Translates keys to ids.  finalize() must have been called.
+   */
+  std::vector<size_t> translate(std::vector<KeyType> const& v);
+
+  std::vector<std::vector<size_t>>
+  translate(std::vector<std::vector<KeyType>> const& v);
+
+private:
+  /**
+   * The Space-Saving summary of one counting thread: the counters in a
+   * min-heap on count, and an open-addressing index from keys to their
+   * place in the heap.
+   */
+  class Summary
+  {
+  public:
+    Summary(size_t numCounters);
+
+    void add(KeyType const& key);
+
+    /**
+     * Returns the count of the smallest counter, which bounds the count of
+     * every key without a counter.
+     */
+    uint64_t getMinCount() const {
+      return heap.size() < numCounters ? 0 : heap[0].count;
+    }
+
+    /**
+     * Takes the counters, sorted by key, and empties the summary.
+     */
+    std::vector<Counter> takeSortedCounters();
+
+  private:
+    size_t numCounters;
+    HF hash;
+
+    /// The counters, a min-heap on count.
+    std::vector<Counter> heap;
+
+    /// The index slot of each counter in the heap.
+    std::vector<uint32_t> heapSlots;
+
+    /// 1 + the heap position of the key in each slot, or 0.  A power of
+    /// two at least twice numCounters.
+    std::vector<uint32_t> index;
+
+    size_t homeSlot(KeyType const& key) const {
+      return (hash(key) * 0x9e3779b97f4a7c15ULL) >> 32 & (index.size() - 1);
+    }
+
+    /// Returns the slot with the key, or index.size().
+    size_t findSlot(KeyType const& key) const;
+
+    void insertSlot(size_t position);
+    void eraseSlot(size_t slot);
+    void swapCounters(size_t a, size_t b);
+    void siftDown(size_t position);
+    void siftUp(size_t position);
+  };
+
+  size_t vocabSize;
+  size_t memoryBudget;
+  HF hash;
+
+  /// The counters of each summary.  Set by the first count call.
+  size_t numCounters = 0;
+  std::vector<Summary> summaries;
+
+  uint64_t numTokens = 0;
+
+  /// The merged counters, by decreasing count.  The counter at i has id
+  /// i + 1.
+  std::vector<Counter> merged;
+
+  /// 1 + the position in merged of the key in each slot, or 0.
+  std::vector<uint32_t> lookup;
+
+  /// The keys that getWord2Int() gives ids.
+  TranslationTable<KeyType, HF> translationTable;
+
+  uint64_t maxError = 0;
+  uint64_t untrackedBound = 0;
+  size_t numGuaranteed = 0;
+
+  bool finalized = false;
+
+  /**
+   * Makes a summary for each counting thread, if there are none yet, and
+   * returns the number of summaries.
+   */
+  size_t prepareSummaries();
+
+  /**
+   * Returns the position of the key in merged, or merged.size().
+   */
+  size_t findMerged(KeyType const& key) const;
+
+  /**
+   * Makes the index into merged and the translation table.
+   */
+  void buildLookup();
+
+  // Serialization, in the layout of CountDictionary.
+  friend class boost::serialization::access;
+
+  template<class Archive>
+  void save(Archive &ar, const unsigned int version) const;
+
+  template<class Archive>
+  void load(Archive &ar, const unsigned int version);
+
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
+template <typename KeyType, typename HF>
+SpaceSavingDictionary<KeyType, HF>::Summary::Summary(size_t numCounters)
+  : numCounters(numCounters)
+{
+  size_t indexSize = 1;
+  while (indexSize < 2 * numCounters) indexSize *= 2;
+  index.assign(indexSize, 0);
+  heap.reserve(numCounters);
+  heapSlots.reserve(numCounters);
+}
+
+template <typename KeyType, typename HF>
+size_t SpaceSavingDictionary<KeyType, HF>::Summary::findSlot(
+  KeyType const& key) const
+{
+  size_t mask = index.size() - 1;
+  for (size_t i = homeSlot(key); ; i = (i + 1) & mask) {
+    if (index[i] == 0) return index.size();
+    if (heap[index[i] - 1].key == key) return i;
+  }
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::Summary::insertSlot(size_t position)
+{
+  size_t mask = index.size() - 1;
+  size_t i = homeSlot(heap[position].key);
+  while (index[i] != 0) i = (i + 1) & mask;
+  index[i] = position + 1;
+  heapSlots[position] = i;
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::Summary::eraseSlot(size_t slot)
+{
+  // Backward shift deletion: move later keys of the probe run into the
+  // hole if their home slot allows it.
+  size_t mask = index.size() - 1;
+  size_t hole = slot;
+  index[hole] = 0;
+  for (size_t i = (hole + 1) & mask; index[i] != 0; i = (i + 1) & mask) {
+    size_t home = homeSlot(heap[index[i] - 1].key);
+    bool stays = hole < i ? (home > hole && home <= i)
+                          : (home > hole || home <= i);
+    if (!stays) {
+      index[hole] = index[i];
+      heapSlots[index[hole] - 1] = hole;
+      index[i] = 0;
+      hole = i;
+    }
+  }
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::Summary::swapCounters(size_t a,
+                                                               size_t b)
+{
+  std::swap(heap[a], heap[b]);
+  std::swap(heapSlots[a], heapSlots[b]);
+  index[heapSlots[a]] = a + 1;
+  index[heapSlots[b]] = b + 1;
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::Summary::siftDown(size_t position)
+{
+  size_t size = heap.size();
+  while (true) {
+    size_t smallest = position;
+    size_t left = 2 * position + 1;
+    size_t right = left + 1;
+    if (left < size && heap[left].count < heap[smallest].count) {
+      smallest = left;
+    }
+    if (right < size && heap[right].count < heap[smallest].count) {
+      smallest = right;
+    }
+    if (smallest == position) return;
+    swapCounters(position, smallest);
+    position = smallest;
+  }
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::Summary::siftUp(size_t position)
+{
+  while (position > 0) {
+    size_t parent = (position - 1) / 2;
+    if (heap[parent].count <= heap[position].count) return;
+    swapCounters(position, parent);
+    position = parent;
+  }
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::Summary::add(KeyType const& key)
+{
+  size_t slot = findSlot(key);
+  if (slot != index.size()) {
+    size_t position = index[slot] - 1;
+    heap[position].count++;
+    siftDown(position);
+    return;
+  }
+
+  if (heap.size() < numCounters) {
+    heap.push_back(Counter { key, 1, 0 });
+    heapSlots.push_back(0);
+    insertSlot(heap.size() - 1);
+    siftUp(heap.size() - 1);
+    return;
+  }
+
+  // Take over the smallest counter.
+  Counter& smallest = heap[0];
+  eraseSlot(heapSlots[0]);
+  smallest.key = key;
+  smallest.error = smallest.count;
+  smallest.count++;
+  insertSlot(0);
+  siftDown(0);
+}
+
+template <typename KeyType, typename HF>
+std::vector<typename SpaceSavingDictionary<KeyType, HF>::Counter>
+SpaceSavingDictionary<KeyType, HF>::Summary::takeSortedCounters()
+{
+  std::vector<Counter> counters;
+  counters.swap(heap);
+  std::vector<uint32_t>().swap(heapSlots);
+  std::vector<uint32_t>().swap(index);
+
+  std::sort(counters.begin(), counters.end(),
+    [](Counter const& a, Counter const& b) { return a.key < b.key; });
+  return counters;
+}
+
+template <typename KeyType, typename HF>
+size_t SpaceSavingDictionary<KeyType, HF>::prepareSummaries()
+{
+  if (finalized) {
+    throw CountDictionaryException("SpaceSavingDictionary: tried to count"
+      " after finalize() was called.");
+  }
+
+  if (summaries.empty()) {
+    // The threads' summaries and the merged summary each get a share.
+    size_t numThreads = std::max<size_t>(1, globalNumThreads);
+    numCounters = memoryBudget / ((numThreads + 1) * bytesPerCounter());
+    numCounters = std::min<size_t>(numCounters,
+      std::numeric_limits<uint32_t>::max() / 2);
+    if (numCounters < vocabSize) {
+      throw CountDictionaryException("SpaceSavingDictionary: a memory budget"
+        " of " + std::to_string(memoryBudget) + " bytes gives " +
+        std::to_string(numThreads) + " threads " +
+        std::to_string(numCounters) + " counters each, fewer than the " +
+        std::to_string(vocabSize) + " the vocabulary needs.");
+    }
+    for (size_t i = 0; i < numThreads; i++) {
+      summaries.push_back(Summary(numCounters));
+    }
+  }
+  return summaries.size();
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::processTokens(
+  std::vector<KeyType> const& v)
+{
+  size_t numThreads = prepareSummaries();
+  auto countFunction = [this, &v, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(v.size(), threadId, numThreads);
+    size_t end = getEndIndex(v.size(), threadId, numThreads);
+
+    Summary& summary = this->summaries[threadId];
+    for (size_t i = beg; i < end; i++) {
+      summary.add(v[i]);
+    }
+  };
+  parallelFor(numThreads, countFunction);
+  numTokens += v.size();
+}
+
+template <typename KeyType, typename HF>
+template <typename Packets, typename Operator>
+void SpaceSavingDictionary<KeyType, HF>::processPackets(
+  Packets const& packets, std::vector<Operator> const& operators)
+{
+  size_t numThreads = prepareSummaries();
+  std::vector<uint64_t> threadTokens(numThreads, 0);
+
+  // Each thread keeps a fixed share of the packets rather than taking
+  // chunks as it goes (see ChunkSchedule): which packets share a summary
+  // changes the approximate counts, and they should be the same from one
+  // run to the next.
+  auto countFunction = [this, &packets, &operators, &threadTokens,
+                        numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(packets.size(), threadId, numThreads);
+    size_t end = getEndIndex(packets.size(), threadId, numThreads);
+
+    // Only one packet's ngrams exist at a time.
+    Summary& summary = this->summaries[threadId];
+    std::vector<KeyType> ngrams;
+    for (size_t i = beg; i < end; i++) {
+      ngrams.clear();
+      for (Operator const& op : operators) {
+        op(packets.getPacket(i), ngrams);
+      }
+      for (KeyType const& key : ngrams) {
+        summary.add(key);
+      }
+      threadTokens[threadId] += ngrams.size();
+    }
+  };
+  parallelFor(numThreads, countFunction);
+
+  for (uint64_t n : threadTokens) numTokens += n;
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::merge(
+  SpaceSavingDictionary const& other)
+{
+  if (finalized || other.finalized) {
+    throw CountDictionaryException("Tried to merge dictionaries but one of"
+      " them has been finalized.");
+  }
+  summaries.insert(summaries.end(), other.summaries.begin(),
+                   other.summaries.end());
+  numCounters = std::max(numCounters, other.numCounters);
+  numTokens += other.numTokens;
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::finalize()
+{
+  // A key missing from a summary occurred at most that summary's minimum
+  // count times in its thread's share of the data.
+  std::vector<uint64_t> minCounts;
+  uint64_t totalMinCount = 0;
+  for (Summary const& summary : summaries) {
+    minCounts.push_back(summary.getMinCount());
+    totalMinCount += summary.getMinCount();
+  }
+
+  std::vector<std::vector<Counter>> sorted;
+  for (Summary& summary : summaries) {
+    sorted.push_back(summary.takeSortedCounters());
+  }
+  summaries.clear();
+
+  // Merge the key-sorted summaries, keeping the numCounters keys with the
+  // largest upper bounds in a min-heap.
+  auto largerCount = [](Counter const& a, Counter const& b) {
+    return a.count > b.count || (a.count == b.count && a.key < b.key);
+  };
+  std::priority_queue<Counter, std::vector<Counter>, decltype(largerCount)>
+    best(largerCount);
+  uint64_t largestDropped = 0;
+
+  typedef std::pair<KeyType, size_t> Head;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  std::vector<size_t> next(sorted.size(), 0);
+  for (size_t s = 0; s < sorted.size(); s++) {
+    if (!sorted[s].empty()) heads.push(Head(sorted[s][0].key, s));
+  }
+
+  while (!heads.empty()) {
+    // Summaries with the key add its bounds, and the others their
+    // minimum count as both count and error.
+    Counter counter { heads.top().first, 0, 0 };
+    uint64_t absentMinCount = totalMinCount;
+    while (!heads.empty() && heads.top().first == counter.key) {
+      size_t s = heads.top().second;
+      heads.pop();
+      Counter const& c = sorted[s][next[s]];
+      counter.count += c.count;
+      counter.error += c.error;
+      absentMinCount -= minCounts[s];
+      if (++next[s] < sorted[s].size()) {
+        heads.push(Head(sorted[s][next[s]].key, s));
+      }
+    }
+    counter.count += absentMinCount;
+    counter.error += absentMinCount;
+
+    best.push(counter);
+    if (best.size() > numCounters) {
+      largestDropped = std::max(largestDropped, best.top().count);
+      best.pop();
+    }
+  }
+  std::vector<std::vector<Counter>>().swap(sorted);
+
+  merged.clear();
+  merged.reserve(best.size());
+  while (!best.empty()) {
+    merged.push_back(best.top());
+    best.pop();
+  }
+  std::reverse(merged.begin(), merged.end());
+  buildLookup();
+
+  // The bounds of the keys that got ids against every key that didn't.
+  untrackedBound = std::max(totalMinCount, largestDropped);
+  size_t numItems = std::min(merged.size(), vocabSize);
+  uint64_t largestWithoutId = untrackedBound;
+  for (size_t i = numItems; i < merged.size(); i++) {
+    largestWithoutId = std::max(largestWithoutId, merged[i].count);
+  }
+  maxError = 0;
+  numGuaranteed = 0;
+  for (size_t i = 0; i < numItems; i++) {
+    maxError = std::max(maxError, merged[i].error);
+    if (merged[i].count - merged[i].error >= largestWithoutId) {
+      numGuaranteed++;
+    }
+  }
+
+  finalized = true;
+}
+
+template <typename KeyType, typename HF>
+void SpaceSavingDictionary<KeyType, HF>::buildLookup()
+{
+  size_t size = 1;
+  while (size < 2 * merged.size()) size *= 2;
+  lookup.assign(size, 0);
+
+  size_t mask = size - 1;
+  for (size_t i = 0; i < merged.size(); i++) {
+    size_t slot = (hash(merged[i].key) * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+    while (lookup[slot] != 0) slot = (slot + 1) & mask;
+    lookup[slot] = i + 1;
+  }
+
+  // Like CountDictionary, only ids below vocabSize are used.
+  std::vector<std::pair<KeyType, size_t>> entries;
+  for (size_t i = 0; i + 1 < vocabSize && i < merged.size(); i++) {
+    entries.push_back(std::make_pair(merged[i].key, i + 1));
+  }
+  translationTable.build(entries);
+}
+
+template <typename KeyType, typename HF>
+size_t SpaceSavingDictionary<KeyType, HF>::findMerged(
+  KeyType const& key) const
+{
+  if (lookup.empty()) return merged.size();
+
+  size_t mask = lookup.size() - 1;
+  size_t slot = (hash(key) * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+  for (; lookup[slot] != 0; slot = (slot + 1) & mask) {
+    if (merged[lookup[slot] - 1].key == key) return lookup[slot] - 1;
+  }
+  return merged.size();
+}
+
+template <typename KeyType, typename HF>
+size_t SpaceSavingDictionary<KeyType, HF>::getCount(KeyType const& key) const
+{
+  size_t i = findMerged(key);
+  return i < merged.size() ? merged[i].count : 0;
+}
+
+template <typename KeyType, typename HF>
+size_t SpaceSavingDictionary<KeyType, HF>::getError(KeyType const& key) const
+{
+  size_t i = findMerged(key);
+  return i < merged.size() ? merged[i].error : 0;
+}
+
+template <typename KeyType, typename HF>
+size_t SpaceSavingDictionary<KeyType, HF>::getWord2Int(
+  KeyType const& key) const
+{
+  return translationTable.lookup(key);
+}
+
+template <typename KeyType, typename HF>
+std::string SpaceSavingDictionary<KeyType, HF>::getErrorReport() const
+{
+  return "Approximate dictionary: " + std::to_string(numTokens) +
+    " keys counted with " + std::to_string(numCounters) +
+    " counters per summary; " + std::to_string(numGuaranteed) + " of " +
+    std::to_string(std::min(merged.size(), vocabSize)) + " vocabulary keys"
+    " guaranteed; largest vocabulary count error " +
+    std::to_string(maxError) + "; untracked keys occurred at most " +
+    std::to_string(untrackedBound) + " times";
+}
+
+template <typename KeyType, typename HF>
+std::vector<size_t>
+SpaceSavingDictionary<KeyType, HF>::translate(std::vector<KeyType> const& v)
+{
+  if (!finalized) {
+    throw CountDictionaryException("Tried to translate vector but finalized"
+      " has not been called.");
+  }
+
+  std::vector<size_t> data(v.size());
+  size_t numThreads = globalNumThreads;
+  auto translateFunction = [this, &v, &data, numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(v.size(), threadId, numThreads);
+    size_t end = getEndIndex(v.size(), threadId, numThreads);
+
+    for (size_t i = beg; i < end; i++) {
+      data[i] = this->getWord2Int(v[i]);
+    }
+  };
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+template <typename KeyType, typename HF>
+std::vector<std::vector<size_t>>
+SpaceSavingDictionary<KeyType, HF>::translate(
+  std::vector<std::vector<KeyType>> const& v)
+{
+  if (!finalized) {
+    throw CountDictionaryException("Tried to translate vector but finalized"
+      " has not been called.");
+  }
+
+  std::vector<std::vector<size_t>> data(v.size());
+  size_t numThreads = globalNumThreads;
+  ChunkSchedule schedule(v.size(), numThreads,
+    [&v](size_t i) -> uint64_t { return v[i].size(); });
+  auto translateFunction = [this, &v, &data, &schedule](size_t threadId)
+  {
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for (size_t i = beg; i < end; i++) {
+        data[i].resize(v[i].size());
+        for (size_t j = 0; j < v[i].size(); j++) {
+          data[i][j] = this->getWord2Int(v[i][j]);
+        }
+      }
+    }
+  };
+  parallelFor(numThreads, translateFunction);
+  return data;
+}
+
+template <typename KeyType, typename HF>
+template <class Archive>
+void SpaceSavingDictionary<KeyType, HF>::save(
+  Archive &ar, const unsigned int version) const
+{
+  // Bucket the tracked keys the way CountDictionary does.
+  std::atomic<size_t> archiveNumKeys(merged.size());
+  size_t archiveCapacity =
+    std::max<size_t>(1, DICTIONARY_SIZE_FACTOR * merged.size());
+  std::vector<std::map<KeyType, size_t>> counts(archiveCapacity);
+  std::vector<std::map<KeyType, size_t>> word2Int(archiveCapacity);
+  for (size_t i = 0; i < merged.size(); i++) {
+    size_t index = hash(merged[i].key) % archiveCapacity;
+    counts[index][merged[i].key] = merged[i].count;
+    if (i < vocabSize) word2Int[index][merged[i].key] = i + 1;
+  }
+  bool initialized = !merged.empty();
+
+  ar &archiveNumKeys &vocabSize &archiveCapacity &counts &word2Int
+     &initialized &finalized;
+}
+
+template <typename KeyType, typename HF>
+template <class Archive>
+void SpaceSavingDictionary<KeyType, HF>::load(Archive &ar,
+                                              const unsigned int version)
+{
+  std::atomic<size_t> archiveNumKeys(0);
+  size_t archiveCapacity = 0;
+  std::vector<std::map<KeyType, size_t>> counts;
+  std::vector<std::map<KeyType, size_t>> word2Int;
+  bool initialized = false;
+  ar &archiveNumKeys &vocabSize &archiveCapacity &counts &word2Int
+     &initialized &finalized;
+
+  // Keys with ids go in id order, then the rest.  The archive has no
+  // errors, so the counts are taken as exact.
+  std::vector<std::pair<size_t, KeyType>> ids;
+  for (auto const& bucket : word2Int) {
+    for (auto const& id : bucket) ids.push_back(std::make_pair(id.second,
+                                                               id.first));
+  }
+  std::sort(ids.begin(), ids.end());
+
+  merged.clear();
+  for (auto const& id : ids) {
+    size_t index = hash(id.second) % archiveCapacity;
+    merged.push_back(Counter { id.second, counts[index][id.second], 0 });
+  }
+  for (size_t i = 0; i < archiveCapacity; i++) {
+    for (auto const& count : counts[i]) {
+      if (word2Int[i].count(count.first) == 0) {
+        merged.push_back(Counter { count.first, count.second, 0 });
+      }
+    }
+  }
+  buildLookup();
+}
+
+}
+
+#endif
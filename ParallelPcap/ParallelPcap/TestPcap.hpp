@@ -4,12 +4,19 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <memory>
+#include <cstring>
 #include <ParallelPcap/Pcap.hpp>
+#include <ParallelPcap/PcapStream.hpp>
 #include <ParallelPcap/CountDictionary.hpp>
+#include <ParallelPcap/FlatCountDictionary.hpp>
+#include <ParallelPcap/MappedDictionary.hpp>
 #include <ParallelPcap/Packet2Vec.hpp>
+#include <ParallelPcap/TokenTable.hpp>
 #include <ParallelPcap/DARPA2009.hpp>
 #include <ParallelPcap/Util.hpp>
 #include <boost/archive/text_iarchive.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/python.hpp>
 #include <boost/python/numpy.hpp>
 #include <boost/serialization/map.hpp>
@@ -21,18 +28,40 @@ namespace np = boost::python::numpy;
 
 namespace parallel_pcap {
 
-// Dictionary type
-typedef CountDictionary<std::string, StringHashFunction> DictionaryType;
+// Dictionary types
+typedef FlatCountDictionary<std::string, StringHashFunction> DictionaryType;
+typedef FlatCountDictionary<uint64_t, PackedNgramHashFunction> 
+  PackedDictionaryType;
+typedef MappedDictionary<std::string, StringHashFunction> 
+  MappedDictionaryType;
+typedef MappedDictionary<uint64_t, PackedNgramHashFunction> 
+  PackedMappedDictionaryType;
 
 class TestPcap {
 
 private:
-  /// Mapping from keys to the assigned integer key.
+  /// Mapping from keys to the assigned integer key.  ReadPcap writes a
+  /// dictionary of packed keys when all of the ngram sizes fit in them, so
+  /// only one of these is used.
   DictionaryType _d;
+  PackedDictionaryType _packedD;
+
+  /// The dictionary when dictPath is a binary dictionary file
+  /// (dict/dictionary.ids) instead of an archive.  Mapped, not read, and
+  /// shared between copies of the TestPcap.  Used instead of _d/_packedD.
+  std::shared_ptr<MappedDictionaryType> _mappedD;
+  std::shared_ptr<PackedMappedDictionaryType> _packedMappedD;
+
+  /// True if the ngrams are packed (_packedD is used).
+  bool _packed;
 
   /// This holds the list of ngram sizes that we want to compute
   bp::list _ngrams;
 
+  /// The ngram sizes, read out of _ngrams once so that the threads that
+  /// process files don't touch the Python list.
+  std::vector<size_t> _ngramSizes;
+
   /// This holds the ndarray containing the embeddings
   np::ndarray _embeddings;
 
@@ -45,11 +74,27 @@ private:
   /// This holds the current label matrix 
   np::ndarray _labels;
 
+  /// The label matrices of the files of the last featureVectors() call.
+  bp::list _labelList;
+
+  /// What processing a file on its own thread makes, before it is copied
+  /// into numpy arrays by the thread that holds the GIL.
+  struct FileFeatures
+  {
+    /// A row of features for each packet.
+    std::vector<float> features;
+
+    /// A label for each packet.
+    std::vector<float> labels;
+  };
+
 public:
   /**
    * Constructor. Initializes the required data to generate feature vectors.
    * Also restores the CountDictionary saved on disk from ReadPcap.
-   * \param dictPath A path to the dictionary archive.
+   * \param dictPath A path to the dictionary archive (dict/dictionary.bin)
+   *                 or the binary dictionary file (dict/dictionary.ids),
+   *                 which opens much faster.
    * \param embeddings A numpy array that has the embeddings.
    * \param ngrams A python list of ngrams to generate.
    */
@@ -59,12 +104,36 @@ public:
     bp::list &ngrams,
     std::string darpafile,
     bool debug
-  ) : _d(0), _ngrams(ngrams), _embeddings(embeddings), _darpa(DARPA2009(darpafile)), 
+  ) : _d(0), _packedD(0), _ngrams(ngrams), _embeddings(embeddings), _darpa(DARPA2009(darpafile)), 
       _labels(np::array(p::list())), _msg(debug) { 
+    std::vector<size_t>& ngramSizes = this->_ngramSizes;
+    for (size_t i = 0; i < bp::len(this->_ngrams); ++i) {
+      ngramSizes.push_back(bp::extract<size_t>(this->_ngrams[i]));
+    }
+    this->_packed = canPackNgrams(ngramSizes);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    if (MappedDictionaryType::isMappedDictionary(dictPath)) {
+      if (this->_packed) {
+        this->_packedMappedD.reset(new PackedMappedDictionaryType(dictPath));
+      } else {
+        this->_mappedD.reset(new MappedDictionaryType(dictPath));
+      }
+      auto t2 = std::chrono::high_resolution_clock::now();
+      this->_msg.printDuration("TestPcap: Time to map dictionary: ", t1, t2);
+      return;
+    }
+
     // Restore the dictionary
     std::ifstream ifs(dictPath);
     ba::text_iarchive ar(ifs);
-    ar >> this->_d;
+    if (this->_packed) {
+      ar >> this->_packedD;
+    } else {
+      ar >> this->_d;
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("TestPcap: Time to load dictionary: ", t1, t2);
   }
 
   ~TestPcap() { }
@@ -81,55 +150,223 @@ public:
    *        vector representing the supplied packet.
    */
   np::ndarray featureVector(std::string file) {
-    // Create Pcap object
     auto time_everything1 = std::chrono::high_resolution_clock::now();
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-    //this->_pcap = Pcap(file);
-    Pcap pcap(file);
-    auto t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("TestPcap::featureVector: Time to create pcap object: ", 
-                  t1, t2);
+    np::ndarray features = np::array(p::list());
 
-    // Print number of packets
-    this->_msg.printMessage("Num packets: " + std::to_string(pcap.getNumPackets()));
+    if (globalMemoryLimit > 0) {
+      // Read the file a window at a time and stack the results.
+      uint64_t windowSize = 
+        PcapStream::windowSizeForMemoryLimit(globalMemoryLimit);
+      PcapStream stream(file, windowSize);
+      PacketTable batch;
+      p::list featureBatches;
+      p::list labelBatches;
+      while (stream.nextBatch(batch)) {
+        featureBatches.append(this->batchFeatures(batch));
+        labelBatches.append(
+          Packet2Vec::translateY(batch, this->_darpa, this->_msg.isDebug()));
+      }
+      this->_msg.printMessage("Num packets: " + 
+                              std::to_string(stream.getNumPacketsRead()));
 
-    std::vector<std::vector<std::string>> ngramVector;
-    typedef std::vector<std::string> OutputType;
+      if (p::len(featureBatches) > 0) {
+        p::object numpy = p::import("numpy");
+        features = p::extract<np::ndarray>(
+          numpy.attr("concatenate")(featureBatches));
+        this->_labels = p::extract<np::ndarray>(
+          numpy.attr("concatenate")(labelBatches));
+      } else {
+        this->_labels = np::array(p::list());
+      }
+    } else {
+      // Create Pcap object
+      auto t1 = std::chrono::high_resolution_clock::now();
+      Pcap pcap(file);
+      auto t2 = std::chrono::high_resolution_clock::now();
+      this->_msg.printDuration("TestPcap::featureVector: Time to create pcap object: ", 
+                    t1, t2);
 
-    t1 = std::chrono::high_resolution_clock::now();
-    // Calculate ngrams
-    for (size_t i = 0; i < bp::len(this->_ngrams); ++i) {
-      size_t ngram = bp::extract<size_t>(this->_ngrams[i]);
+      // Print number of packets
+      this->_msg.printMessage("Num packets: " + std::to_string(pcap.getNumPackets()));
 
-      NgramOperator ngramOperator(ngram);
-      pcap.applyOperator<NgramOperator, OutputType>(ngramOperator,
-                                                      ngramVector);
+      features = this->batchFeatures(pcap.getPacketTable());
+      this->_labels = Packet2Vec::translateY(pcap, this->_darpa, this->_msg.isDebug());  
     }
-    t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("TestPcap::featureVector: Time to create ngram: ", t1, t2);
 
-    // create final vector
-    t1 = std::chrono::high_resolution_clock::now();
-    std::vector<std::vector<size_t>> vvtranslated = 
-      this->_d.translate(ngramVector);
-    t2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("TestPcap::featureVector: Time to translate: ", t1, t2);
+    auto time_everything2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("TestPcap::featureVector: Time for everything: ", 
+     time_everything1, time_everything2);
+
+    return features;
+  }
+
+  /**
+   * Returns the feature vectors of several raw pcap files, in the order of
+   * the files, as calling featureVector() on each of them would.  With
+   * globalFileParallelism, the files are processed at once, one on each
+   * thread and largest first, and each file's packets are read with its
+   * thread's share of globalMemoryLimit.
+   * \param files A python list of paths to raw pcap files.
+   * \param Returns a python list with a numpy array for each file.
+   */
+  bp::list featureVectors(bp::list files) {
+    bp::list features;
+    this->_labelList = bp::list();
+    if (!globalFileParallelism) {
+      for (size_t i = 0; i < bp::len(files); ++i) {
+        features.append(this->featureVector(bp::extract<std::string>(files[i])));
+        this->_labelList.append(this->_labels);
+      }
+      return features;
+    }
+
+    auto time_everything1 = std::chrono::high_resolution_clock::now();
+    std::vector<std::string> paths;
+    std::vector<uint64_t> sizes;
+    for (size_t i = 0; i < bp::len(files); ++i) {
+      paths.push_back(bp::extract<std::string>(files[i]));
+      sizes.push_back(boost::filesystem::file_size(paths.back()));
+    }
+
+    int numColumns = this->_embeddings.shape(1);
+    float const *embeddings = 
+      reinterpret_cast<float const *>(this->_embeddings.get_data());
+    uint64_t memoryLimit = globalMemoryLimit / globalNumThreads;
+
+    std::vector<FileFeatures> results(paths.size());
+    parallelForLargestFirst(sizes, [this, &paths, &results, embeddings,
+                                    numColumns, memoryLimit]
+      (size_t threadId, size_t i)
+    {
+      this->fileFeatures(paths[i], embeddings, numColumns, memoryLimit,
+                         results[i]);
+    });
+
+    for (FileFeatures& result : results) {
+      size_t numPackets = result.labels.size();
+      np::ndarray X = np::zeros(p::make_tuple(numPackets, numColumns),
+                                np::dtype::get_builtin<float>());
+      std::memcpy(X.get_data(), result.features.data(),
+                  result.features.size() * sizeof(float));
+      np::ndarray y = np::zeros(p::make_tuple(numPackets),
+                                np::dtype::get_builtin<float>());
+      std::memcpy(y.get_data(), result.labels.data(),
+                  result.labels.size() * sizeof(float));
+      features.append(X);
+      this->_labelList.append(y);
+      result = FileFeatures();
+    }
+
+    auto time_everything2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("TestPcap::featureVectors: Time for everything: ", 
+     time_everything1, time_everything2);
+
+    return features;
+  }
+
+  /**
+   * Returns the label matrices of the files of the last featureVectors()
+   * call, in the order of the files.
+   */
+  bp::list labelVectors() {
+    return this->_labelList;
+  }
+
+private:
+  /**
+   * Makes the features and labels of a file without touching any Python
+   * objects, so that it can run on any thread.
+   * \param file A path to the raw pcap file.
+   * \param embeddings The embeddings, numColumns floats per id.
+   * \param memoryLimit When nonzero, the file is read a window at a time
+   *                    in about this much memory.
+   * \param result Gets the features and labels.
+   */
+  void fileFeatures(std::string const& file, float const *embeddings,
+                    int numColumns, uint64_t memoryLimit,
+                    FileFeatures& result)
+  {
+    auto addPackets = [this, embeddings, numColumns, &result]
+      (PacketTable const& packets)
+    {
+      if (packets.size() == 0) return;
+      TokenTable tokens;
+      this->translateBatch(packets, tokens);
+
+      size_t first = result.labels.size();
+      result.features.resize((first + packets.size()) * numColumns);
+      Packet2Vec::averageEmbeddings(&result.features[first * numColumns],
+                                    embeddings, numColumns, tokens);
+      result.labels.resize(first + packets.size());
+      Packet2Vec::labelPackets(packets, this->_darpa, &result.labels[first]);
+    };
+
+    if (memoryLimit > 0) {
+      PcapStream stream(file, 
+        PcapStream::windowSizeForMemoryLimit(memoryLimit));
+      PacketTable batch;
+      while (stream.nextBatch(batch)) {
+        addPackets(batch);
+      }
+    } else {
+      Pcap pcap(file);
+      addPackets(pcap.getPacketTable());
+    }
+    this->_msg.printMessage(file + ": Num packets: " + 
+                            std::to_string(result.labels.size()));
+  }
+
+  /**
+   * Translates the ngrams of a set of packets to ids.
+   * \param packets The packets to translate.
+   * \param tokens Set to the ids of the ngrams of each packet.
+   */
+  void translateBatch(PacketTable const& packets, TokenTable& tokens) {
+    if (this->_packedMappedD) {
+      this->translateBatch(packets, *this->_packedMappedD, tokens);
+    } else if (this->_mappedD) {
+      this->translateBatch(packets, *this->_mappedD, tokens);
+    } else if (this->_packed) {
+      this->translateBatch(packets, this->_packedD, tokens);
+    } else {
+      this->translateBatch(packets, this->_d, tokens);
+    }
+  }
+
+  template <typename Dictionary>
+  void translateBatch(PacketTable const& packets, Dictionary const& d,
+                      TokenTable& tokens) {
+    typedef typename Dictionary::key_type KeyType;
+    typedef typename NgramTraits<KeyType>::Operator Operator;
+    std::vector<Operator> operators;
+    for (size_t ngram : this->_ngramSizes) {
+      operators.push_back(Operator(ngram));
+    }
+    tokens.translatePackets(packets, operators, d);
+  }
+
+  /**
+   * Returns the feature vectors of a set of packets.
+   * \param packets The packets to featurize.
+   */
+  np::ndarray batchFeatures(PacketTable const& packets) {
+    // Ngram and translate the packets in one go
+    auto t1 = std::chrono::high_resolution_clock::now();
+    TokenTable tokens;
+    this->translateBatch(packets, tokens);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    this->_msg.printDuration("TestPcap::featureVector: Time to ngram and translate: ", t1, t2);
 
     t1 = std::chrono::high_resolution_clock::now();
     np::ndarray features = Packet2Vec::translateX(
       this->_embeddings,
-      vvtranslated,
+      tokens,
       this->_msg.isDebug()
     );
     t2 = std::chrono::high_resolution_clock::now();
     this->_msg.printDuration("TestPcap::featureVector: Time to create features: ", t1, t2);
 
-    auto time_everything2 = std::chrono::high_resolution_clock::now();
-    this->_msg.printDuration("TestPcap::featureVector: Time for everything: ", 
-     time_everything1, time_everything2);
-    this->_labels = Packet2Vec::translateY(pcap, this->_darpa, this->_msg.isDebug());  
-
     return features;
   }
 };
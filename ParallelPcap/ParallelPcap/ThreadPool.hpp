@@ -0,0 +1,277 @@
+#ifndef PARALLELPCAP_THREAD_POOL_HPP
+#define PARALLELPCAP_THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <chrono>
+
+namespace parallel_pcap {
+
+/**
+ * A set of worker threads that are started once and reused by every
+ * parallel loop, instead of each loop starting and joining its own
+ * threads.  parallelFor(numTasks, f) calls f(0), ..., f(numTasks - 1),
+ * each exactly once, on the workers and the calling thread, and returns
+ * when all of the calls have.  A task can be given any number of tasks;
+ * the loops of this library give it one per thread, and use the task
+ * number as the thread id.
+ *
+ * One loop runs on the workers at a time.  A parallelFor called while
+ * another thread's loop is running waits for it to finish, so threads
+ * that each run a stage of a pipeline take turns with the workers.  One
+ * called from inside a task runs its tasks one after another on the
+ * calling thread.
+ *
+ * The pool adds up how long each of its threads spends running tasks, so
+ * that loops that leave some threads idle while others work can be
+ * spotted.
+ */
+class ThreadPool
+{
+public:
+  ThreadPool() {}
+
+  ~ThreadPool() { this->resize(1); }
+
+  ThreadPool(ThreadPool const&) = delete;
+  ThreadPool& operator=(ThreadPool const&) = delete;
+
+  /**
+   * Sets how many threads run the tasks of a loop: the calling thread
+   * and numThreads - 1 workers.  Waits for a running loop to finish.
+   */
+  void resize(size_t numThreads);
+
+  /**
+   * Returns how many threads run the tasks of a loop.
+   */
+  size_t getNumThreads() const { return workers.size() + 1; }
+
+  /**
+   * Runs f(0), ..., f(numTasks - 1) and waits for them.  If any of them
+   * throws, the first exception is rethrown once all of them are done.
+   * \param numTasks The number of tasks.
+   * \param f A callable taking the task number (a size_t).
+   */
+  template <typename Function>
+  void parallelFor(size_t numTasks, Function f);
+
+  /**
+   * Returns true on a thread that is running a task of a loop, where
+   * further loops run their tasks one after another.
+   */
+  static bool isInTask() { return inLoop(); }
+
+  /**
+   * Returns how many tasks all of the loops so far have had.
+   */
+  size_t getNumTasksDispatched() const { return numTasksDispatched; }
+
+  /**
+   * Returns how many loops have run so far.
+   */
+  size_t getNumLoops() const { return numLoops; }
+
+  /**
+   * Returns how long each thread has spent running tasks since the pool
+   * was last resized: the threads that start loops (together) first, then
+   * each of the workers.
+   */
+  std::vector<double> getBusySeconds() const;
+
+private:
+  std::vector<std::thread> workers;
+
+  /// Held for the whole of a loop run on the workers, and by resize().
+  std::mutex loopMutex;
+
+  /// Guards the members below it, up to the counters.
+  std::mutex mutex;
+  std::condition_variable loopReady;
+  std::condition_variable loopDone;
+
+  /// The tasks of the current loop.
+  std::function<void(size_t)> const* task = 0;
+  size_t numTasks = 0;
+  std::atomic<size_t> nextTask { 0 };
+
+  /// Changes when a loop starts, so workers can tell a new loop.
+  size_t loopNumber = 0;
+
+  /// The workers that haven't finished the current loop.
+  size_t numBusyWorkers = 0;
+
+  std::exception_ptr error;
+  bool stopping = false;
+
+  std::atomic<size_t> numTasksDispatched { 0 };
+  std::atomic<size_t> numLoops { 0 };
+
+  /// Time spent running tasks by each thread, the starting threads first
+  /// (as one).  Slot 0 is only written while holding loopMutex.
+  std::vector<uint64_t> busyNanos = std::vector<uint64_t>(1, 0);
+
+  /// True on a thread that is running tasks of a loop.
+  static bool& inLoop() {
+    static thread_local bool inLoop = false;
+    return inLoop;
+  }
+
+  /**
+   * Runs the tasks of each loop after lastLoop until the pool stops.
+   * \param workerId The worker's position in busyNanos.
+   */
+  void workerLoop(size_t workerId, size_t lastLoop);
+
+  /**
+   * Runs tasks of the current loop until there are none left, and adds
+   * the time taken to busyNanos[threadIndex].
+   */
+  void runTasks(size_t threadIndex);
+
+  static uint64_t nanosSince(std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - t).count();
+  }
+};
+
+inline
+void ThreadPool::resize(size_t numThreads)
+{
+  std::lock_guard<std::mutex> loopLock(loopMutex);
+  if (numThreads < 1) numThreads = 1;
+  if (numThreads == this->getNumThreads()) return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  loopReady.notify_all();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+
+  stopping = false;
+  busyNanos.assign(numThreads, 0);
+
+  // A worker may not get to run before the next loop starts, so it is
+  // told which loop was the last one here rather than looking itself.
+  for (size_t i = 1; i < numThreads; i++) {
+    workers.push_back(std::thread(&ThreadPool::workerLoop, this, i,
+                                  loopNumber));
+  }
+}
+
+inline
+std::vector<double> ThreadPool::getBusySeconds() const
+{
+  std::vector<double> seconds;
+  for (uint64_t nanos : busyNanos) {
+    seconds.push_back(nanos / 1e9);
+  }
+  return seconds;
+}
+
+template <typename Function>
+void ThreadPool::parallelFor(size_t numTasks, Function f)
+{
+  numTasksDispatched += numTasks;
+  numLoops++;
+
+  if (inLoop()) {
+    for (size_t i = 0; i < numTasks; i++) {
+      f(i);
+    }
+    return;
+  }
+
+  std::unique_lock<std::mutex> loopLock(loopMutex);
+  if (workers.empty() || numTasks < 2) {
+    // The tasks still count as in a loop, so loops they start don't wait
+    // for this one.
+    auto t = std::chrono::steady_clock::now();
+    inLoop() = true;
+    try {
+      for (size_t i = 0; i < numTasks; i++) {
+        f(i);
+      }
+    } catch (...) {
+      inLoop() = false;
+      throw;
+    }
+    inLoop() = false;
+    busyNanos[0] += nanosSince(t);
+    return;
+  }
+
+  std::function<void(size_t)> function(f);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->task = &function;
+    this->numTasks = numTasks;
+    this->nextTask = 0;
+    this->numBusyWorkers = workers.size();
+    this->error = std::exception_ptr();
+    this->loopNumber++;
+  }
+  loopReady.notify_all();
+
+  inLoop() = true;
+  this->runTasks(0);
+  inLoop() = false;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  loopDone.wait(lock, [this] { return this->numBusyWorkers == 0; });
+  this->task = 0;
+  if (this->error) {
+    std::exception_ptr e = this->error;
+    this->error = std::exception_ptr();
+    std::rethrow_exception(e);
+  }
+}
+
+inline
+void ThreadPool::workerLoop(size_t workerId, size_t lastLoop)
+{
+  inLoop() = true;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      loopReady.wait(lock, [this, lastLoop] {
+        return this->stopping || this->loopNumber != lastLoop;
+      });
+      if (this->stopping) return;
+      lastLoop = this->loopNumber;
+    }
+
+    this->runTasks(workerId);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--this->numBusyWorkers == 0) loopDone.notify_one();
+  }
+}
+
+inline
+void ThreadPool::runTasks(size_t threadIndex)
+{
+  auto t = std::chrono::steady_clock::now();
+  for (size_t i = nextTask++; i < numTasks; i = nextTask++) {
+    try {
+      (*task)(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!this->error) this->error = std::current_exception();
+    }
+  }
+  busyNanos[threadIndex] += nanosSince(t);
+}
+
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef PARALLELPCAP_TOKEN_STORE_HPP
+#define PARALLELPCAP_TOKEN_STORE_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <ParallelPcap/TokenTable.hpp>
+#include <ParallelPcap/MappedFile.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The exception type generated by the token store classes.
+ */
+class TokenStoreException : public std::runtime_error {
+public:
+  TokenStoreException(char const* message) : std::runtime_error(message) {}
+  TokenStoreException(std::string message) : std::runtime_error(message) {}
+};
+
+/**
+ * The fixed size header at the start of a token store file.  It is written
+ * and read as is, in the byte order of the machine.
+ */
+struct TokenStoreHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrderMark;
+
+  uint64_t numPackets;
+  uint64_t numTokens;
+
+  /// The size of each id: 2 (uint16) or 4 (uint32).
+  uint32_t idBytes;
+  uint32_t reserved;
+
+  /// Where the ids and the offsets start, in bytes from the start of the
+  /// file.
+  uint64_t idsPos;
+  uint64_t offsetsPos;
+};
+
+static_assert(sizeof(TokenStoreHeader) == 56,
+              "TokenStoreHeader must not have padding");
+
+namespace details {
+
+inline char const* tokenStoreMagic() { return "PPTOKCSR"; }
+
+const uint32_t TOKEN_STORE_VERSION = 1;
+const uint32_t TOKEN_STORE_BYTE_ORDER_MARK = 0x01020304;
+
+}
+
+/**
+ * Writes a token store: the dictionary ids of the ngrams of each packet of
+ * a capture (the intVectorVector), in compressed sparse row form that
+ * TokenStore can memory map and numpy can read with np.memmap.
+ *
+ * The file is
+ *   - a TokenStoreHeader,
+ *   - the ids of all of the packets, in order, as uint16 when every id of
+ *     the dictionary fits in one and as uint32 otherwise, padded to a
+ *     multiple of 8 bytes,
+ *   - numPackets + 1 offsets (uint64): the ids of packet i are ids
+ *     offsets[i] up to offsets[i + 1].
+ *
+ * The ids are written as the tables are added, so they are written front
+ * to back and only the offsets (8 bytes a packet) are kept until finish().
+ * The header is written last; a store that was never finished has a zeroed
+ * header and won't open.
+ */
+class TokenStoreWriter
+{
+public:
+  /**
+   * \param filename The path of the store.  An existing file is replaced.
+   * \param maxId The largest id that can be written, which sets the size
+   *              of the ids.
+   */
+  TokenStoreWriter(std::string const& filename, uint64_t maxId);
+
+  TokenStoreWriter(TokenStoreWriter const& other) = delete;
+  TokenStoreWriter& operator=(TokenStoreWriter const& other) = delete;
+
+  /**
+   * Adds the packets of a table to the end of the store.  Can be called
+   * once with all of a capture's packets or once per batch.
+   */
+  void write(TokenTable const& tokens);
+
+  /**
+   * Writes the offsets and the header, and closes the file.
+   */
+  void finish();
+
+private:
+  std::string filename;
+  std::ofstream stream;
+
+  /// Where the ids of each packet start, plus the end of the last one.
+  std::vector<uint64_t> offsets = std::vector<uint64_t>(1, 0);
+
+  uint32_t idBytes;
+
+  /// The ids of a table, narrowed for writing.
+  std::vector<uint16_t> buffer16;
+  std::vector<uint32_t> buffer32;
+
+  template <typename Id>
+  void writeIds(std::vector<size_t> const& ids, std::vector<Id>& buffer);
+
+  void check() const;
+};
+
+/**
+ * The packets of a TokenStore with ids of type Id, with the accessors of
+ * TokenTable.  Points into the store's mapping.
+ */
+template <typename Id>
+class TokenStoreRows
+{
+public:
+  TokenStoreRows(Id const* ids, uint64_t const* offsets, size_t numPackets)
+    : ids(ids), offsets(offsets), numPackets(numPackets) {}
+
+  size_t size() const { return numPackets; }
+  uint64_t getOffset(size_t i) const { return offsets[i]; }
+  size_t getPacketSize(size_t i) const { return offsets[i + 1] - offsets[i]; }
+  Id const* getPacketIds(size_t i) const { return ids + offsets[i]; }
+
+private:
+  Id const* ids;
+  uint64_t const* offsets;
+  size_t numPackets;
+};
+
+/**
+ * A read-only view of a token store written by TokenStoreWriter.  The file
+ * is memory mapped and the ids are read straight from the mapping, through
+ * getRows() with the id type of the file.
+ */
+class TokenStore
+{
+public:
+  /**
+   * Maps the store and checks its header.  Throws a TokenStoreException if
+   * the file isn't a token store of this version and byte order, or its
+   * size doesn't match the header.
+   * \param filename The path of the store.
+   */
+  TokenStore(std::string const& filename);
+
+  /**
+   * Returns true if the file starts with the token store magic.  Files
+   * written by older versions of ReadPcap (Boost text archives of a
+   * std::vector<std::vector<size_t>>) don't.
+   */
+  static bool isTokenStore(std::string const& filename);
+
+  /**
+   * Returns the number of packets.
+   */
+  size_t size() const { return header.numPackets; }
+
+  uint64_t getNumTokens() const { return header.numTokens; }
+  uint32_t getIdBytes() const { return header.idBytes; }
+  uint64_t getOffset(size_t i) const { return offsets[i]; }
+
+  /**
+   * Returns the number of ids of packet i.
+   */
+  size_t getPacketSize(size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+  /**
+   * Returns the number of ids of the packet with the most.
+   */
+  size_t getMaxPacketSize() const;
+
+  /**
+   * Returns the packets, with their ids as Id.  Throws a
+   * TokenStoreException if Id isn't getIdBytes() bytes.
+   */
+  template <typename Id>
+  TokenStoreRows<Id> getRows() const;
+
+private:
+  std::shared_ptr<MappedFile> mapped;
+  TokenStoreHeader header;
+
+  // Point into the mapping.
+  unsigned char const* ids = 0;
+  uint64_t const* offsets = 0;
+};
+
+inline TokenStoreWriter::TokenStoreWriter(std::string const& filename,
+                                          uint64_t maxId)
+  : filename(filename), stream(filename, std::ios::binary | std::ios::trunc),
+    idBytes(maxId <= std::numeric_limits<uint16_t>::max() ? 
+            sizeof(uint16_t) : sizeof(uint32_t))
+{
+  if (!stream.is_open()) {
+    throw TokenStoreException("Could not open " + filename + " for writing");
+  }
+
+  // Zeros until finish() writes the real header.
+  TokenStoreHeader empty;
+  std::memset(&empty, 0, sizeof(empty));
+  stream.write(reinterpret_cast<char const*>(&empty), sizeof(empty));
+  check();
+}
+
+inline void TokenStoreWriter::write(TokenTable const& tokens)
+{
+  if (idBytes == sizeof(uint16_t)) {
+    writeIds(tokens.getIds(), buffer16);
+  } else {
+    writeIds(tokens.getIds(), buffer32);
+  }
+
+  uint64_t first = offsets.back();
+  for (size_t i = 1; i <= tokens.size(); i++) {
+    offsets.push_back(first + tokens.getOffset(i));
+  }
+  check();
+}
+
+template <typename Id>
+void TokenStoreWriter::writeIds(std::vector<size_t> const& ids,
+                                std::vector<Id>& buffer)
+{
+  buffer.resize(ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (ids[i] > std::numeric_limits<Id>::max()) {
+      throw TokenStoreException("TokenStoreWriter::write: id " +
+        std::to_string(ids[i]) + " is larger than the maximum id");
+    }
+    buffer[i] = ids[i];
+  }
+  writeBinary(buffer, stream);
+}
+
+inline void TokenStoreWriter::finish()
+{
+  uint64_t numTokens = offsets.back();
+  uint64_t idsBytes = numTokens * idBytes;
+  uint64_t padding = ((idsBytes + 7) & ~uint64_t(7)) - idsBytes;
+  stream.write("\0\0\0\0\0\0\0", padding);
+  writeBinary(offsets, stream);
+
+  TokenStoreHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, details::tokenStoreMagic(), sizeof(header.magic));
+  header.version = details::TOKEN_STORE_VERSION;
+  header.byteOrderMark = details::TOKEN_STORE_BYTE_ORDER_MARK;
+  header.numPackets = offsets.size() - 1;
+  header.numTokens = numTokens;
+  header.idBytes = idBytes;
+  header.idsPos = sizeof(header);
+  header.offsetsPos = sizeof(header) + idsBytes + padding;
+
+  stream.seekp(0);
+  stream.write(reinterpret_cast<char const*>(&header), sizeof(header));
+  stream.close();
+  check();
+}
+
+inline void TokenStoreWriter::check() const
+{
+  if (!stream) {
+    throw TokenStoreException("Error writing token store " + filename);
+  }
+}
+
+inline TokenStore::TokenStore(std::string const& filename)
+  : mapped(std::make_shared<MappedFile>(filename))
+{
+  uint64_t fileBytes = mapped->getSize();
+  if (fileBytes < sizeof(header)) {
+    throw TokenStoreException(filename + " is too small to be a token"
+                              " store");
+  }
+  unsigned char const* data = mapped->getData();
+  std::memcpy(&header, data, sizeof(header));
+
+  if (std::memcmp(header.magic, details::tokenStoreMagic(),
+                  sizeof(header.magic)) != 0)
+  {
+    throw TokenStoreException(filename + " is not a token store");
+  }
+  if (header.version != details::TOKEN_STORE_VERSION) {
+    throw TokenStoreException(filename + " is token store version " +
+      std::to_string(header.version) + "; expected version " +
+      std::to_string(details::TOKEN_STORE_VERSION));
+  }
+  if (header.byteOrderMark != details::TOKEN_STORE_BYTE_ORDER_MARK) {
+    throw TokenStoreException(filename + " was written on a machine with"
+                              " a different byte order");
+  }
+
+  if (header.idBytes != sizeof(uint16_t) && 
+      header.idBytes != sizeof(uint32_t))
+  {
+    throw TokenStoreException(filename + " has ids of " +
+      std::to_string(header.idBytes) + " bytes");
+  }
+
+  uint64_t n = header.numPackets;
+  if (header.idsPos != sizeof(header) || header.offsetsPos % 8 != 0 ||
+      header.offsetsPos < header.idsPos || header.offsetsPos > fileBytes ||
+      header.numTokens > (header.offsetsPos - header.idsPos) /
+                         header.idBytes ||
+      n >= (fileBytes - header.offsetsPos) / sizeof(uint64_t) ||
+      header.offsetsPos + (n + 1) * sizeof(uint64_t) != fileBytes)
+  {
+    throw TokenStoreException("The size of " + filename + " doesn't match"
+                              " its header");
+  }
+
+  ids = data + header.idsPos;
+  offsets = reinterpret_cast<uint64_t const*>(data + header.offsetsPos);
+
+  if (offsets[0] != 0 || offsets[n] != header.numTokens) {
+    throw TokenStoreException("The offsets of " + filename + " don't match"
+                              " its header");
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (offsets[i] > offsets[i + 1]) {
+      throw TokenStoreException("Packet " + std::to_string(i) + " of " +
+        filename + " has a negative number of ids");
+    }
+  }
+}
+
+inline bool TokenStore::isTokenStore(std::string const& filename)
+{
+  std::ifstream stream(filename, std::ios::binary);
+  char magic[8];
+  stream.read(magic, sizeof(magic));
+  return stream &&
+         std::memcmp(magic, details::tokenStoreMagic(), sizeof(magic)) == 0;
+}
+
+inline size_t TokenStore::getMaxPacketSize() const
+{
+  size_t largest = 0;
+  for (size_t i = 0; i < size(); i++) {
+    largest = std::max(largest, getPacketSize(i));
+  }
+  return largest;
+}
+
+template <typename Id>
+TokenStoreRows<Id> TokenStore::getRows() const
+{
+  if (sizeof(Id) != header.idBytes) {
+    throw TokenStoreException("TokenStore::getRows: the ids are " +
+      std::to_string(header.idBytes) + " bytes, not " +
+      std::to_string(sizeof(Id)));
+  }
+  return TokenStoreRows<Id>(reinterpret_cast<Id const*>(ids), offsets,
+                            size());
+}
+
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef PARALLELPCAP_TOKEN_TABLE_HPP
+#define PARALLELPCAP_TOKEN_TABLE_HPP
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <ParallelPcap/Util.hpp>
+
+namespace parallel_pcap {
+
+/**
+ * The dictionary ids of the ngrams of a set of packets, in compressed
+ * sparse row form: the ids of packet i are getIds()[getOffset(i)] up to
+ * getIds()[getOffset(i + 1)].  The ids of all the packets together, in
+ * order, are the flat token vector (intVector), and each packet's slice is
+ * its row of the token vectors (intVectorVector).
+ */
+class TokenTable
+{
+private:
+  /// Where the ids of each packet start, plus the end of the last packet.
+  std::vector<uint64_t> offsets = std::vector<uint64_t>(1, 0);
+
+  /// The ids of all of the ngrams of all of the packets.
+  std::vector<size_t> ids;
+
+public:
+  /**
+   * Returns the number of packets.
+   */
+  size_t size() const { return offsets.size() - 1; }
+
+  /**
+   * Returns the number of ids of all of the packets.
+   */
+  uint64_t getNumTokens() const { return ids.size(); }
+
+  uint64_t getOffset(size_t i) const { return offsets[i]; }
+  std::vector<uint64_t> const& getOffsets() const { return offsets; }
+  std::vector<size_t> const& getIds() const { return ids; }
+
+  /**
+   * Returns the number of ids of packet i.
+   */
+  size_t getPacketSize(size_t i) const { return offsets[i + 1] - offsets[i]; }
+
+  /**
+   * Returns the ids of packet i.
+   */
+  size_t const* getPacketIds(size_t i) const {
+    return ids.data() + offsets[i];
+  }
+  size_t* getPacketIds(size_t i) { return ids.data() + offsets[i]; }
+
+  /**
+   * Sets the layout of the table and makes room for the ids, which are
+   * then filled in through getPacketIds().
+   * \param packetOffsets Where the ids of each packet start, plus the end.
+   *                      The first offset is 0.
+   */
+  void setOffsets(std::vector<uint64_t> const& packetOffsets);
+
+  /**
+   * Ngrams the packets and translates the ngrams to dictionary ids, writing
+   * the ids straight into the table.  The ngrams are never stored: each
+   * thread ngrams one packet at a time.
+   * \param packets The packets (a PacketTable or PacketStore).
+   * \param operators The ngram operators, applied to each packet in order.
+   * \param d The finalized dictionary.
+   */
+  template <typename Packets, typename Operator, typename Dictionary>
+  void translatePackets(Packets const& packets,
+                        std::vector<Operator> const& operators,
+                        Dictionary const& d);
+};
+
+inline void TokenTable::setOffsets(std::vector<uint64_t> const& packetOffsets)
+{
+  offsets = packetOffsets;
+  if (offsets.empty()) offsets.push_back(0);
+  ids.resize(offsets.back());
+}
+
+template <typename Packets, typename Operator, typename Dictionary>
+void TokenTable::translatePackets(Packets const& packets,
+                                  std::vector<Operator> const& operators,
+                                  Dictionary const& d)
+{
+  size_t numThreads = globalNumThreads;
+  size_t numPackets = packets.size();
+
+  // Lay out the table from the number of ngrams of each packet.
+  offsets.assign(numPackets + 1, 0);
+  auto countFunction = [this, &packets, &operators, numPackets,
+                        numThreads](size_t threadId)
+  {
+    size_t beg = getBeginIndex(numPackets, threadId, numThreads);
+    size_t end = getEndIndex(numPackets, threadId, numThreads);
+
+    for (size_t i = beg; i < end; i++) {
+      uint64_t numNgrams = 0;
+      for (Operator const& op : operators) {
+        numNgrams += op.numNgrams(packets.getPacket(i));
+      }
+      this->offsets[i + 1] = numNgrams;
+    }
+  };
+
+  parallelFor(numThreads, countFunction);
+
+  for (size_t i = 0; i < numPackets; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+  ids.resize(offsets.back());
+
+  // The threads take chunks of about the same number of ngrams as they go,
+  // since the packets' numbers of ngrams vary by orders of magnitude.
+  ChunkSchedule schedule(numPackets, numThreads,
+    [this](size_t i) -> uint64_t { return this->getPacketSize(i); });
+
+  std::atomic<bool> mismatch(false);
+  auto translateFunction = [this, &packets, &operators, &d, &mismatch,
+                            &schedule](size_t threadId)
+  {
+    std::vector<typename Dictionary::key_type> ngrams;
+    size_t beg, end;
+    while (schedule.next(beg, end)) {
+      for (size_t i = beg; i < end; i++) {
+        ngrams.clear();
+        for (Operator const& op : operators) {
+          op(packets.getPacket(i), ngrams);
+        }
+        if (ngrams.size() != this->getPacketSize(i)) {
+          mismatch = true;
+          return;
+        }
+
+        size_t* packetIds = this->getPacketIds(i);
+        for (size_t j = 0; j < ngrams.size(); j++) {
+          packetIds[j] = d.getWord2Int(ngrams[j]);
+        }
+      }
+    }
+  };
+
+  parallelFor(numThreads, translateFunction);
+
+  if (mismatch) {
+    throw std::logic_error("TokenTable::translatePackets: an ngram operator"
+      " made a different number of ngrams than its numNgrams()");
+  }
+}
+
+}
+
+#endif
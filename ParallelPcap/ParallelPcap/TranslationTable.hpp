@@ -0,0 +1,106 @@
+#ifndef PARALLELPCAP_TRANSLATION_TABLE_HPP
+#define PARALLELPCAP_TRANSLATION_TABLE_HPP
+
+#include <vector>
+#include <utility>
+
+namespace parallel_pcap {
+
+/**
+ * A read-only map from the keys that have ids to their ids, made once a
+ * dictionary is finalized.  The keys and ids sit together in one flat
+ * open-addressing table at most half full, so a lookup is a hash and a
+ * short linear probe over adjacent entries: no locks, no allocation, and
+ * usually one cache line.  Keys without ids, which most of the ngrams of
+ * new traffic are, stop at the first empty entry.
+ */
+template <typename KeyType, typename HF>
+class TranslationTable
+{
+public:
+  static const size_t UNK = 0;
+
+  /**
+   * Makes the table, replacing what it had.
+   * \param entries The keys and their ids.  The ids are not UNK.
+   */
+  void build(std::vector<std::pair<KeyType, size_t>> const& entries);
+
+  /**
+   * Returns the id of the key, or UNK if it doesn't have one.
+   */
+  size_t lookup(KeyType const& key) const {
+    if (numEntries == 0) return UNK;
+    for (size_t i = firstSlot(key); ; i = (i + 1) & mask) {
+      Entry const& entry = slots[i];
+      if (entry.id == UNK) return UNK;
+      if (entry.key == key) return entry.id;
+    }
+  }
+
+  /**
+   * Returns the number of keys with ids.
+   */
+  size_t size() const { return numEntries; }
+
+  /**
+   * Returns the keys and their ids, in no particular order.
+   */
+  std::vector<std::pair<KeyType, size_t>> getEntries() const {
+    std::vector<std::pair<KeyType, size_t>> entries;
+    entries.reserve(numEntries);
+    for (Entry const& entry : slots) {
+      if (entry.id != UNK) entries.push_back(std::make_pair(entry.key,
+                                                            entry.id));
+    }
+    return entries;
+  }
+
+private:
+  struct Entry
+  {
+    KeyType key;
+    size_t id;
+  };
+
+  HF hash;
+
+  /// A power of two of entries, at least twice numEntries.  Empty entries
+  /// have the UNK id.
+  std::vector<Entry> slots;
+  size_t mask = 0;
+  int shift = 64;
+  size_t numEntries = 0;
+
+  size_t firstSlot(KeyType const& key) const {
+    return (hash(key) * 0x9e3779b97f4a7c15ULL) >> shift & mask;
+  }
+};
+
+template <typename KeyType, typename HF>
+void TranslationTable<KeyType, HF>::build(
+  std::vector<std::pair<KeyType, size_t>> const& entries)
+{
+  size_t size = 2;
+  int bits = 1;
+  while (size < 2 * entries.size()) {
+    size *= 2;
+    bits++;
+  }
+
+  slots.assign(size, Entry { KeyType(), UNK });
+  mask = size - 1;
+  shift = 64 - bits;
+  numEntries = entries.size();
+
+  for (auto const& entry : entries) {
+    size_t i = firstSlot(entry.first);
+    while (slots[i].id != UNK) i = (i + 1) & mask;
+    slots[i].key = entry.first;
+    slots[i].id = entry.second;
+  }
+}
+
+}
+
+#endif
@@ -9,9 +9,15 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <algorithm>
+#include <sys/resource.h>
+#include <unistd.h>
 #include <boost/serialization/serialization.hpp>
 #include <boost/serialization/version.hpp>
 #include <boost/serialization/split_free.hpp>
+#include <boost/serialization/collection_size_type.hpp>
+#include <boost/serialization/item_version_type.hpp>
+#include <ParallelPcap/ThreadPool.hpp>
 
 
 class Messenger
@@ -23,6 +29,7 @@ class Messenger
     void printDuration(std::string message, TimeType const& t1, TimeType const& t2) 
     {
       if (this->_debug) {
+        std::lock_guard<std::mutex> lock(outputMutex());
         std::cout << message 
           << static_cast<double>(std::chrono::duration_cast
               <std::chrono::milliseconds>(t2-t1).count()) / 1000
@@ -32,16 +39,38 @@ class Messenger
 
     void printMessage(std::string message) {
       if (this->_debug) {
+        std::lock_guard<std::mutex> lock(outputMutex());
         std::cout << message << std::endl;
       }
     }
 
+    /**
+     * Prints the most memory the process has used so far.
+     */
+    void printPeakMemory(std::string message) {
+      if (this->_debug) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        std::lock_guard<std::mutex> lock(outputMutex());
+        // ru_maxrss is in kilobytes on Linux.
+        std::cout << message 
+          << static_cast<double>(usage.ru_maxrss) / 1024
+          << " MB" << std::endl;
+      }
+    }
+
     bool isDebug(void) {
       return this->_debug;
     }
   
   private:
     bool _debug;
+
+    /// Keeps the lines of threads that print at once from interleaving.
+    static std::mutex& outputMutex() {
+      static std::mutex mutex;
+      return mutex;
+    }
 };
 
 
@@ -68,11 +97,193 @@ auto t2 = std::chrono::high_resolution_clock::now();
 /// Global variable indicating how many threads to use in for loops.
 size_t globalNumThreads = 1;
 
+/// The threads that run the parallel loops, globalNumThreads of them
+/// counting the thread that starts a loop.
+parallel_pcap::ThreadPool globalThreadPool;
+
 /**
- * Sets the globalNumThreads variable.
+ * Sets the globalNumThreads variable, and starts or stops workers of the
+ * globalThreadPool to match.
  */
 void setGlobalNumThreads(size_t t) {
   globalNumThreads = t;
+  globalThreadPool.resize(t);
+}
+
+/**
+ * Runs f(0), ..., f(numTasks - 1) on the globalThreadPool and waits for
+ * them.  Loops over getBeginIndex()/getEndIndex() shares pass the number
+ * of shares as numTasks and take the task number as the thread id.
+ */
+template <typename Function>
+void parallelFor(size_t numTasks, Function f) {
+  globalThreadPool.parallelFor(numTasks, f);
+}
+
+/**
+ * Returns how many threads a parallel loop started on this thread runs
+ * on: globalNumThreads, or 1 inside a task of another loop, where loops
+ * run their tasks one after another.  Loops that keep state for each of
+ * their threads size it by this.
+ */
+size_t getLoopThreads() {
+  return parallel_pcap::ThreadPool::isInTask() ? 1 : globalNumThreads;
+}
+
+/**
+ * Calls f(threadId, i) once for each item i, on globalNumThreads threads
+ * that each take the largest item left when they are free, so that the
+ * last items to finish are small ones.  Items of the same size are taken
+ * in index order.  Loops started by f run on its thread alone.
+ * \param sizes The size of each item, e.g. of each file in bytes.
+ * \param f A callable taking the thread id and the item index (size_ts).
+ */
+template <typename Function>
+void parallelForLargestFirst(std::vector<uint64_t> const& sizes, Function f)
+{
+  std::vector<size_t> order(sizes.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+    [&sizes](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+  std::atomic<size_t> next(0);
+  parallelFor(globalNumThreads, [&order, &next, &f](size_t threadId) {
+    for (size_t k = next++; k < order.size(); k = next++) {
+      f(threadId, order[k]);
+    }
+  });
+}
+
+/// Global variable bounding how much memory (in bytes) processing a pcap
+/// file should use.  0 means no limit: whole files are read at once.
+size_t globalMemoryLimit = 0;
+
+/**
+ * Sets the globalMemoryLimit variable.
+ */
+void setGlobalMemoryLimit(size_t bytes) {
+  globalMemoryLimit = bytes;
+}
+
+/**
+ * Returns the size of the machine's physical memory in bytes, or 0 if it
+ * can't be found.
+ */
+uint64_t getPhysicalMemory() {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long pageSize = sysconf(_SC_PAGE_SIZE);
+  if (pages <= 0 || pageSize <= 0) return 0;
+  return static_cast<uint64_t>(pages) * static_cast<uint64_t>(pageSize);
+}
+
+/// Global variable bounding how much memory (in bytes) ReadPcap's
+/// dictionary may use to count ngrams.  When nonzero, ngrams that don't fit
+/// a dense dictionary are counted approximately in that much memory (see
+/// SpaceSavingDictionary).  0 means the counts are exact.
+size_t globalDictionaryMemory = 0;
+
+/**
+ * Sets the globalDictionaryMemory variable.
+ */
+void setGlobalDictionaryMemory(size_t bytes) {
+  globalDictionaryMemory = bytes;
+}
+
+/// Global variable indicating how many items (whole files, or windows
+/// when streaming) may wait between the stages of ReadPcap's pipeline:
+/// reading, counting or translating, and writing.  0 runs the stages one
+/// after another.
+size_t globalPipelineDepth = 0;
+
+/**
+ * Sets the globalPipelineDepth variable.
+ */
+void setGlobalPipelineDepth(size_t depth) {
+  globalPipelineDepth = depth;
+}
+
+/// Global variable indicating whether ReadPcap and TestPcap process
+/// several whole files at once, one on each thread, instead of one file at
+/// a time with all of the threads.
+bool globalFileParallelism = false;
+
+/**
+ * Sets the globalFileParallelism variable.
+ */
+void setGlobalFileParallelism(bool parallel) {
+  globalFileParallelism = parallel;
+}
+
+/// Global variables for building the dictionary with several processes.
+/// With globalNumShards > 0, ReadPcap only counts shard globalShardIndex
+/// of the files (file i, in name order, is in shard i % globalNumShards)
+/// and saves its counts.  With globalMergeShards as well, it instead
+/// merges the saved counts of all of the shards and translates every file.
+size_t globalNumShards = 0;
+size_t globalShardIndex = 0;
+bool globalMergeShards = false;
+
+/**
+ * Sets the globalShardIndex and globalNumShards variables.
+ */
+void setGlobalShard(size_t index, size_t numShards) {
+  globalShardIndex = index;
+  globalNumShards = numShards;
+}
+
+/**
+ * Sets the globalMergeShards variable.
+ */
+void setGlobalMergeShards(bool merge) {
+  globalMergeShards = merge;
+}
+
+/// Global variable indicating whether Pcap should keep a packet index of
+/// each capture file (see PacketIndex.hpp).
+bool globalPacketIndex = false;
+
+/**
+ * Sets the globalPacketIndex variable.
+ */
+void setGlobalPacketIndex(bool useIndex) {
+  globalPacketIndex = useIndex;
+}
+
+/// Global variable with the directory the packet indexes are kept in.
+/// Empty means next to each capture file.
+std::string globalPacketIndexDir = "";
+
+/**
+ * Sets the globalPacketIndexDir variable.
+ */
+void setGlobalPacketIndexDir(std::string indexDir) {
+  globalPacketIndexDir = indexDir;
+}
+
+/// Global variable indicating whether ReadPcap should spill the ngrams of
+/// each file in its first pass, so that the second pass translates the
+/// spill instead of reading and ngramming the file again.
+bool globalSpillNgrams = false;
+
+/**
+ * Sets the globalSpillNgrams variable.
+ */
+void setGlobalSpillNgrams(bool spill) {
+  globalSpillNgrams = spill;
+}
+
+/// Global variable indicating whether the hashed dictionary counts into
+/// per-thread shards that are merged afterwards, instead of having all of
+/// the threads count into the shared table (see FlatCountDictionary).
+bool globalShardedCounting = false;
+
+/**
+ * Sets the globalShardedCounting variable.
+ */
+void setGlobalShardedCounting(bool sharded) {
+  globalShardedCounting = sharded;
 }
 
 /**
@@ -110,6 +321,78 @@ uint64_t getEndIndex(uint64_t num_elements,
  
 }
 
+/**
+ * Hands out the elements [0, num_elements) to the threads of a parallel
+ * loop a chunk at a time, instead of one getBeginIndex()/getEndIndex()
+ * share per thread, so that a thread that gets the cheap elements goes on
+ * to take more of them rather than idling while the others finish.  The
+ * chunks are cut to be of about the same weight (e.g. the bytes of the
+ * packets in them), CHUNKS_PER_THREAD of them per thread.
+ */
+class ChunkSchedule
+{
+public:
+  static const size_t CHUNKS_PER_THREAD = 16;
+
+  /**
+   * Cuts chunks of about the same weight.
+   * \param weight A callable returning the weight (a uint64_t) of element
+   *               i.
+   */
+  template <typename Weight>
+  ChunkSchedule(size_t numElements, size_t numThreads, Weight weight);
+
+  /**
+   * Claims the next chunk for the calling thread.  Returns false once all
+   * of the chunks are claimed.
+   * \param beg Gets the first element of the chunk.
+   * \param end Gets one past the last element of the chunk.
+   */
+  bool next(size_t& beg, size_t& end) {
+    size_t chunk = nextChunk++;
+    if (chunk + 1 >= bounds.size()) return false;
+    beg = bounds[chunk];
+    end = bounds[chunk + 1];
+    return true;
+  }
+
+  size_t getNumChunks() const { return bounds.size() - 1; }
+
+private:
+  /// Chunk i is [bounds[i], bounds[i + 1]).
+  std::vector<size_t> bounds;
+  std::atomic<size_t> nextChunk { 0 };
+};
+
+template <typename Weight>
+ChunkSchedule::ChunkSchedule(size_t numElements, size_t numThreads,
+                             Weight weight)
+{
+  if (numThreads <= 1) {
+    bounds.push_back(0);
+    bounds.push_back(numElements);
+    return;
+  }
+
+  uint64_t totalWeight = 0;
+  for (size_t i = 0; i < numElements; i++) {
+    totalWeight += weight(i);
+  }
+  uint64_t chunkWeight = std::max<uint64_t>(1,
+    totalWeight / (numThreads * CHUNKS_PER_THREAD));
+
+  bounds.push_back(0);
+  uint64_t weightSoFar = 0;
+  for (size_t i = 0; i < numElements; i++) {
+    weightSoFar += weight(i);
+    if (weightSoFar >= chunkWeight) {
+      bounds.push_back(i + 1);
+      weightSoFar = 0;
+    }
+  }
+  if (bounds.back() != numElements) bounds.push_back(numElements);
+}
+
 
 inline
 uint64_t hashFunction(std::string const& key)
@@ -132,6 +415,26 @@ public:
   }
 };
 
+/**
+ * Hashes ngrams packed into integers (see PackedNgramOperator).  The keys
+ * are small and mostly differ in their low bytes, so the bits are mixed
+ * (the splitmix64 finalizer) before the hash is taken modulo the table
+ * size.
+ */
+class PackedNgramHashFunction
+{
+public:
+  inline
+  uint64_t operator()(uint64_t key) const {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+  }
+};
+
 class StringEqualityFunction
 {
 public:
@@ -156,8 +459,7 @@ std::vector<KeyType> flatten(std::vector<std::vector<KeyType>> const& vec)
   std::vector<KeyType> rvec;
 
   size_t numThreads = globalNumThreads;
-  std::thread* threads = new std::thread[numThreads];  
-  
+
   // First we get the total number of ngrams so that we can allocate
   // the vector to be of that size.
   std::atomic<uint64_t> totalNumNgrams( 0 );  
@@ -176,11 +478,7 @@ std::vector<KeyType> flatten(std::vector<std::vector<KeyType>> const& vec)
     totalNumNgrams.fetch_add(localCount);
   };
 
-  for(size_t i = 0; i < numThreads; i++) { 
-    threads[i] = std::thread(countFunction, i);
-  }
-
-  for(size_t i = 0; i < numThreads; i++) { threads[i].join(); }
+  parallelFor(numThreads, countFunction);
   DETAIL_TIMING_END("flatten: Time to count ngrams: ");
 
   
@@ -212,17 +510,84 @@ std::vector<KeyType> flatten(std::vector<std::vector<KeyType>> const& vec)
     }
   };
 
-  for(size_t i = 0; i < numThreads; i++) { 
-    threads[i] = std::thread(flattenFunction, i);
-  }
-  for(size_t i = 0; i < numThreads; i++) { threads[i].join(); }
-
-  delete[] threads;
+  parallelFor(numThreads, flattenFunction);
   DETAIL_TIMING_END("flatten: Time to fill up rvec: ")
 
   return rvec;
 }
 
+/**
+ * Returns the k first items under less, in order, without ordering the
+ * rest.  Each thread selects and sorts the k first items of its share
+ * (std::nth_element, then std::sort), and the sorted shares are merged
+ * up to k items.  When less is a strict total order (no two items are
+ * equivalent), the result is the same for any number of threads.
+ *
+ * \param items The items.  Reordered.
+ * \param k How many items to return.
+ * \param less The order.
+ */
+template <typename T, typename Less>
+std::vector<T> parallelTopK(std::vector<T>& items, size_t k, Less less)
+{
+  k = std::min(k, items.size());
+  size_t numThreads = std::max<size_t>(1, 
+    std::min<size_t>(globalNumThreads, items.size()));
+
+  // The sorted k first items of each thread's share are at
+  // [getBeginIndex(), runEnds[threadId]).
+  std::vector<size_t> runEnds(numThreads);
+  auto selectFunction = [&items, &runEnds, &less, k, numThreads]
+    (size_t threadId)
+  {
+    uint64_t beg = getBeginIndex(items.size(), threadId, numThreads);
+    uint64_t end = getEndIndex(items.size(), threadId, numThreads);
+
+    size_t runEnd = beg + std::min<size_t>(k, end - beg);
+    if (runEnd < end) {
+      std::nth_element(items.begin() + beg, items.begin() + runEnd,
+                       items.begin() + end, less);
+    }
+    std::sort(items.begin() + beg, items.begin() + runEnd, less);
+    runEnds[threadId] = runEnd;
+  };
+
+  parallelFor(numThreads, selectFunction);
+
+  std::vector<size_t> next(numThreads);
+  for (size_t i = 0; i < numThreads; i++) {
+    next[i] = getBeginIndex(items.size(), i, numThreads);
+  }
+
+  std::vector<T> top;
+  top.reserve(k);
+  while (top.size() < k) {
+    size_t first = numThreads;
+    for (size_t i = 0; i < numThreads; i++) {
+      if (next[i] < runEnds[i] &&
+          (first == numThreads || less(items[next[i]], items[next[first]])))
+      {
+        first = i;
+      }
+    }
+    top.push_back(items[next[first]]);
+    next[first]++;
+  }
+  return top;
+}
+
+/**
+ * Takes a vector and appends it in binary form to a stream.
+ *
+ * \param v The vector to be written.
+ * \param stream The stream to write to.
+ */
+template <typename T>
+void writeBinary(std::vector<T> const& v, std::ostream& stream)
+{
+  stream.write(reinterpret_cast<char const*>(v.data()), v.size() * sizeof(T));
+}
+
 /**
  * Takes a vector and writes it in binary form to a file.
  *
@@ -230,16 +595,11 @@ std::vector<KeyType> flatten(std::vector<std::vector<KeyType>> const& vec)
  * \param path Where the file should be written.
  */
 template <typename T>
-void writeBinary(std::vector<T> v, std::string path)
+void writeBinary(std::vector<T> const& v, std::string path)
 {
   std::ofstream stream;
   stream.open(path, std::ios::binary);
-
-  for ( T item : v )
-  {
-    stream.write(reinterpret_cast<char*>(&item), sizeof(item));
-  }
-  
+  writeBinary(v, stream);
   stream.close();
 }
 
@@ -20,7 +20,9 @@ BOOST_PYTHON_MODULE(parallelpcap)
   Py_Initialize();
   boost::python::numpy::initialize();
 
-  class_<Pcap>("Pcap", init<std::string>())
+  class_<Pcap, boost::noncopyable>("Pcap", init<std::string>())
+    .def(init<std::string, bool>())
+    .def(init<std::string, uint64_t, uint64_t>())
     .def("getNumPackets", &Pcap::getNumPackets)
     .def("applyNgramOperator", &Pcap::applyNgramOperator)
   ;
@@ -31,6 +33,16 @@ BOOST_PYTHON_MODULE(parallelpcap)
   def("flatten", flatten<std::string>);
 
   def("setParallelPcapThreads", setGlobalNumThreads);
+  def("setParallelPcapMemoryLimit", setGlobalMemoryLimit);
+  def("setParallelPcapPacketIndex", setGlobalPacketIndex);
+  def("setParallelPcapPacketIndexDir", setGlobalPacketIndexDir);
+  def("setParallelPcapSpillNgrams", setGlobalSpillNgrams);
+  def("setParallelPcapShardedCounting", setGlobalShardedCounting);
+  def("setParallelPcapDictionaryMemory", setGlobalDictionaryMemory);
+  def("setParallelPcapShard", setGlobalShard);
+  def("setParallelPcapMergeShards", setGlobalMergeShards);
+  def("setParallelPcapPipelineDepth", setGlobalPipelineDepth);
+  def("setParallelPcapFileParallelism", setGlobalFileParallelism);
 
   class_<PacketHeader>("PacketHeader", 
     init<uint32_t, uint32_t, uint32_t, uint32_t>())
@@ -69,6 +81,8 @@ BOOST_PYTHON_MODULE(parallelpcap)
     init<std::string, numpy::ndarray&, list&, std::string, bool>())
       .def("featureVector", &TestPcap::featureVector)
       .def("labelVector", &TestPcap::labelVector)
+      .def("featureVectors", &TestPcap::featureVectors)
+      .def("labelVectors", &TestPcap::labelVectors)
   ;
 
 }
@@ -13,7 +13,8 @@ from sklearn.metrics import (roc_auc_score, confusion_matrix, f1_score,
   average_precision_score, auc, precision_recall_curve, roc_curve)
 from sklearn.kernel_approximation import RBFSampler
 
-def test_classifier(output_dir, data_dir, test_data, classifier, darpafile, num_threads=1):
+def test_classifier(output_dir, data_dir, test_data, classifier, darpafile, num_threads=1,
+                    memory_limit=0, packet_index=False, file_parallelism=False):
     """
     Tests binary classifiers on a set of raw pcaps.
 
@@ -33,6 +34,15 @@ def test_classifier(output_dir, data_dir, test_data, classifier, darpafile, num_
     num_threads : int
         Number of threads ParallelPcap will use when creating feature
         vectors
+    memory_limit : int
+        Approximate number of bytes of memory ParallelPcap may use when
+        reading a pcap file. 0 means no limit.
+    packet_index : bool
+        Whether ParallelPcap keeps a packet index of each pcap file in
+        <data_dir>/index/ and uses it to skip parsing on later runs.
+    file_parallelism : bool
+        When true, ParallelPcap makes the feature vectors of num_threads
+        pcap files at once, one file on each thread.
     """
     classifier_type = classifier.split('/')[-1].split('.')[0]
     report_file = os.path.join(output_dir, '{}_test_report.txt'.format(classifier_type))
@@ -51,6 +61,10 @@ def test_classifier(output_dir, data_dir, test_data, classifier, darpafile, num_
     all_bin_preds = []
 
     parallelpcap.setParallelPcapThreads(num_threads)
+    parallelpcap.setParallelPcapMemoryLimit(memory_limit)
+    parallelpcap.setParallelPcapPacketIndex(packet_index)
+    parallelpcap.setParallelPcapPacketIndexDir(os.path.join(data_dir, 'index'))
+    parallelpcap.setParallelPcapFileParallelism(file_parallelism)
 
     # Loading the embeddings
     final_embeddings = load_features(data_dir)
@@ -58,19 +72,32 @@ def test_classifier(output_dir, data_dir, test_data, classifier, darpafile, num_
     # Loading the classifier
     clf = joblib.load(classifier)
 
-    # Loading the dictionary
-    testpcap = parallelpcap.TestPcap(os.path.join(data_dir, 'dict/dictionary.bin'), 
+    # Loading the dictionary.  The binary dictionary file is mapped instead
+    # of parsed, when ReadPcap wrote one.
+    dict_path = os.path.join(data_dir, 'dict/dictionary.ids')
+    if not os.path.exists(dict_path):
+        dict_path = os.path.join(data_dir, 'dict/dictionary.bin')
+    testpcap = parallelpcap.TestPcap(dict_path, 
                                      final_embeddings, [2], darpafile, False)
 
     test_files = [os.path.join(test_data, f) for f in os.listdir(test_data)]
 
-    for i, f in enumerate(test_files):
+    # The files are featurized a group at a time.  When they are processed
+    # at once, a group has a few files for each thread, so that starting
+    # the largest first can even out the threads' work.
+    group_size = 4 * num_threads if file_parallelism else 1
+    groups = [test_files[i:i + group_size]
+              for i in range(0, len(test_files), group_size)]
+
+    def file_features():
+        for group in groups:
+            for f, X, y in zip(group, testpcap.featureVectors(group),
+                               testpcap.labelVectors()):
+                yield f, X, y
+
+    for i, (f, X, y) in enumerate(file_features()):
         if (i + 1) % 10 == 0:
             print("Testing on file {} of {}".format(i + 1, len(test_files)))
-        
-        # Grab data
-        X = testpcap.featureVector(f)
-        y = testpcap.labelVector()
 
         y_hat = clf.predict_proba(X)[:,1]
         y_hat_bin = clf.predict(X)
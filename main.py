@@ -36,7 +36,19 @@ def tokens(args):
         pp.main(args['train_data'], args['working'], 
                 num_threads=args['options']['threads'],
                 ngram=[args['hyperparameters']['ngram']],
-                vocab_size=args['hyperparameters']['vocab_size'])
+                vocab_size=args['hyperparameters']['vocab_size'],
+                memory_limit=args['options'].get('memory_limit', 0),
+                packet_index=args['options'].get('packet_index', False),
+                spill_ngrams=args['options'].get('spill_ngrams', False),
+                sharded_counting=args['options'].get('sharded_counting',
+                                                     False),
+                dictionary_memory=args['options'].get('dictionary_memory',
+                                                      0),
+                num_shards=args['options'].get('num_shards', 0),
+                shard=args['options'].get('shard', 0),
+                pipeline_depth=args['options'].get('pipeline_depth', 0),
+                file_parallelism=args['options'].get('file_parallelism',
+                                                     False))
 
 def embeddings(args):
     """
@@ -92,7 +104,11 @@ def classifiers(args):
                 clf = os.path.join(args['working'], 'classifiers', 'rfc.joblib')
                 test.test_classifier(args['working'], args['working'], 
                                      args['test_data'], clf, args['darpa'], 
-                                     args['options']['threads'])
+                                     args['options']['threads'],
+                                     args['options'].get('memory_limit', 0),
+                                     args['options'].get('packet_index', False),
+                                     args['options'].get('file_parallelism',
+                                                         False))
 
 
         if 'gnb' in args['classifiers']:
@@ -103,7 +119,11 @@ def classifiers(args):
                 clf = os.path.join(args['working'], 'classifiers', 'gnb.joblib')
                 test.test_classifier(args['working'], args['working'], 
                                      args['test_data'], clf, args['darpa'], 
-                                     args['options']['threads'])
+                                     args['options']['threads'],
+                                     args['options'].get('memory_limit', 0),
+                                     args['options'].get('packet_index', False),
+                                     args['options'].get('file_parallelism',
+                                                         False))
 
 
 def run(args):
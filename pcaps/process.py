@@ -1,13 +1,18 @@
+import os
 import parallelpcap
 from common import timer
 
-def main(pcap_path, output_dir, num_threads=1, ngram=[2], vocab_size=50000):
+def main(pcap_path, output_dir, num_threads=1, ngram=[2], vocab_size=50000,
+         memory_limit=0, packet_index=False, spill_ngrams=False,
+         sharded_counting=False, dictionary_memory=0, num_shards=0,
+         shard=0, pipeline_depth=0, file_parallelism=False):
     """
     Uses the ParallelPcap library to generate the pcap binaries, 
     dictionary archive, and token vector files. Two different 
     token vector files are generated. 1D vectors of integers 
     (intVector) and 2D vectors of integers (intVectorVector)
-    indexed by packet.
+    indexed by packet. The intVectorVector files can be loaded with
+    pcaps.tokens.load_token_vectors.
 
     Parameters
     ----------
@@ -24,9 +29,69 @@ def main(pcap_path, output_dir, num_threads=1, ngram=[2], vocab_size=50000):
         the dictionary generation
     vocab_size : int
         Size of the dictionary vocabulary
+    memory_limit : int
+        Approximate number of bytes of memory ParallelPcap may use.
+        When nonzero, pcap files are read a window at a time instead
+        of all at once. 0 means no limit.
+    packet_index : bool
+        When true, a packet index of each pcap file is kept in
+        <output_dir>/index/<file>.<hash>.ppidx, where <hash> is a hash
+        of the file's full path, and later runs load the packet
+        boundaries from it instead of parsing the file.
+    spill_ngrams : bool
+        When true, the ngrams of each pcap file are written to a
+        compact spill while the dictionary is counted, and the token
+        vectors are made from the spill instead of reading and
+        ngramming the pcap files a second time.
+    sharded_counting : bool
+        When true, each thread counts ngrams into private tables
+        that are merged into the dictionary afterwards, instead of
+        all threads counting into the shared dictionary.
+    dictionary_memory : int
+        Approximate number of bytes the dictionary may use to count
+        ngrams. When nonzero, ngrams are counted approximately in
+        that much memory and the error bounds of the vocabulary are
+        written to dict/dictionary_bounds.txt. 0 means exact counts.
+    num_shards : int
+        When nonzero, the dictionary is built by num_shards runs
+        over the same output directory, each counting every
+        num_shards-th pcap file (in name order) and saving its
+        counts in dict/shards/, and then one merging run.
+        0 means a single run counts all files.
+    shard : int or str
+        Which shard this run counts, from 0 to num_shards - 1, or
+        'merge' for the run that merges the saved counts and makes
+        the dictionary and token vectors.
+    pipeline_depth : int
+        When nonzero, reading the next pcap files (or windows) and
+        writing the results of the previous ones overlap with
+        counting and translating the current one, with up to
+        pipeline_depth of them waiting between the steps. Without
+        memory_limit, whole files are only read ahead while they are
+        estimated to fit in physical memory. 0 means the steps run
+        one after another.
+    file_parallelism : bool
+        When true, num_threads pcap files are processed at once, one
+        on each thread and the largest first, instead of one file at
+        a time with all of the threads.
     """
 
     parallelpcap.setParallelPcapThreads(num_threads)
+    parallelpcap.setParallelPcapMemoryLimit(memory_limit)
+    parallelpcap.setParallelPcapPacketIndex(packet_index)
+    parallelpcap.setParallelPcapPacketIndexDir(os.path.join(output_dir,
+                                                            'index'))
+    parallelpcap.setParallelPcapSpillNgrams(spill_ngrams)
+    parallelpcap.setParallelPcapShardedCounting(sharded_counting)
+    parallelpcap.setParallelPcapDictionaryMemory(dictionary_memory)
+    if shard == 'merge':
+        parallelpcap.setParallelPcapShard(0, num_shards)
+        parallelpcap.setParallelPcapMergeShards(True)
+    else:
+        parallelpcap.setParallelPcapShard(shard, num_shards)
+        parallelpcap.setParallelPcapMergeShards(False)
+    parallelpcap.setParallelPcapPipelineDepth(pipeline_depth)
+    parallelpcap.setParallelPcapFileParallelism(file_parallelism)
     parallelpcap.ReadPcap(
         pcap_path,
         ngram,
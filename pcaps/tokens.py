@@ -0,0 +1,64 @@
+import numpy as np
+
+# The header of an intVectorVector token store, as written by
+# TokenStoreWriter (ParallelPcap/TokenStore.hpp) in the byte order of the
+# machine that ran ParallelPcap.
+TOKEN_STORE_MAGIC = b'PPTOKCSR'
+TOKEN_STORE_VERSION = 1
+TOKEN_STORE_BYTE_ORDER_MARK = 0x01020304
+TOKEN_STORE_HEADER = np.dtype([
+    ('magic', 'S8'),
+    ('version', '=u4'),
+    ('byte_order_mark', '=u4'),
+    ('num_packets', '=u8'),
+    ('num_tokens', '=u8'),
+    ('id_bytes', '=u4'),
+    ('reserved', '=u4'),
+    ('ids_pos', '=u8'),
+    ('offsets_pos', '=u8'),
+])
+
+def load_token_vectors(path):
+    """
+    Memory maps the token vectors of each packet (an intVectorVector
+    file) without going through ParallelPcap. The ids of packet i are
+    ids[offsets[i]:offsets[i + 1]], which is the layout of a
+    scipy.sparse.csr_matrix's indptr and indices.
+
+    Parameters
+    ----------
+    path : str
+        Path to an intVectorVector file
+    Returns
+    -------
+    offsets : numpy.memmap
+        num_packets + 1 uint64 offsets into ids
+    ids : numpy.memmap
+        The ids of all of the packets, in order, as uint16 or uint32
+    """
+    header = np.fromfile(path, dtype=TOKEN_STORE_HEADER, count=1)
+    if len(header) != 1 or header['magic'][0] != TOKEN_STORE_MAGIC:
+        raise ValueError(f"{path} is not a token store")
+    header = header[0]
+    if header['version'] != TOKEN_STORE_VERSION:
+        raise ValueError(f"{path} is token store version " +
+                         f"{header['version']}; expected version " +
+                         f"{TOKEN_STORE_VERSION}")
+    if header['byte_order_mark'] != TOKEN_STORE_BYTE_ORDER_MARK:
+        raise ValueError(f"{path} was written on a machine with a " +
+                         "different byte order")
+
+    id_type = {2: np.uint16, 4: np.uint32}[int(header['id_bytes'])]
+    num_packets = int(header['num_packets'])
+    num_tokens = int(header['num_tokens'])
+
+    # np.memmap can't map zero elements.
+    if num_tokens > 0:
+        ids = np.memmap(path, dtype=id_type, mode='r',
+                        offset=int(header['ids_pos']), shape=(num_tokens,))
+    else:
+        ids = np.zeros(0, dtype=id_type)
+    offsets = np.memmap(path, dtype=np.uint64, mode='r',
+                        offset=int(header['offsets_pos']),
+                        shape=(num_packets + 1,))
+    return offsets, ids